@@ -0,0 +1,566 @@
+// Benchmarks the table core directly, without Node or N-API in the way.
+// Each scenario fills a fresh segment, starts reader and writer processes
+// that attach to it like separate services would, and reports throughput
+// and latency percentiles from every operation's TSC timing. Workers are
+// forked on POSIX; on Windows the benchmark runs itself again with
+// --worker=N, and the worker reads its scenario from a named mapping.
+//
+//   node-gyp rebuild --benchmarks=true && build/Release/table_bench
+//   build/Release/table_bench --sweep=contention --dist=zipf --duration=2000
+//
+// Sweeps (--sweep=load|hit|value|dist|contention|batch|all, default all)
+// vary one dimension from a baseline that the other flags set: --load=0.75
+// --hit=0.9 --value=64 --dist=uniform|zipf --readers=1 --writers=0
+// --batch=1 --probing=linear|robinhood --slots=262144 --duration=500 (ms).
+// Readers with --batch above 1 look keys up through PipelineLookups, as
+// mget does. Read latency is always per lookup: with batches, the time
+// each key's resolve step takes once its prefetches were issued.
+// --read=mutex|seqlock|readonly picks how readers attach; readonly maps
+// the segment PROT_READ, as createCache({readOnly: true}) does.
+
+#include "../src/shm_table.h"
+
+#ifndef _WIN32
+  #include <sys/wait.h>
+#endif
+#include <random>
+
+using namespace fast_shm;
+
+const char* const BENCH_SEGMENT = "/fast_shm_table_bench";
+const size_t OP_STREAM_SIZE = 1 << 16;  // precomputed operations per worker, replayed
+const double ZIPF_EXPONENT = 0.99;
+const size_t MAX_WORKERS = 64;
+const char* const RESULTS_MAPPING = "fast_shm_table_bench_results";    // Windows only
+
+// Latencies in ns: 16 linear buckets per power of two, so a percentile
+// is within about 6% of the real value
+struct Histogram {
+    static const size_t SUB_BUCKETS = 16;
+    static const size_t NUM_BUCKETS = 64 * SUB_BUCKETS;
+    uint64_t counts[NUM_BUCKETS];
+    uint64_t total;
+    
+    static size_t BucketFor(uint64_t ns) {
+        if (ns < SUB_BUCKETS) {
+            return static_cast<size_t>(ns);
+        }
+        uint32_t exponent = Log2(ns);
+        size_t sub = static_cast<size_t>(ns >> (exponent - 4)) & (SUB_BUCKETS - 1);
+        return (exponent - 3) * SUB_BUCKETS + sub;
+    }
+    
+    // Middle of the bucket
+    static double ValueOf(size_t bucket) {
+        if (bucket < SUB_BUCKETS) {
+            return static_cast<double>(bucket);
+        }
+        uint32_t exponent = static_cast<uint32_t>(bucket / SUB_BUCKETS) + 3;
+        double low = std::ldexp(static_cast<double>(SUB_BUCKETS + bucket % SUB_BUCKETS), exponent - 4);
+        return low + std::ldexp(0.5, exponent - 4);
+    }
+    
+    void Record(uint64_t ns) {
+        counts[BucketFor(ns)]++;
+        total++;
+    }
+    
+    void Merge(const Histogram& other) {
+        for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+            counts[i] += other.counts[i];
+        }
+        total += other.total;
+    }
+    
+    double Percentile(double fraction) const {
+        uint64_t rank = static_cast<uint64_t>(std::ceil(fraction * total));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < NUM_BUCKETS; ++i) {
+            seen += counts[i];
+            if (seen >= rank && seen > 0) {
+                return ValueOf(i);
+            }
+        }
+        return 0;
+    }
+};
+
+struct Scenario {
+    const char* sweep;
+    double load;                        // entries / slots
+    double hit;                         // share of reads whose key exists
+    size_t value;                       // value bytes
+    bool zipf;
+    size_t readers;
+    size_t writers;
+    size_t batch;                       // keys per reader lookup batch
+    ReadMode read_mode;                 // readers'; writers take the lock
+    bool read_only;                     // readers map the segment PROT_READ
+    Probing probing;
+    size_t slots;
+    uint32_t duration_ms;
+};
+
+// What each worker reports back, in a mapping shared with the parent
+struct WorkerResult {
+    Histogram latency;
+    uint64_t ops;
+    bool writer;
+};
+
+struct SharedResults {
+    Scenario scenario;                  // what the workers run
+    double ticks_per_ns;
+    std::atomic<uint32_t> ready;
+    std::atomic<uint32_t> start;
+    WorkerResult workers[MAX_WORKERS];
+};
+
+#ifdef _WIN32
+typedef HANDLE WorkerProcess;
+static HANDLE results_mapping = NULL;
+#else
+typedef pid_t WorkerProcess;
+#endif
+
+struct Op {
+    std::string key;
+    uint64_t hash;
+};
+
+static std::string KeyFor(const char* prefix, size_t i) {
+    char key[32];
+    snprintf(key, sizeof(key), "%s:%010zu", prefix, i);
+    return key;
+}
+
+// Key indexes drawn uniformly or from a Zipf distribution over count keys
+class KeyChooser {
+public:
+    KeyChooser(size_t count, bool zipf, uint64_t seed) : count_(count), zipf_(zipf), rng_(seed) {
+        if (zipf_) {
+            cdf_.resize(count_);
+            double sum = 0;
+            for (size_t i = 0; i < count_; ++i) {
+                sum += 1.0 / std::pow(static_cast<double>(i + 1), ZIPF_EXPONENT);
+                cdf_[i] = sum;
+            }
+            for (double& p : cdf_) {
+                p /= sum;
+            }
+        }
+    }
+    
+    size_t Next() {
+        if (!zipf_) {
+            return static_cast<size_t>(rng_() % count_);
+        }
+        double u = std::uniform_real_distribution<double>(0, 1)(rng_);
+        return std::min(count_ - 1, static_cast<size_t>(std::lower_bound(cdf_.begin(), cdf_.end(), u) - cdf_.begin()));
+    }
+    
+    double Uniform() { return std::uniform_real_distribution<double>(0, 1)(rng_); }
+
+private:
+    size_t count_;
+    bool zipf_;
+    std::mt19937_64 rng_;
+    std::vector<double> cdf_;
+};
+
+static size_t FillCount(const Scenario& scenario) {
+    return std::max<size_t>(1, static_cast<size_t>(scenario.load * scenario.slots));
+}
+
+static double CalibrateTicksPerNs() {
+    uint64_t ns = SteadyNs();
+    uint64_t ticks = ReadTicks();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    return static_cast<double>(ReadTicks() - ticks) / (SteadyNs() - ns);
+}
+
+// Runs in a worker process: attaches, waits for the start signal, then
+// replays its operation stream until the duration is up
+static void RunWorker(size_t worker, SharedResults* results) {
+    const Scenario& scenario = results->scenario;
+    bool writer = worker >= scenario.readers;
+    double ticks_per_ns = results->ticks_per_ns;
+    ResetLockOwner();
+    HandleStats stats;
+    HandleOptions options = {writer ? READ_MODE_MUTEX : scenario.read_mode, false, false,
+                             !writer && scenario.read_only, DEFAULT_LOCK_TIMEOUT_MS, &stats};
+    ShmTable table(options);
+    if (!table.Attach(BENCH_SEGMENT)) {
+        fprintf(stderr, "worker %zu: attach failed: %s\n", worker, strerror(errno));
+        _exit(1);
+    }
+    
+    // Writers overwrite existing keys; readers miss with probability 1 - hit
+    size_t fill = FillCount(scenario);
+    KeyChooser chooser(fill, scenario.zipf, 0x9e3779b97f4a7c15ULL * (worker + 1));
+    std::vector<Op> ops(OP_STREAM_SIZE);
+    std::vector<uint64_t> hashes(OP_STREAM_SIZE);
+    for (size_t i = 0; i < OP_STREAM_SIZE; ++i) {
+        bool hit = writer || chooser.Uniform() < scenario.hit;
+        ops[i].key = hit ? KeyFor("key", chooser.Next()) : KeyFor("miss", chooser.Next());
+        ops[i].hash = WyHash(ops[i].key.data(), ops[i].key.size());
+        hashes[i] = ops[i].hash;
+    }
+    std::string value(scenario.value, 'v');
+    std::vector<char> buffer(scenario.value);
+    
+    WorkerResult& result = results->workers[worker];
+    result.writer = writer;
+    results->ready.fetch_add(1);
+    while (results->start.load() == 0) {
+        std::this_thread::yield();
+    }
+    
+    uint64_t end = SteadyNs() + static_cast<uint64_t>(scenario.duration_ms) * 1000000;
+    uint64_t count = 0;
+    size_t batch = writer ? 1 : scenario.batch;
+    while (batch > 1) {
+        for (size_t i = 0; i < 1024; i += batch, count += batch) {
+            size_t first = count % (OP_STREAM_SIZE - OP_STREAM_SIZE % batch);
+            PipelineLookups(&hashes[first], batch, [&](uint64_t) { return &table; }, [&](size_t i) {
+                uint32_t length;
+                uint64_t started = ReadTicks();
+                table.LoadValue(ops[first + i].key, ops[first + i].hash, buffer.data(), buffer.size(), &length);
+                result.latency.Record(static_cast<uint64_t>((ReadTicks() - started) / ticks_per_ns));
+            });
+        }
+        if (SteadyNs() >= end) {
+            result.ops = count;
+            _exit(0);
+        }
+    }
+    for (;;) {
+        for (size_t i = 0; i < 1024; ++i, ++count) {
+            const Op& op = ops[count & (OP_STREAM_SIZE - 1)];
+            uint64_t started = ReadTicks();
+            if (writer) {
+                table.StoreValue(op.key, op.hash, value.data(), value.size(), 0, false, nullptr);
+            } else {
+                uint32_t length;
+                table.LoadValue(op.key, op.hash, buffer.data(), buffer.size(), &length);
+            }
+            result.latency.Record(static_cast<uint64_t>((ReadTicks() - started) / ticks_per_ns));
+        }
+        if (SteadyNs() >= end) {
+            break;
+        }
+    }
+    result.ops = count;
+    _exit(0);
+}
+
+// The mapping workers report into: anonymous and inherited by fork on
+// POSIX, named on Windows so that a started worker can open it
+static SharedResults* MapResults(bool create) {
+#ifdef _WIN32
+    results_mapping = create ? CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+                                                  static_cast<DWORD>(sizeof(SharedResults)), RESULTS_MAPPING)
+                             : OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, RESULTS_MAPPING);
+    if (!results_mapping) {
+        return nullptr;
+    }
+    void* mapping = MapViewOfFile(results_mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(SharedResults));
+    if (!mapping) {
+        CloseHandle(results_mapping);
+        return nullptr;
+    }
+#else
+    (void)create;
+    void* mapping = mmap(NULL, sizeof(SharedResults), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        return nullptr;
+    }
+#endif
+    return create ? new (mapping) SharedResults() : static_cast<SharedResults*>(mapping);
+}
+
+static void UnmapResults(SharedResults* results) {
+#ifdef _WIN32
+    UnmapViewOfFile(results);
+    CloseHandle(results_mapping);
+#else
+    munmap(results, sizeof(SharedResults));
+#endif
+}
+
+static bool StartWorker(size_t worker, SharedResults* results, WorkerProcess* process) {
+#ifdef _WIN32
+    (void)results;
+    char path[MAX_PATH];
+    DWORD length = GetModuleFileNameA(NULL, path, MAX_PATH);
+    if (length == 0 || length >= MAX_PATH) {
+        return false;
+    }
+    std::string command = "\"" + std::string(path, length) + "\" --worker=" + std::to_string(worker);
+    STARTUPINFOA startup = {};
+    startup.cb = sizeof(startup);
+    PROCESS_INFORMATION info;
+    if (!CreateProcessA(path, &command[0], NULL, NULL, FALSE, 0, NULL, NULL, &startup, &info)) {
+        return false;
+    }
+    CloseHandle(info.hThread);
+    *process = info.hProcess;
+    return true;
+#else
+    pid_t pid = fork();
+    if (pid == 0) {
+        RunWorker(worker, results);
+    }
+    *process = pid;
+    return pid > 0;
+#endif
+}
+
+// True if the worker exited cleanly
+static bool WaitWorker(WorkerProcess process) {
+#ifdef _WIN32
+    DWORD code = 1;
+    WaitForSingleObject(process, INFINITE);
+    GetExitCodeProcess(process, &code);
+    CloseHandle(process);
+    return code == 0;
+#else
+    int status;
+    return waitpid(process, &status, 0) == process && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#endif
+}
+
+static void PrintHeader() {
+    printf("%-10s %5s %4s %6s %-7s %3s %3s %3s %9s | %24s | %24s\n", "sweep", "load", "hit", "value", "dist", "R",
+           "W", "B", "Mops/s", "lookup p50/p99/p999 ns", "write p50/p99/p999 ns");
+}
+
+static void PrintLatency(const Histogram& latency) {
+    if (latency.total == 0) {
+        printf(" %24s", "-");
+        return;
+    }
+    char cell[64];
+    snprintf(cell, sizeof(cell), "%.0f/%.0f/%.0f", latency.Percentile(0.5), latency.Percentile(0.99),
+             latency.Percentile(0.999));
+    printf(" %24s", cell);
+}
+
+static bool RunScenario(const Scenario& scenario, double ticks_per_ns) {
+    ShmTable::Unlink(BENCH_SEGMENT, false);
+    
+    size_t fill = FillCount(scenario);
+    HandleStats stats;
+    HandleOptions options = {READ_MODE_MUTEX, false, false, false, DEFAULT_LOCK_TIMEOUT_MS, &stats};
+    TableConfig config;
+    config.max_keys = scenario.slots - 1;
+    config.max_value_size = scenario.value;
+    config.arena_size = AlignUp((fill + 1) * (ARENA_ALIGN << SizeClassFor(scenario.value)) + ARENA_ALIGN,
+                                CACHE_LINE_SIZE);
+    config.eviction = EVICTION_NONE;
+    config.probing = scenario.probing;
+    config.value_type = VALUE_STRING;
+    config.num_shards = 1;
+    config.numa_node = -1;
+    config.huge_pages = HUGE_PAGES_NONE;
+    
+    std::unique_ptr<ShmTable> table(new ShmTable(options));
+    if (!table->Create(BENCH_SEGMENT, config, 0)) {
+        fprintf(stderr, "create failed: %s\n", strerror(errno));
+        return false;
+    }
+    std::string value(scenario.value, 'v');
+    for (size_t i = 0; i < fill; ++i) {
+        std::string key = KeyFor("key", i);
+        if (!table->StoreValue(key, WyHash(key.data(), key.size()), value.data(), value.size(), 0, false, nullptr)) {
+            fprintf(stderr, "fill failed at %zu of %zu\n", i, fill);
+            return false;
+        }
+    }
+    
+    SharedResults* results = MapResults(true);
+    if (!results) {
+        fprintf(stderr, "results mapping failed\n");
+        return false;
+    }
+    results->scenario = scenario;
+    results->ticks_per_ns = ticks_per_ns;
+    
+    bool ok = true;
+    size_t workers = scenario.readers + scenario.writers;
+    std::vector<WorkerProcess> children;
+    for (size_t i = 0; i < workers && ok; ++i) {
+        WorkerProcess process;
+        ok = StartWorker(i, results, &process);
+        if (ok) {
+            children.push_back(process);
+        } else {
+            fprintf(stderr, "worker %zu: start failed\n", i);
+        }
+    }
+    while (ok && results->ready.load() < workers) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    results->start.store(1);
+    
+    for (WorkerProcess process : children) {
+        ok = WaitWorker(process) && ok;
+    }
+    
+    Histogram reads = {};
+    Histogram writes = {};
+    uint64_t ops = 0;
+    for (size_t i = 0; i < workers; ++i) {
+        (results->workers[i].writer ? writes : reads).Merge(results->workers[i].latency);
+        ops += results->workers[i].ops;
+    }
+    
+    printf("%-10s %5.2f %4.2f %6zu %-7s %3zu %3zu %3zu %9.2f |", scenario.sweep, scenario.load, scenario.hit,
+           scenario.value, scenario.zipf ? "zipf" : "uniform", scenario.readers, scenario.writers, scenario.batch,
+           ops / (scenario.duration_ms * 1000.0));
+    PrintLatency(reads);
+    printf(" |");
+    PrintLatency(writes);
+    printf("\n");
+    fflush(stdout);
+    
+    UnmapResults(results);
+    table.reset();
+    ShmTable::Unlink(BENCH_SEGMENT, false);
+    return ok;
+}
+
+static bool ParseFlag(const char* arg, const char* name, std::string* value) {
+    size_t length = strlen(name);
+    if (strncmp(arg, name, length) != 0 || arg[length] != '=') {
+        return false;
+    }
+    *value = arg + length + 1;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    ResetLockOwner();
+    
+#ifdef _WIN32
+    // A worker StartWorker started; RunWorker exits for it
+    std::string worker;
+    if (argc == 2 && ParseFlag(argv[1], "--worker", &worker)) {
+        SharedResults* results = MapResults(false);
+        if (!results) {
+            fprintf(stderr, "worker %s: results mapping failed\n", worker.c_str());
+            return 1;
+        }
+        RunWorker(strtoul(worker.c_str(), nullptr, 10), results);
+    }
+#endif
+    
+    Scenario base = {"", 0.75, 0.9, 64, false, 1, 0, 1, READ_MODE_MUTEX, false, PROBING_LINEAR, 1 << 18, 500};
+    std::string sweep = "all";
+    for (int i = 1; i < argc; ++i) {
+        std::string value;
+        if (ParseFlag(argv[i], "--sweep", &value)) {
+            sweep = value;
+        } else if (ParseFlag(argv[i], "--load", &value)) {
+            base.load = atof(value.c_str());
+        } else if (ParseFlag(argv[i], "--hit", &value)) {
+            base.hit = atof(value.c_str());
+        } else if (ParseFlag(argv[i], "--value", &value)) {
+            base.value = strtoul(value.c_str(), nullptr, 10);
+        } else if (ParseFlag(argv[i], "--dist", &value)) {
+            base.zipf = value == "zipf";
+        } else if (ParseFlag(argv[i], "--readers", &value)) {
+            base.readers = strtoul(value.c_str(), nullptr, 10);
+        } else if (ParseFlag(argv[i], "--writers", &value)) {
+            base.writers = strtoul(value.c_str(), nullptr, 10);
+        } else if (ParseFlag(argv[i], "--batch", &value)) {
+            base.batch = strtoul(value.c_str(), nullptr, 10);
+        } else if (ParseFlag(argv[i], "--read", &value)) {
+            base.read_mode = value == "mutex" ? READ_MODE_MUTEX : READ_MODE_SEQLOCK;
+            base.read_only = value == "readonly";
+        } else if (ParseFlag(argv[i], "--probing", &value)) {
+            base.probing = value == "robinhood" ? PROBING_ROBIN_HOOD : PROBING_LINEAR;
+        } else if (ParseFlag(argv[i], "--slots", &value)) {
+            base.slots = CapacityFor(strtoul(value.c_str(), nullptr, 10) - 1);
+        } else if (ParseFlag(argv[i], "--duration", &value)) {
+            base.duration_ms = static_cast<uint32_t>(strtoul(value.c_str(), nullptr, 10));
+        } else {
+            fprintf(stderr, "unknown flag %s\n", argv[i]);
+            return 2;
+        }
+    }
+    if (base.value == 0 || base.value > MAX_VALUE_SIZE_LIMIT || base.readers + base.writers == 0 ||
+        base.readers + base.writers > MAX_WORKERS || !(base.load > 0 && base.load < 1) || base.batch == 0 ||
+        base.batch > 1024) {
+        fprintf(stderr, "need 0 < load < 1, 1 to 16 MB values, 1 to %zu workers and batches of 1 to 1024\n",
+                MAX_WORKERS);
+        return 2;
+    }
+    
+    std::vector<Scenario> scenarios;
+    if (sweep == "load" || sweep == "all") {
+        for (double load : {0.25, 0.5, 0.75, 0.9, 0.95}) {
+            Scenario s = base;
+            s.sweep = "load";
+            s.load = load;
+            scenarios.push_back(s);
+        }
+    }
+    if (sweep == "hit" || sweep == "all") {
+        for (double hit : {1.0, 0.5, 0.0}) {
+            Scenario s = base;
+            s.sweep = "hit";
+            s.hit = hit;
+            scenarios.push_back(s);
+        }
+    }
+    if (sweep == "value" || sweep == "all") {
+        for (size_t value : {16, 256, 1024}) {
+            Scenario s = base;
+            s.sweep = "value";
+            s.value = value;
+            scenarios.push_back(s);
+        }
+    }
+    if (sweep == "dist" || sweep == "all") {
+        for (bool zipf : {false, true}) {
+            Scenario s = base;
+            s.sweep = "dist";
+            s.zipf = zipf;
+            scenarios.push_back(s);
+        }
+    }
+    if (sweep == "contention" || sweep == "all") {
+        const size_t mixes[][2] = {{1, 0}, {2, 0}, {4, 0}, {4, 1}, {2, 2}, {1, 4}};
+        for (const auto& mix : mixes) {
+            Scenario s = base;
+            s.sweep = "contention";
+            s.readers = mix[0];
+            s.writers = mix[1];
+            scenarios.push_back(s);
+        }
+    }
+    if (sweep == "batch" || sweep == "all") {
+        for (size_t batch : {1, 16, 64}) {
+            Scenario s = base;
+            s.sweep = "batch";
+            s.batch = batch;
+            scenarios.push_back(s);
+        }
+    }
+    if (scenarios.empty()) {
+        fprintf(stderr, "--sweep must be load, hit, value, dist, contention, batch or all\n");
+        return 2;
+    }
+    
+    double ticks_per_ns = CalibrateTicksPerNs();
+    printf("Table core benchmark: %zu slots, %s probing, %u ms per scenario, %.2f ticks/ns\n\n", base.slots,
+           base.probing == PROBING_ROBIN_HOOD ? "robinhood" : "linear", base.duration_ms, ticks_per_ns);
+    PrintHeader();
+    for (const Scenario& scenario : scenarios) {
+        if (!RunScenario(scenario, ticks_per_ns)) {
+            return 1;
+        }
+    }
+    return 0;
+}
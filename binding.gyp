@@ -1,4 +1,8 @@
 {
+  "variables": {
+    "slot_lock%": "futex",
+    "benchmarks%": "false"
+  },
   "targets": [
     {
       "target_name": "fast_shm_cache",
@@ -12,6 +16,9 @@
       "cflags_cc": [ "-std=c++11", "-pthread" ],
       "defines": [ "NAPI_DISABLE_CPP_EXCEPTIONS" ],
       "conditions": [
+        ["slot_lock=='pthread'", {
+          "defines": [ "FAST_SHM_PTHREAD_SLOT_LOCK" ]
+        }],
         ["OS=='linux'", {
           "libraries": [ "-lrt", "-lpthread" ]
         }],
@@ -31,5 +38,33 @@
         }]
       ]
     }
+  ],
+  "conditions": [
+    ["benchmarks=='true'", {
+      "targets": [
+        {
+          "target_name": "table_bench",
+          "type": "executable",
+          "sources": [ "bench/table_bench.cc" ],
+          "cflags_cc!": [ "-fno-exceptions" ],
+          "cflags_cc": [ "-std=c++11", "-pthread", "-O2" ],
+          "conditions": [
+            ["slot_lock=='pthread'", {
+              "defines": [ "FAST_SHM_PTHREAD_SLOT_LOCK" ]
+            }],
+            ["OS=='linux'", {
+              "libraries": [ "-lrt", "-lpthread" ]
+            }],
+            ["OS=='win'", {
+              "msvs_settings": {
+                "VCCLCompilerTool": {
+                  "ExceptionHandling": 1
+                }
+              }
+            }]
+          ]
+        }
+      ]
+    }]
   ]
-} 
\ No newline at end of file
+}
\ No newline at end of file
@@ -0,0 +1,61 @@
+'use strict';
+
+// Compares slot lock builds. Run once per build:
+//   npm run build && node examples/lock-benchmark.js
+//   npx node-gyp rebuild --slot_lock=pthread && node examples/lock-benchmark.js
+
+const { Worker, isMainThread, parentPort, workerData } = require('worker_threads');
+const cache = require('../index.js');
+
+const DURATION_MS = 2000;
+const HOT_KEYS = 4;
+
+function hammer(c, keys, durationMs) {
+  const value = 'x'.repeat(200);
+  let ops = 0;
+  const end = Date.now() + durationMs;
+  while (Date.now() < end) {
+    for (let i = 0; i < 1000; i++) {
+      const key = keys[i % keys.length];
+      if (i % 4 === 0) {
+        c.set(key, value);
+      } else {
+        c.get(key);
+      }
+    }
+    ops += 1000;
+  }
+  return ops;
+}
+
+if (isMainThread) {
+  console.log(`Slot lock benchmark (${cache.slotLock} build)`);
+  console.log('=================================\n');
+  
+  const c = cache({ name: 'lock_benchmark', maxKeys: 1024 });
+  const keys = Array.from({ length: HOT_KEYS }, (_, i) => `hot${i}`);
+  keys.forEach(key => c.set(key, 'x'));
+  
+  // Uncontended: the lock's fast path only
+  const solo = hammer(c, keys, DURATION_MS);
+  console.log(`Uncontended, 1 thread: ${Math.round(solo / (DURATION_MS / 1000)).toLocaleString()} ops/sec`);
+  
+  // Contended: every thread on the same few slots
+  const threads = Math.max(2, Math.min(8, require('os').cpus().length));
+  let done = 0;
+  let total = 0;
+  for (let i = 0; i < threads; i++) {
+    const worker = new Worker(__filename, { workerData: { keys } });
+    worker.on('message', (ops) => {
+      total += ops;
+      if (++done === threads) {
+        console.log(`Contended, ${threads} threads on ${HOT_KEYS} keys: ` +
+          `${Math.round(total / (DURATION_MS / 1000)).toLocaleString()} ops/sec`);
+        console.log(`Lock waits past lockTimeout: ${c.lockStats().timeouts}`);
+      }
+    });
+  }
+} else {
+  const c = cache({ name: 'lock_benchmark' });
+  parentPort.postMessage(hammer(c, workerData.keys, DURATION_MS));
+}
@@ -0,0 +1,38 @@
+'use strict';
+
+// Moves small messages from one process to another through a queue:
+//   node examples/queue-benchmark.js
+
+const { fork } = require('child_process');
+const { createQueue } = require('../index.js');
+
+const MESSAGES = 5000000;
+const MESSAGE_SIZE = 16;
+const BATCH = 256;
+
+if (process.argv[2] === 'producer') {
+  const queue = createQueue({ name: 'queue_benchmark' });
+  const message = Buffer.alloc(MESSAGE_SIZE);
+  for (let i = 0; i < MESSAGES; i++) {
+    message.writeUInt32LE(i);
+    queue.push(message, Infinity);
+  }
+} else {
+  console.log('Queue benchmark');
+  console.log('===============\n');
+  
+  const queue = createQueue({ name: 'queue_benchmark', capacity: 4096, maxMessageSize: MESSAGE_SIZE });
+  const producer = fork(__filename, ['producer']);
+  
+  // Timed from the first message, so the producer's startup doesn't count
+  let received = queue.popBatch(BATCH, Infinity).length;
+  const start = process.hrtime.bigint();
+  while (received < MESSAGES) {
+    received += queue.popBatch(BATCH, Infinity).length;
+  }
+  const seconds = Number(process.hrtime.bigint() - start) / 1e9;
+  
+  console.log(`${MESSAGES.toLocaleString()} messages of ${MESSAGE_SIZE} bytes, popBatch(${BATCH}): ` +
+    `${Math.round(MESSAGES / seconds).toLocaleString()} messages/sec`);
+  producer.on('exit', () => process.exit(0));
+}
@@ -1,22 +1,189 @@
 'use strict';
 
+const os = require('os');
 const binding = require('./build/Release/fast_shm_cache.node');
 
+/**
+ * Wraps binary data in a Buffer view over the same memory (no copy)
+ * @param {Buffer|ArrayBuffer|ArrayBufferView} data - Binary data
+ * @returns {Buffer|null} Buffer view, or null if data isn't binary
+ */
+function asBuffer(data) {
+  if (Buffer.isBuffer(data)) {
+    return data;
+  }
+  if (data instanceof ArrayBuffer) {
+    return Buffer.from(data);
+  }
+  if (ArrayBuffer.isView(data)) {
+    return Buffer.from(data.buffer, data.byteOffset, data.byteLength);
+  }
+  return null;
+}
+
+/**
+ * Checks a value against the cache's valueType
+ * @param {string} valueType - 'string', 'int64' or 'float64'
+ * @param {*} value - Value to store
+ */
+function checkValue(valueType, value) {
+  if (valueType === 'string') {
+    if (typeof value !== 'string') {
+      throw new TypeError('Value must be a string');
+    }
+  } else if (valueType === 'float64') {
+    if (typeof value !== 'number') {
+      throw new TypeError('Value must be a number');
+    }
+  } else if (typeof value === 'bigint') {
+    if (BigInt.asIntN(64, value) !== value) {
+      throw new RangeError('Value must fit in a signed 64-bit integer');
+    }
+  } else if (!Number.isSafeInteger(value)) {
+    throw new TypeError('Value must be a BigInt or a safe integer');
+  }
+}
+
+/**
+ * Validates an optional time-to-live argument
+ * @param {number|undefined} ttlMs - Milliseconds until expiry, 0 or undefined for never
+ */
+function checkTtl(ttlMs) {
+  if (ttlMs !== undefined && !(typeof ttlMs === 'number' && ttlMs >= 0 && Number.isFinite(ttlMs))) {
+    throw new TypeError('ttlMs must be a non-negative number');
+  }
+}
+
+// Records decoded per turn of the event loop by keysAsync and entriesAsync
+const DECODE_CHUNK = 4096;
+
+// Typed values are packed in the writer's byte order
+const LITTLE_ENDIAN = os.endianness() === 'LE';
+
+/**
+ * Decodes one value from the native bulk scans
+ * @param {Buffer} records - Packed records
+ * @param {number} start - First byte of the value
+ * @param {number} end - Byte after the value
+ * @param {string} valueType - The cache's valueType
+ * @returns {string|bigint|number} The value
+ */
+function decodeValue(records, start, end, valueType) {
+  if (valueType === 'int64') {
+    return LITTLE_ENDIAN ? records.readBigInt64LE(start) : records.readBigInt64BE(start);
+  }
+  if (valueType === 'float64') {
+    return LITTLE_ENDIAN ? records.readDoubleLE(start) : records.readDoubleBE(start);
+  }
+  return records.toString('utf8', start, end);
+}
+
+/**
+ * Decodes the records packed by the native bulk scans, yielding to the
+ * event loop between chunks so a large table doesn't stall other work
+ * @param {Buffer} records - u8 key length and key, then for entries u32 value length and value
+ * @param {boolean} withValues - Whether each record carries a value
+ * @param {string} valueType - The cache's valueType
+ * @returns {Promise<Array>} Keys, or [key, value] pairs
+ */
+async function decodeRecords(records, withValues, valueType) {
+  const decoded = [];
+  let offset = 0;
+  while (offset < records.length) {
+    for (let n = 0; n < DECODE_CHUNK && offset < records.length; n++) {
+      const keyEnd = offset + 1 + records[offset];
+      const key = records.toString('utf8', offset + 1, keyEnd);
+      offset = keyEnd;
+      if (!withValues) {
+        decoded.push(key);
+        continue;
+      }
+      const valueEnd = offset + 4 + records.readUInt32LE(offset);
+      decoded.push([key, decodeValue(records, offset + 4, valueEnd, valueType)]);
+      offset = valueEnd;
+    }
+    if (offset < records.length) {
+      await new Promise(setImmediate);
+    }
+  }
+  return decoded;
+}
+
 /**
  * Creates a new shared memory cache instance
  * @param {Object} options - Configuration options
  * @param {string} options.name - Name of the shared memory segment (default: 'node_cache')
  * @param {number} options.maxKeys - Maximum number of keys in the cache (default: 1024)
+ * @param {number} options.maxValueSize - Largest value in bytes, up to 16 MB (default: 256)
+ * @param {number} options.arenaSize - Bytes reserved for values (default: 256 per slot, or less for small maxValueSize)
+ * @param {string} options.eviction - What a full cache does on set: 'none' rejects, 'clock' or 'lru' evict (default: 'none')
+ * @param {string} options.probing - Collision strategy: 'linear', or 'robinhood' for evenly short probes
+ *   at 90-95% load (default: 'linear')
+ * @param {string} options.valueType - 'string', or 'int64' or 'float64' values kept in the slot
+ *   itself with no arena; attaching to an existing cache takes its type (default: 'string')
+ * @param {number} options.shards - Independent sub-tables, each with its own locks and counters, up to 256 (default: 1)
+ * @param {boolean} options.numa - Spread shards over the host's NUMA nodes (default: false)
+ * @param {string} options.hugePages - Page backing: 'none', 'transparent', or hugetlbfs '2mb' or '1gb' (default: 'none')
+ * @param {string} options.file - Path of a regular file to map instead of shared memory; the cache
+ *   survives reboots there and reopens warm (default: null)
+ * @param {boolean} options.prefault - Fault the whole segment in up front instead of on first use (default: false)
+ * @param {number} options.reapInterval - Milliseconds between background sweeps for expired entries, 0 for none (default: 0)
  * @param {boolean} options.persist - Whether to persist shared memory after process exit (default: false)
+ * @param {string} options.readMode - How get/has read slots: 'mutex' or lock-free 'seqlock' (default: 'mutex')
+ * @param {boolean} options.readOnly - Attach to an existing cache mapped read-only; reads are
+ *   lock-free and write methods throw (default: false)
+ * @param {number} options.lockTimeout - Milliseconds to wait on a slot lock before checking that its
+ *   owner is alive and taking it over if not, 0 to wait forever (default: 1000)
+ * @param {number} options.latencySampling - Time 1 in N gets, sets and deletes for stats(), 0 for none (default: 0)
  * @returns {Object} Cache instance with get/set/delete/has/keys/entries methods
  */
 function createCache(options = {}) {
+  const { config, cache } = openCache(options, false);
+  return wrapCache(config, cache);
+}
+
+/**
+ * Creates a cache like createCache, but prefaults its pages on the libuv
+ * thread pool instead of blocking the event loop
+ * @param {Object} options - Same options as createCache
+ * @returns {Promise<Object>} Cache instance, once every page is mapped
+ */
+async function createCacheAsync(options = {}) {
+  const { config, cache } = openCache(options, true);
+  if (config.prefault) {
+    await cache.prefault();
+  }
+  return wrapCache(config, cache);
+}
+
+/**
+ * Validates options and opens the native cache
+ * @param {Object} options - createCache options
+ * @param {boolean} deferPrefault - Leave prefaulting to the caller
+ * @returns {{config: Object, cache: Object}} Resolved options and native cache
+ */
+function openCache(options, deferPrefault) {
   const defaults = {
     name: 'node_cache',
     maxKeys: 1024,
-    persist: false
+    maxValueSize: 256,
+    arenaSize: 0,
+    eviction: 'none',
+    probing: 'linear',
+    valueType: 'string',
+    shards: 1,
+    numa: false,
+    hugePages: 'none',
+    file: null,
+    prefault: false,
+    reapInterval: 0,
+    persist: false,
+    readMode: 'mutex',
+    readOnly: false,
+    lockTimeout: 1000,
+    latencySampling: 0
   };
-
+  
   const config = Object.assign({}, defaults, options);
   
   // Validate options
@@ -28,35 +195,131 @@ function createCache(options = {}) {
     throw new TypeError('maxKeys must be a positive integer');
   }
   
+  if (!Number.isInteger(config.maxValueSize) || config.maxValueSize < 1 || config.maxValueSize > 16 * 1024 * 1024) {
+    throw new RangeError('maxValueSize must be an integer between 1 and 16 MB');
+  }
+  
+  if (!Number.isInteger(config.arenaSize) || config.arenaSize < 0) {
+    throw new TypeError('arenaSize must be a non-negative integer');
+  }
+  
+  if (!['none', 'clock', 'lru'].includes(config.eviction)) {
+    throw new TypeError("eviction must be 'none', 'clock' or 'lru'");
+  }
+  
+  if (config.probing !== 'linear' && config.probing !== 'robinhood') {
+    throw new TypeError("probing must be 'linear' or 'robinhood'");
+  }
+  
+  if (!['string', 'int64', 'float64'].includes(config.valueType)) {
+    throw new TypeError("valueType must be 'string', 'int64' or 'float64'");
+  }
+  
+  if (!Number.isInteger(config.shards) || config.shards < 1 || config.shards > 256) {
+    throw new RangeError('shards must be an integer between 1 and 256');
+  }
+  
+  if (typeof config.numa !== 'boolean') {
+    throw new TypeError('numa must be a boolean');
+  }
+  
+  if (!['none', 'transparent', '2mb', '1gb'].includes(config.hugePages)) {
+    throw new TypeError("hugePages must be 'none', 'transparent', '2mb' or '1gb'");
+  }
+  
+  if (config.file !== null && (typeof config.file !== 'string' || config.file.length === 0)) {
+    throw new TypeError('file must be a non-empty string');
+  }
+  
+  if (config.file !== null && (config.hugePages === '2mb' || config.hugePages === '1gb')) {
+    throw new TypeError("hugePages '2mb' and '1gb' can't be combined with file");
+  }
+  
+  if (typeof config.prefault !== 'boolean') {
+    throw new TypeError('prefault must be a boolean');
+  }
+  
+  if (!Number.isInteger(config.reapInterval) || config.reapInterval < 0) {
+    throw new TypeError('reapInterval must be a non-negative integer');
+  }
+  
   if (typeof config.persist !== 'boolean') {
     throw new TypeError('persist must be a boolean');
   }
-
+  
+  if (config.readMode !== 'mutex' && config.readMode !== 'seqlock') {
+    throw new TypeError("readMode must be 'mutex' or 'seqlock'");
+  }
+  
+  if (typeof config.readOnly !== 'boolean') {
+    throw new TypeError('readOnly must be a boolean');
+  }
+  
+  if (config.readOnly && config.reapInterval > 0) {
+    throw new TypeError("reapInterval can't be combined with readOnly");
+  }
+  
+  if (!Number.isInteger(config.lockTimeout) || config.lockTimeout < 0) {
+    throw new TypeError('lockTimeout must be a non-negative integer');
+  }
+  
+  if (!Number.isInteger(config.latencySampling) || config.latencySampling < 0 || config.latencySampling > 0xffffffff) {
+    throw new TypeError('latencySampling must be a non-negative integer');
+  }
+  
   // Create native cache instance
-  const cache = new binding.FastShmCache(config);
+  const cache = new binding.FastShmCache(Object.assign({}, config, {
+    prefault: config.prefault && !deferPrefault
+  }));
+  return { config, cache };
+}
+
+/**
+ * Builds the public API around a native cache
+ * @param {Object} config - Resolved options
+ * @param {Object} cache - Native cache
+ * @returns {Object} Cache instance
+ */
+function wrapCache(config, cache) {
+  // Attaching handles take the creator's type
+  const valueType = cache.valueType();
+  
+  // watch() callbacks by id; the native side reports [id, keys] pairs
+  const watchers = new Map();
+  const dispatch = (changes) => {
+    for (const [id, keys] of changes) {
+      const callback = watchers.get(id);
+      if (callback) {
+        callback(keys);
+      }
+    }
+  };
   
   // Return public API
   return {
     /**
      * Sets a key-value pair in the cache
      * @param {string} key - Key (max 64 bytes)
-     * @param {string} value - Value (max 256 bytes)
-     * @returns {boolean} True if successful, false if cache is full or key/value too large
+     * @param {string|bigint|number} value - Value (max maxValueSize bytes); a BigInt or safe
+     *   integer for int64 caches, a number for float64 ones
+     * @param {number} [ttlMs] - Expire after this many milliseconds (default: never)
+     * @returns {boolean} True if successful, false if cache or arena is full (and nothing
+     *   could be evicted) or key/value too large
      */
-    set(key, value) {
+    set(key, value, ttlMs) {
       if (typeof key !== 'string') {
         throw new TypeError('Key must be a string');
       }
-      if (typeof value !== 'string') {
-        throw new TypeError('Value must be a string');
-      }
-      return cache.set(key, value);
+      checkValue(valueType, value);
+      checkTtl(ttlMs);
+      return cache.set(key, value, ttlMs);
     },
     
     /**
      * Gets a value by key from the cache
      * @param {string} key - Key to lookup
-     * @returns {string|undefined} The value if found, undefined otherwise
+     * @returns {string|bigint|number|undefined} The value if found, undefined otherwise;
+     *   a BigInt for int64 caches and a number for float64 ones
      */
     get(key) {
       if (typeof key !== 'string') {
@@ -65,6 +328,95 @@ function createCache(options = {}) {
       return cache.get(key);
     },
     
+    /**
+     * Sets a key to raw bytes, copied straight into shared memory
+     * @param {string} key - Key (max 64 bytes)
+     * @param {Buffer|ArrayBuffer|ArrayBufferView} value - Value (max maxValueSize bytes)
+     * @param {number} [ttlMs] - Expire after this many milliseconds (default: never)
+     * @returns {boolean} True if successful, false if cache or arena is full or key/value too large
+     */
+    setBuffer(key, value, ttlMs) {
+      if (typeof key !== 'string') {
+        throw new TypeError('Key must be a string');
+      }
+      const buffer = asBuffer(value);
+      if (buffer === null) {
+        throw new TypeError('Value must be a Buffer, ArrayBuffer or typed array');
+      }
+      checkTtl(ttlMs);
+      return cache.setBuffer(key, buffer, ttlMs);
+    },
+    
+    /**
+     * Gets a value as a new Buffer holding its raw bytes
+     * @param {string} key - Key to lookup
+     * @returns {Buffer|undefined} The value if found, undefined otherwise
+     */
+    getBuffer(key) {
+      if (typeof key !== 'string') {
+        throw new TypeError('Key must be a string');
+      }
+      return cache.getBuffer(key);
+    },
+    
+    /**
+     * Copies a value into an existing buffer without allocating
+     * @param {string} key - Key to lookup
+     * @param {Buffer|ArrayBuffer|ArrayBufferView} target - Destination for the value's bytes
+     * @returns {number|undefined} Value length in bytes, or undefined if not found.
+     *   If the length exceeds the target's size, nothing is copied.
+     */
+    getInto(key, target) {
+      if (typeof key !== 'string') {
+        throw new TypeError('Key must be a string');
+      }
+      const buffer = asBuffer(target);
+      if (buffer === null) {
+        throw new TypeError('Target must be a Buffer, ArrayBuffer or typed array');
+      }
+      return cache.getInto(key, buffer);
+    },
+    
+    /**
+     * Gets several values in one native call
+     * @param {string[]} keys - Keys to lookup
+     * @returns {Array<string|undefined>} Values in key order, undefined where not found
+     */
+    mget(keys) {
+      if (!Array.isArray(keys)) {
+        throw new TypeError('Keys must be an array');
+      }
+      return cache.mget(keys);
+    },
+    
+    /**
+     * Sets several key-value pairs in one native call
+     * @param {Array<[string, string|Buffer, number?]>|Map<string, string|Buffer>} entries - Pairs to
+     *   store, each optionally followed by a ttlMs
+     * @returns {boolean[]} Per-entry result, as set() would return
+     */
+    mset(entries) {
+      if (entries instanceof Map) {
+        entries = Array.from(entries);
+      }
+      if (!Array.isArray(entries)) {
+        throw new TypeError('Entries must be an array of [key, value] pairs or a Map');
+      }
+      return cache.mset(entries);
+    },
+    
+    /**
+     * Deletes several keys in one native call
+     * @param {string[]} keys - Keys to delete
+     * @returns {number} How many keys were found and deleted
+     */
+    mdel(keys) {
+      if (!Array.isArray(keys)) {
+        throw new TypeError('Keys must be an array');
+      }
+      return cache.mdel(keys);
+    },
+    
     /**
      * Deletes a key-value pair from the cache
      * @param {string} key - Key to delete
@@ -89,6 +441,72 @@ function createCache(options = {}) {
       return cache.has(key);
     },
     
+    /**
+     * Adds to an integer counter in one native call, atomically across
+     * processes. The value stays decimal text, so get() and set() still work.
+     * Typed caches add to the stored number instead.
+     * @param {string} key - Counter key; a missing one starts from 0
+     * @param {number|bigint} [delta] - Safe integer to add, a BigInt too for int64
+     *   caches, any number for float64 ones (default: 1)
+     * @param {number} [ttlMs] - Expiry for a counter this call creates; an existing
+     *   counter keeps its own, so a rate limit window ends on time
+     * @returns {number|bigint|undefined} The new value, a BigInt for int64 caches, or
+     *   undefined if the value isn't an integer, the result would leave the safe
+     *   integer range (the int64 range for int64 caches), or there is no room
+     */
+    incrBy(key, delta = 1, ttlMs) {
+      if (typeof key !== 'string') {
+        throw new TypeError('Key must be a string');
+      }
+      if (valueType !== 'string') {
+        checkValue(valueType, delta);
+      } else if (!Number.isSafeInteger(delta)) {
+        throw new RangeError('delta must be a safe integer');
+      }
+      checkTtl(ttlMs);
+      return cache.incrBy(key, delta, ttlMs);
+    },
+    
+    /**
+     * Replaces a value only if it still equals the expected one, atomically
+     * across processes
+     * @param {string} key - Key to update
+     * @param {string|bigint|number|undefined} expected - Value it must hold, or undefined for
+     *   a missing key; typed values compare bit for bit, so NaN matches NaN and 0 not -0
+     * @param {string|bigint|number} next - Value to store
+     * @param {number} [ttlMs] - Expire after this many milliseconds (default: never)
+     * @returns {boolean} True if next was stored
+     */
+    compareAndSet(key, expected, next, ttlMs) {
+      if (typeof key !== 'string') {
+        throw new TypeError('Key must be a string');
+      }
+      if (expected !== undefined) {
+        checkValue(valueType, expected);
+      }
+      checkValue(valueType, next);
+      checkTtl(ttlMs);
+      return cache.compareAndSet(key, expected, next, ttlMs);
+    },
+    
+    /**
+     * Returns the current value, or stores and returns the given one if the
+     * key is missing. Concurrent callers all get the same winner.
+     * @param {string} key - Key to look up
+     * @param {string|bigint|number} value - Value to store if the key is missing
+     * @param {number} [ttlMs] - Expiry for the stored value (default: never)
+     * @returns {string|bigint|number|undefined} The value now in the cache, or undefined
+     *   if it was missing and there is no room
+     */
+    getOrSet(key, value, ttlMs) {
+      if (typeof key !== 'string') {
+        throw new TypeError('Key must be a string');
+      }
+      checkValue(valueType, value);
+      checkTtl(ttlMs);
+      return cache.getOrSet(key, value, ttlMs);
+    },
+    
     /**
      * Returns all keys in the cache
      * @returns {string[]} Array of keys
@@ -105,6 +523,33 @@ function createCache(options = {}) {
       return cache.entries();
     },
     
+    /**
+     * Walks the cache a batch at a time, like Redis SCAN: start with cursor 0
+     * and pass each returned cursor back until it is 0 again. An entry present
+     * for the whole walk is returned at least once, unless tombstone compaction
+     * or a Robin Hood insert moves it behind the cursor; a resize in between
+     * can repeat entries but not skip them.
+     * @param {number} cursor - 0 to start, else the cursor from the last batch
+     * @param {number} count - Most entries to return in this batch (default: 100)
+     * @param {Object} options - Scan options
+     * @param {string} options.prefix - Only return keys starting with this (default: '')
+     * @returns {{cursor: number, entries: Array<[string, string]>}} Next cursor, and the
+     *   batch, which can be empty before the walk is done
+     */
+    scan(cursor = 0, count = 100, options = {}) {
+      if (!Number.isSafeInteger(cursor) || cursor < 0) {
+        throw new TypeError('cursor must be a cursor returned by scan(), or 0');
+      }
+      if (!Number.isInteger(count) || count < 1 || count > 0xffffffff) {
+        throw new RangeError('count must be a positive integer');
+      }
+      const prefix = options.prefix === undefined ? '' : options.prefix;
+      if (typeof prefix !== 'string') {
+        throw new TypeError('prefix must be a string');
+      }
+      return cache.scan(cursor, count, prefix);
+    },
+    
     /**
      * Clears all entries from the cache
      */
@@ -112,6 +557,60 @@ function createCache(options = {}) {
       return cache.clear();
     },
     
+    /**
+     * Like keys(), but scans the slots on the libuv thread pool so a large
+     * table doesn't block the event loop
+     * @returns {Promise<string[]>} Array of keys
+     */
+    async keysAsync() {
+      return decodeRecords(await cache.keysAsync(), false, valueType);
+    },
+    
+    /**
+     * Like entries(), but scans the slots on the libuv thread pool
+     * @returns {Promise<Array<[string, string]>>} Array of [key, value] pairs
+     */
+    async entriesAsync() {
+      return decodeRecords(await cache.entriesAsync(), true, valueType);
+    },
+    
+    /**
+     * Like clear(), but on the libuv thread pool
+     * @returns {Promise<void>} Settles once every entry is gone
+     */
+    clearAsync() {
+      return cache.clearAsync();
+    },
+    
+    /**
+     * Calls back when any handle, in any process, writes a key: set, delete,
+     * the batch and atomic methods, restore and clear. Evictions and expiry
+     * aren't reported. Bursts are coalesced, so each call lists the distinct
+     * keys written since the last one. An open watch keeps the process alive.
+     * @param {string|{prefix: string}} target - A key, or { prefix } for every key starting with it
+     * @param {function((string[]|null)): void} callback - Gets the written keys, or null when
+     *   they can't be listed (clear(), more than 1024 of them, or a watcher that fell
+     *   behind the change log), so everything watched should be re-read
+     * @returns {function(): void} Stops watching
+     */
+    watch(target, callback) {
+      const prefix = typeof target === 'object' && target !== null;
+      const pattern = prefix ? target.prefix : target;
+      if (typeof pattern !== 'string') {
+        throw new TypeError('target must be a key or { prefix: string }');
+      }
+      if (typeof callback !== 'function') {
+        throw new TypeError('callback must be a function');
+      }
+      const id = cache.watch(pattern, prefix, dispatch);
+      watchers.set(id, callback);
+      return () => {
+        if (watchers.delete(id)) {
+          cache.unwatch(id);
+        }
+      };
+    },
+    
     /**
      * Returns the number of entries in the cache
      * @returns {number} Number of entries
@@ -121,11 +620,86 @@ function createCache(options = {}) {
     },
     
     /**
-     * Gets the maximum number of keys
+     * Grows the cache in place, coordinated with every attached process.
+     * Entries move to a larger segment one slot at a time while all handles
+     * keep reading and writing.
+     * @param {number} maxKeys - New maximum number of keys
+     * @returns {boolean} True if the cache grew, false if it already holds maxKeys
+     * @throws {Error} If entries don't fit the new segment's arena; they stay
+     *   readable where they are, and a later resize() moves them
+     */
+    resize(maxKeys) {
+      if (!Number.isInteger(maxKeys) || maxKeys < 1) {
+        throw new TypeError('maxKeys must be a positive integer');
+      }
+      return cache.resize(maxKeys);
+    },
+    
+    /**
+     * Gets the type every value in this cache has, as chosen by its creator
+     * @returns {string} 'string', 'int64' or 'float64'
+     */
+    get valueType() {
+      return valueType;
+    },
+    
+    /**
+     * Gets the maximum number of keys, as last resized by any process
      * @returns {number} Maximum number of keys
      */
     get maxKeys() {
-      return config.maxKeys;
+      return cache.maxKeys();
+    },
+    
+    /**
+     * Writes every entry to a file while other processes keep writing.
+     * Each entry is copied whole; the file is replaced atomically once complete.
+     * @param {string} path - Destination file
+     * @returns {number} Number of entries written
+     */
+    snapshot(path) {
+      if (typeof path !== 'string' || path.length === 0) {
+        throw new TypeError('path must be a non-empty string');
+      }
+      return cache.snapshot(path);
+    },
+    
+    /**
+     * Loads entries from a snapshot, after checking its version and checksum
+     * @param {string} path - Snapshot file
+     * @returns {number} Number of entries stored; expired ones and ones that don't fit are skipped
+     */
+    restore(path) {
+      if (typeof path !== 'string' || path.length === 0) {
+        throw new TypeError('path must be a non-empty string');
+      }
+      return cache.restore(path);
+    },
+    
+    /**
+     * Writes a file-backed cache's dirty pages to disk and waits for them
+     */
+    flush() {
+      cache.flush();
+    },
+    
+    /**
+     * Gets lock counters from every process using the cache
+     * @returns {{timeouts: number, recovered: number}} Slot lock waits that outlasted
+     *   lockTimeout, and locks taken over from processes that died holding them
+     */
+    lockStats() {
+      return cache.lockStats();
+    },
+    
+    /**
+     * Gets this handle's operation counters since it opened, and the table's occupancy
+     * @returns {Object} hits, misses, sets, setFailures, evictions, avgProbe and maxProbe (groups
+     *   looked at per lookup), lockContention, loadFactor (entries / maxKeys), tombstoneRatio, and
+     *   with latencySampling, latency.get/set/delete as { samples, p50, p99, max, histogram } in ns
+     */
+    stats() {
+      return cache.stats();
     },
     
     /**
@@ -138,4 +712,143 @@ function createCache(options = {}) {
   };
 }
 
-module.exports = createCache; 
\ No newline at end of file
+/**
+ * Checks a queue wait time
+ * @param {number} timeoutMs - Milliseconds to wait, 0 for none or Infinity for no limit
+ */
+function checkTimeout(timeoutMs) {
+  if (typeof timeoutMs !== 'number' || Number.isNaN(timeoutMs) || timeoutMs < 0) {
+    throw new TypeError('timeoutMs must be a non-negative number or Infinity');
+  }
+}
+
+/**
+ * Creates or attaches to a shared memory message queue. Any number of
+ * processes may push and pop; each message goes to exactly one pop.
+ * @param {Object} options - Configuration options
+ * @param {string} options.name - Shared memory segment name (default: 'node_queue')
+ * @param {number} options.capacity - Messages the queue holds, rounded up to a power of two (default: 1024)
+ * @param {number} options.maxMessageSize - Maximum message size in bytes (default: 256)
+ * @param {boolean} options.persist - Whether to persist shared memory after process exit (default: false)
+ * @returns {Object} Queue instance with push/pop/popBatch methods
+ */
+function createQueue(options = {}) {
+  const defaults = {
+    name: 'node_queue',
+    capacity: 1024,
+    maxMessageSize: 256,
+    persist: false
+  };
+  
+  const config = Object.assign({}, defaults, options);
+  
+  if (typeof config.name !== 'string' || config.name.length === 0) {
+    throw new TypeError('Queue name must be a non-empty string');
+  }
+  
+  if (!Number.isInteger(config.capacity) || config.capacity < 1 || config.capacity > 2 ** 30) {
+    throw new RangeError('capacity must be an integer between 1 and 2^30');
+  }
+  
+  if (!Number.isInteger(config.maxMessageSize) || config.maxMessageSize < 1 || config.maxMessageSize > 16 * 1024 * 1024) {
+    throw new RangeError('maxMessageSize must be an integer between 1 and 16 MB');
+  }
+  
+  if (typeof config.persist !== 'boolean') {
+    throw new TypeError('persist must be a boolean');
+  }
+  
+  // Attaching handles take the creator's capacity and message size
+  const queue = new binding.FastShmQueue(config);
+  const maxMessageSize = queue.maxMessageSize();
+  
+  return {
+    /**
+     * Adds a message, waiting up to timeoutMs for room if the queue is full
+     * @param {Buffer|ArrayBuffer|ArrayBufferView|string} data - Message
+     * @param {number} timeoutMs - Milliseconds to wait, 0 for none or Infinity for no limit (default: 0)
+     * @returns {boolean} True if the message was added, false if the queue stayed full
+     */
+    push(data, timeoutMs = 0) {
+      const buffer = typeof data === 'string' ? Buffer.from(data) : asBuffer(data);
+      if (buffer === null) {
+        throw new TypeError('data must be a string, Buffer, ArrayBuffer or ArrayBufferView');
+      }
+      if (buffer.length > maxMessageSize) {
+        throw new RangeError(`Message is ${buffer.length} bytes, maxMessageSize is ${maxMessageSize}`);
+      }
+      checkTimeout(timeoutMs);
+      return queue.push(buffer, timeoutMs);
+    },
+    
+    /**
+     * Takes the oldest message, waiting up to timeoutMs for one if the queue is empty
+     * @param {number} timeoutMs - Milliseconds to wait, 0 for none or Infinity for no limit (default: 0)
+     * @returns {Buffer|undefined} Message, or undefined if the queue stayed empty
+     */
+    pop(timeoutMs = 0) {
+      checkTimeout(timeoutMs);
+      return queue.pop(timeoutMs);
+    },
+    
+    /**
+     * Takes up to max messages, waiting up to timeoutMs for the first
+     * @param {number} max - Most messages to take
+     * @param {number} timeoutMs - Milliseconds to wait, 0 for none or Infinity for no limit (default: 0)
+     * @returns {Buffer[]} Messages, oldest first; empty if the queue stayed empty
+     */
+    popBatch(max, timeoutMs = 0) {
+      if (!Number.isInteger(max) || max < 1) {
+        throw new TypeError('max must be a positive integer');
+      }
+      checkTimeout(timeoutMs);
+      const records = queue.popBatch(max, timeoutMs);
+      const messages = [];
+      let offset = 0;
+      while (offset < records.length) {
+        const end = offset + 4 + records.readUInt32LE(offset);
+        messages.push(records.subarray(offset + 4, end));
+        offset = end;
+      }
+      return messages;
+    },
+    
+    /**
+     * Gets the number of messages waiting
+     * @returns {number} Messages pushed and not yet popped
+     */
+    size() {
+      return queue.size();
+    },
+    
+    /**
+     * Gets the queue's capacity
+     * @returns {number} Messages the queue holds
+     */
+    get capacity() {
+      return queue.capacity();
+    },
+    
+    /**
+     * Gets the largest message the queue takes
+     * @returns {number} Maximum message size in bytes
+     */
+    get maxMessageSize() {
+      return maxMessageSize;
+    },
+    
+    /**
+     * Gets the queue name
+     * @returns {string} Queue name
+     */
+    get name() {
+      return config.name;
+    }
+  };
+}
+
+module.exports = createCache;
+module.exports.createCacheAsync = createCacheAsync;
+module.exports.createQueue = createQueue;
+// Slot lock the addon was built with: 'futex', or 'pthread' from --slot_lock=pthread
+module.exports.slotLock = binding.slotLock; 
\ No newline at end of file
@@ -1,40 +1,35 @@
 #include <napi.h>
 #include <string>
 #include <cstring>
+#include <cerrno>
 #include <atomic>
 #include <mutex>
-#include <chrono>
-
-#ifdef _WIN32
-  #include <windows.h>
-#else
-  #include <sys/mman.h>
-  #include <sys/stat.h>
-  #include <fcntl.h>
-  #include <unistd.h>
-  #include <pthread.h>
-#endif
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <unordered_set>
+#include <map>
+#include <cmath>
 
-// Constants
-const size_t MAX_KEY_SIZE = 64;
-const size_t MAX_VALUE_SIZE = 256;
-const size_t DEFAULT_MAX_KEYS = 1024;
+#include "shm_table.h"
 
-// Slot structure for the hash table
-struct CacheSlot {
-    std::atomic<bool> occupied;
-    char key[MAX_KEY_SIZE];
-    char value[MAX_VALUE_SIZE];
-    std::atomic<uint64_t> timestamp;
-    pthread_mutex_t mutex;
-};
+using namespace fast_shm;
 
-// Shared memory header
-struct SharedMemoryHeader {
-    size_t max_keys;
-    std::atomic<size_t> num_entries;
-    pthread_mutex_t global_mutex;
-};
+// Turns an optional ttlMs argument into an expiry time; anything but a
+// positive number means no expiry
+static inline uint64_t ExpiryFrom(Napi::Value ttl) {
+    if (!ttl.IsNumber()) {
+        return 0;
+    }
+    
+    double ttl_ms = ttl.As<Napi::Number>().DoubleValue();
+    if (!(ttl_ms > 0)) {
+        return 0;
+    }
+    return NowNs() + static_cast<uint64_t>(ttl_ms * 1e6);
+}
 
 class FastShmCache : public Napi::ObjectWrap<FastShmCache> {
 public:
@@ -45,143 +40,197 @@ public:
 private:
     static Napi::FunctionReference constructor;
     
-    void* shm_ptr_;
-    size_t shm_size_;
-    std::string shm_name_;
-    int shm_fd_;
-    bool is_creator_;
     bool persist_;
+    HandleStats stats_;
+    HandleOptions options_;
+    ValueType value_type_;              // the creator's, from the header
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::string read_buffer_;
+    std::string key_buffer_;
     
-    SharedMemoryHeader* header_;
-    CacheSlot* slots_;
+    std::thread reaper_;
+    std::mutex reaper_mutex_;           // also guards the shards' table pointers
+    std::condition_variable reaper_cv_;
+    bool reaper_stop_;
+    
+    // watch(): a thread per handle reads every shard's change log while
+    // any watch is open and queues what matched for the JS thread
+    struct WatchPattern {
+        uint32_t id;
+        std::string pattern;
+        bool prefix;
+    };
+    struct PendingChanges {
+        std::unordered_set<std::string> keys;
+        bool all;                       // too many to list, or a clear()
+    };
+    std::thread watcher_;
+    std::atomic<bool> watcher_stop_;
+    SharedWake watch_wake_;             // on shard 0's watch_wake
+    std::mutex watch_mutex_;            // guards watches_, pending_ and delivery_queued_
+    std::vector<WatchPattern> watches_;
+    std::map<uint32_t, PendingChanges> pending_;
+    bool delivery_queued_;
+    uint32_t next_watch_id_;
+    Napi::ThreadSafeFunction watch_tsfn_;
     
     Napi::Value Set(const Napi::CallbackInfo& info);
     Napi::Value Get(const Napi::CallbackInfo& info);
+    Napi::Value SetBuffer(const Napi::CallbackInfo& info);
+    Napi::Value GetBuffer(const Napi::CallbackInfo& info);
+    Napi::Value GetInto(const Napi::CallbackInfo& info);
+    Napi::Value MGet(const Napi::CallbackInfo& info);
+    Napi::Value MSet(const Napi::CallbackInfo& info);
+    Napi::Value MDel(const Napi::CallbackInfo& info);
     Napi::Value Delete(const Napi::CallbackInfo& info);
     Napi::Value Has(const Napi::CallbackInfo& info);
+    Napi::Value IncrBy(const Napi::CallbackInfo& info);
+    Napi::Value CompareAndSet(const Napi::CallbackInfo& info);
+    Napi::Value GetOrSet(const Napi::CallbackInfo& info);
     Napi::Value Keys(const Napi::CallbackInfo& info);
     Napi::Value Entries(const Napi::CallbackInfo& info);
+    Napi::Value Scan(const Napi::CallbackInfo& info);
     Napi::Value Clear(const Napi::CallbackInfo& info);
     Napi::Value Size(const Napi::CallbackInfo& info);
     
-    uint32_t Hash(const std::string& key);
-    bool InitializeSharedMemory(const std::string& name, size_t max_keys, bool persist);
-    void CleanupSharedMemory();
+    Napi::Value Resize(const Napi::CallbackInfo& info);
+    Napi::Value MaxKeys(const Napi::CallbackInfo& info);
+    Napi::Value IncrByTyped(Napi::Env env, const std::string& key, Napi::Value delta, uint64_t expires_at);
+    Napi::Value GetValueType(const Napi::CallbackInfo& info);
+    Napi::Value Prefault(const Napi::CallbackInfo& info);
+    Napi::Value Snapshot(const Napi::CallbackInfo& info);
+    Napi::Value Restore(const Napi::CallbackInfo& info);
+    Napi::Value Flush(const Napi::CallbackInfo& info);
+    Napi::Value LockStats(const Napi::CallbackInfo& info);
+    Napi::Value Stats(const Napi::CallbackInfo& info);
+    Napi::Value KeysAsync(const Napi::CallbackInfo& info);
+    Napi::Value EntriesAsync(const Napi::CallbackInfo& info);
+    Napi::Value ClearAsync(const Napi::CallbackInfo& info);
+    Napi::Value Watch(const Napi::CallbackInfo& info);
+    Napi::Value Unwatch(const Napi::CallbackInfo& info);
+    
+    friend class PrefaultWorker;
+    friend class BulkWorker;
+    void PrefaultShards();
+    Napi::Value QueueBulk(Napi::Env env, int operation);
+    static uint64_t Hash(const std::string& key);
+    bool StoreValue(const std::string& key, uint64_t hash, const char* data, size_t length, uint64_t expires_at);
+    bool UpdateValue(const std::string& key, uint64_t hash, const std::string& value, uint64_t expires_at,
+                     ValueUpdate* update);
+    bool LoadValue(const std::string& key, uint64_t hash, char* value_out, size_t capacity, uint32_t* length_out);
+    bool RemoveValue(const std::string& key, uint64_t hash);
+    size_t ReapExpired(size_t groups);
+    void StartReaper(uint32_t interval_ms);
+    void StopReaper();
+    void NotifyChange(Shard* shard, const std::string& key);
+    void NotifyClear();
+    void WakeWatchers();
+    void StartWatcher(Napi::Env env, Napi::Function dispatch);
+    void StopWatcher();
+    void WatchLoop(std::vector<ChangeLog*> logs, std::vector<uint64_t> seen);
+    bool ReadChanges(ChangeLog* log, uint64_t* seen, uint32_t* stalls);
+    void MatchChange(const char* key, uint32_t key_length);
+    void DeliverChanges();
+    bool ReadKeys(Napi::Env env, Napi::Value value, std::vector<std::string>& keys, std::vector<uint64_t>& hashes);
+    void ReadKey(Napi::Env env, Napi::Value value, std::string& key);
+    bool ReadValue(Napi::Env env, Napi::Value value, std::string& bytes);
+    Napi::Value ValueToJs(Napi::Env env, const char* data, uint32_t length) const;
+    Shard* ShardFor(uint64_t hash) const;
+    bool RejectReadOnly(Napi::Env env) const;
+    bool OpenShards(const std::string& shm_name, size_t num_shards, const TableConfig& config, bool numa);
 };
 
 Napi::FunctionReference FastShmCache::constructor;
 
-// FNV-1a hash function
-uint32_t FastShmCache::Hash(const std::string& key) {
-    const uint32_t FNV_32_PRIME = 0x01000193;
-    uint32_t hash = 0x811c9dc5;
-    
-    for (char c : key) {
-        hash ^= static_cast<uint32_t>(c);
-        hash *= FNV_32_PRIME;
-    }
-    
-    return hash;
+uint64_t FastShmCache::Hash(const std::string& key) {
+    return HashKey(key);
 }
 
-bool FastShmCache::InitializeSharedMemory(const std::string& name, size_t max_keys, bool persist) {
-    shm_name_ = "/" + name;
-    shm_size_ = sizeof(SharedMemoryHeader) + (max_keys * sizeof(CacheSlot));
-    
-#ifdef _WIN32
-    // Windows implementation using CreateFileMapping
-    HANDLE hMapFile = CreateFileMappingA(
-        INVALID_HANDLE_VALUE,
-        NULL,
-        PAGE_READWRITE,
-        0,
-        shm_size_,
-        name.c_str()
-    );
-    
-    is_creator_ = (GetLastError() != ERROR_ALREADY_EXISTS);
-    
-    shm_ptr_ = MapViewOfFile(
-        hMapFile,
-        FILE_MAP_ALL_ACCESS,
-        0,
-        0,
-        shm_size_
-    );
-    
-    if (!shm_ptr_) {
+Shard* FastShmCache::ShardFor(uint64_t hash) const {
+    return shards_[ShardIndex(hash, shards_.size())].get();
+}
+
+// A read-only handle's mapping would fault on the first write, so
+// writing methods throw up front instead
+bool FastShmCache::RejectReadOnly(Napi::Env env) const {
+    if (!options_.read_only) {
         return false;
     }
-#else
-    // POSIX implementation
-    shm_fd_ = shm_open(shm_name_.c_str(), O_CREAT | O_RDWR, 0666);
-    if (shm_fd_ == -1) {
+    Napi::Error::New(env, "Cache is read-only").ThrowAsJavaScriptException();
+    return true;
+}
+
+bool FastShmCache::OpenShards(const std::string& shm_name, size_t num_shards, const TableConfig& config, bool numa) {
+    return fast_shm::OpenShards(shm_name, num_shards, config, numa, options_, reaper_mutex_, &shards_);
+}
+
+bool FastShmCache::StoreValue(const std::string& key, uint64_t hash, const char* data, size_t length,
+                              uint64_t expires_at) {
+    uint64_t started = stats_.SampleStart();
+    Shard* shard = ShardFor(hash);
+    bool stored = shard->StoreValue(key, hash, data, length, expires_at, nullptr);
+    stats_.SampleEnd(STAT_SET, started);
+    if (!stored) {
+        stats_.set_failures.Add(1);
         return false;
     }
-    
-    // Check if we're creating or attaching
-    struct stat sb;
-    if (fstat(shm_fd_, &sb) == 0 && sb.st_size == 0) {
-        is_creator_ = true;
-        if (ftruncate(shm_fd_, shm_size_) == -1) {
-            close(shm_fd_);
-            return false;
-        }
-    } else {
-        is_creator_ = false;
-    }
-    
-    shm_ptr_ = mmap(NULL, shm_size_, PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd_, 0);
-    if (shm_ptr_ == MAP_FAILED) {
-        close(shm_fd_);
+    stats_.sets.Add(1);
+    NotifyChange(shard, key);
+    return true;
+}
+
+// value bounds what the update may store, for the size checks up front
+bool FastShmCache::UpdateValue(const std::string& key, uint64_t hash, const std::string& value, uint64_t expires_at,
+                               ValueUpdate* update) {
+    uint64_t started = stats_.SampleStart();
+    Shard* shard = ShardFor(hash);
+    bool stored = shard->StoreValue(key, hash, value.data(), value.length(), expires_at, update);
+    stats_.SampleEnd(STAT_SET, started);
+    if (!stored) {
+        stats_.set_failures.Add(1);
         return false;
     }
-#endif
-    
-    header_ = static_cast<SharedMemoryHeader*>(shm_ptr_);
-    slots_ = reinterpret_cast<CacheSlot*>(static_cast<char*>(shm_ptr_) + sizeof(SharedMemoryHeader));
-    
-    // Initialize if we're the creator
-    if (is_creator_) {
-        memset(shm_ptr_, 0, shm_size_);
-        header_->max_keys = max_keys;
-        header_->num_entries.store(0);
-        pthread_mutex_init(&header_->global_mutex, NULL);
-        
-        for (size_t i = 0; i < max_keys; ++i) {
-            slots_[i].occupied.store(false);
-            pthread_mutex_init(&slots_[i].mutex, NULL);
-        }
+    if (update->applied) {
+        stats_.sets.Add(1);
+        NotifyChange(shard, key);
     }
-    
-    persist_ = persist;
-    
     return true;
 }
 
-void FastShmCache::CleanupSharedMemory() {
-#ifdef _WIN32
-    if (shm_ptr_) {
-        UnmapViewOfFile(shm_ptr_);
-    }
-#else
-    if (shm_ptr_ && shm_ptr_ != MAP_FAILED) {
-        munmap(shm_ptr_, shm_size_);
-    }
-    
-    if (shm_fd_ != -1) {
-        close(shm_fd_);
+bool FastShmCache::LoadValue(const std::string& key, uint64_t hash, char* value_out, size_t capacity,
+                             uint32_t* length_out) {
+    uint64_t started = stats_.SampleStart();
+    bool found = ShardFor(hash)->LoadValue(key, hash, value_out, capacity, length_out);
+    stats_.SampleEnd(STAT_GET, started);
+    (found ? stats_.hits : stats_.misses).Add(1);
+    return found;
+}
+
+bool FastShmCache::RemoveValue(const std::string& key, uint64_t hash) {
+    uint64_t started = stats_.SampleStart();
+    Shard* shard = ShardFor(hash);
+    bool removed = shard->RemoveValue(key, hash);
+    stats_.SampleEnd(STAT_DELETE, started);
+    if (!removed) {
+        return false;
     }
-    
-    // Only unlink if we're not persisting and we're the creator
-    if (is_creator_ && !shm_name_.empty() && !persist_) {
-        shm_unlink(shm_name_.c_str());
+    NotifyChange(shard, key);
+    return true;
+}
+
+// Called by the reaper thread with reaper_mutex_ held
+size_t FastShmCache::ReapExpired(size_t groups) {
+    size_t reclaimed = 0;
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        reclaimed += shard->ReapExpired(groups);
     }
-#endif
+    return reclaimed;
 }
 
-FastShmCache::FastShmCache(const Napi::CallbackInfo& info) 
-    : Napi::ObjectWrap<FastShmCache>(info), shm_ptr_(nullptr), shm_fd_(-1), is_creator_(false), persist_(false) {
+FastShmCache::FastShmCache(const Napi::CallbackInfo& info)
+    : Napi::ObjectWrap<FastShmCache>(info), persist_(false),
+      options_({READ_MODE_MUTEX, false, false, false, DEFAULT_LOCK_TIMEOUT_MS, &stats_}), value_type_(VALUE_STRING),
+      reaper_stop_(false), watcher_stop_(false), delivery_queued_(false), next_watch_id_(1) {
     
     Napi::Env env = info.Env();
     
@@ -194,6 +243,15 @@ FastShmCache::FastShmCache(const Napi::CallbackInfo& info)
     
     std::string name = "node_cache";
     size_t max_keys = DEFAULT_MAX_KEYS;
+    size_t max_value_size = DEFAULT_MAX_VALUE_SIZE;
+    size_t arena_size = 0;
+    EvictionPolicy eviction = EVICTION_NONE;
+    Probing probing = PROBING_LINEAR;
+    ValueType value_type = VALUE_STRING;
+    HugePages huge_pages = HUGE_PAGES_NONE;
+    uint32_t reap_interval = 0;
+    size_t num_shards = 1;
+    bool numa = false;
     bool persist = false;
     
     if (options.Has("name") && options.Get("name").IsString()) {
@@ -204,70 +262,231 @@ FastShmCache::FastShmCache(const Napi::CallbackInfo& info)
         max_keys = options.Get("maxKeys").As<Napi::Number>().Uint32Value();
     }
     
+    if (options.Has("maxValueSize") && options.Get("maxValueSize").IsNumber()) {
+        max_value_size = options.Get("maxValueSize").As<Napi::Number>().Uint32Value();
+    }
+    
+    if (options.Has("arenaSize") && options.Get("arenaSize").IsNumber()) {
+        arena_size = static_cast<size_t>(options.Get("arenaSize").As<Napi::Number>().DoubleValue());
+    }
+    
+    if (options.Has("shards") && options.Get("shards").IsNumber()) {
+        num_shards = options.Get("shards").As<Napi::Number>().Uint32Value();
+    }
+    
+    if (num_shards == 0 || num_shards > MAX_SHARDS) {
+        Napi::RangeError::New(env, "shards must be between 1 and 256").ThrowAsJavaScriptException();
+        return;
+    }
+    
+    if (options.Has("numa") && options.Get("numa").IsBoolean()) {
+        numa = options.Get("numa").As<Napi::Boolean>().Value();
+    }
+    
+    if (max_value_size == 0 || max_value_size > MAX_VALUE_SIZE_LIMIT) {
+        Napi::RangeError::New(env, "maxValueSize must be between 1 and 16 MB").ThrowAsJavaScriptException();
+        return;
+    }
+    
+    if (options.Has("valueType") && options.Get("valueType").IsString()) {
+        std::string type = options.Get("valueType").As<Napi::String>().Utf8Value();
+        if (type == "int64") {
+            value_type = VALUE_INT64;
+        } else if (type == "float64") {
+            value_type = VALUE_FLOAT64;
+        } else if (type != "string") {
+            Napi::TypeError::New(env, "valueType must be 'string', 'int64' or 'float64'").ThrowAsJavaScriptException();
+            return;
+        }
+    }
+    
+    // Limits are split evenly between shards
+    size_t shard_keys = (max_keys + num_shards - 1) / num_shards;
+    
+    // Typed values live in the slots, so those tables get no arena. By
+    // default budget what the old fixed 256-byte slots held. Pages are
+    // only backed once touched, so an unused arena costs address space only.
+    if (value_type != VALUE_STRING) {
+        max_value_size = sizeof(uint64_t);
+        arena_size = 0;
+    } else if (arena_size == 0) {
+        size_t per_slot = std::min(ChunkSize(SizeClassFor(max_value_size)), DEFAULT_ARENA_BYTES_PER_SLOT);
+        arena_size = AlignUp(shard_keys + 1, GROUP_WIDTH) * per_slot;
+    } else {
+        arena_size /= num_shards;
+    }
+    arena_size = AlignUp(arena_size + ARENA_ALIGN, CACHE_LINE_SIZE);
+    
+    if (arena_size > MAX_ARENA_SIZE) {
+        Napi::RangeError::New(env, "arenaSize must be at most 32 GB").ThrowAsJavaScriptException();
+        return;
+    }
+    
+    if (options.Has("eviction") && options.Get("eviction").IsString()) {
+        std::string policy = options.Get("eviction").As<Napi::String>().Utf8Value();
+        if (policy == "clock") {
+            eviction = EVICTION_CLOCK;
+        } else if (policy == "lru") {
+            eviction = EVICTION_LRU;
+        } else if (policy != "none") {
+            Napi::TypeError::New(env, "eviction must be 'none', 'clock' or 'lru'").ThrowAsJavaScriptException();
+            return;
+        }
+    }
+    
+    if (options.Has("probing") && options.Get("probing").IsString()) {
+        std::string strategy = options.Get("probing").As<Napi::String>().Utf8Value();
+        if (strategy == "robinhood") {
+            probing = PROBING_ROBIN_HOOD;
+        } else if (strategy != "linear") {
+            Napi::TypeError::New(env, "probing must be 'linear' or 'robinhood'").ThrowAsJavaScriptException();
+            return;
+        }
+    }
+    
+    if (options.Has("hugePages") && options.Get("hugePages").IsString()) {
+        std::string pages = options.Get("hugePages").As<Napi::String>().Utf8Value();
+        if (pages == "transparent") {
+            huge_pages = HUGE_PAGES_TRANSPARENT;
+        } else if (pages == "2mb") {
+            huge_pages = HUGE_PAGES_2MB;
+        } else if (pages == "1gb") {
+            huge_pages = HUGE_PAGES_1GB;
+        } else if (pages != "none") {
+            Napi::TypeError::New(env, "hugePages must be 'none', 'transparent', '2mb' or '1gb'")
+                .ThrowAsJavaScriptException();
+            return;
+        }
+    }
+    
+    // A file-backed cache lives at that path and outlives every handle
+    std::string shm_name = "/" + name;
+    if (options.Has("file") && options.Get("file").IsString()) {
+        shm_name = options.Get("file").As<Napi::String>().Utf8Value();
+        options_.file_backed = true;
+        persist = true;
+        if (HugePageBytes(huge_pages) != 0) {
+            Napi::TypeError::New(env, "hugePages '2mb' and '1gb' can't be combined with file")
+                .ThrowAsJavaScriptException();
+            return;
+        }
+    }
+    
+    if (options.Has("prefault") && options.Get("prefault").IsBoolean()) {
+        options_.prefault = options.Get("prefault").As<Napi::Boolean>().Value();
+    }
+    
+    if (options.Has("lockTimeout") && options.Get("lockTimeout").IsNumber()) {
+        options_.lock_timeout_ms = options.Get("lockTimeout").As<Napi::Number>().Uint32Value();
+    }
+    
+    if (options.Has("latencySampling") && options.Get("latencySampling").IsNumber()) {
+        stats_.sample_every = options.Get("latencySampling").As<Napi::Number>().Uint32Value();
+        stats_.sample_countdown = stats_.sample_every;
+    }
+    
     if (options.Has("persist") && options.Get("persist").IsBoolean()) {
-        persist = options.Get("persist").As<Napi::Boolean>().Value();
+        persist = options.Get("persist").As<Napi::Boolean>().Value() || options_.file_backed;
+    }
+    
+    if (options.Has("readMode") && options.Get("readMode").IsString()) {
+        std::string mode = options.Get("readMode").As<Napi::String>().Utf8Value();
+        if (mode == "seqlock") {
+            options_.read_mode = READ_MODE_SEQLOCK;
+        } else if (mode != "mutex") {
+            Napi::TypeError::New(env, "readMode must be 'mutex' or 'seqlock'").ThrowAsJavaScriptException();
+            return;
+        }
+    }
+    
+    if (options.Has("reapInterval") && options.Get("reapInterval").IsNumber()) {
+        reap_interval = options.Get("reapInterval").As<Napi::Number>().Uint32Value();
+    }
+    
+    // Read-only handles map the segment PROT_READ and read every slot by
+    // seqlock, as the locks can't be taken
+    if (options.Has("readOnly") && options.Get("readOnly").IsBoolean()) {
+        options_.read_only = options.Get("readOnly").As<Napi::Boolean>().Value();
+    }
+    if (options_.read_only) {
+        options_.read_mode = READ_MODE_SEQLOCK;
+        if (reap_interval > 0) {
+            Napi::TypeError::New(env, "reapInterval can't be combined with readOnly").ThrowAsJavaScriptException();
+            return;
+        }
     }
     
-    if (!InitializeSharedMemory(name, max_keys, persist)) {
+    TableConfig config;
+    config.max_keys = shard_keys;
+    config.max_value_size = max_value_size;
+    config.arena_size = arena_size;
+    config.eviction = eviction;
+    config.probing = probing;
+    config.value_type = value_type;
+    config.num_shards = static_cast<uint32_t>(num_shards);
+    config.numa_node = -1;
+    config.huge_pages = huge_pages;
+    
+    persist_ = persist;
+    if (!OpenShards(shm_name, num_shards, config, numa)) {
+        if (options_.read_only) {
+            std::string reason = strerror(errno);
+            Napi::Error::New(env, "Failed to attach read-only: " + reason).ThrowAsJavaScriptException();
+            return;
+        }
+        if (HugePageBytes(huge_pages) != 0) {
+            std::string reason = errno == ENOENT ? "no hugetlbfs mount with that page size" : strerror(errno);
+            Napi::Error::New(env, "Failed to map huge pages: " + reason).ThrowAsJavaScriptException();
+            return;
+        }
         Napi::Error::New(env, "Failed to initialize shared memory").ThrowAsJavaScriptException();
+        return;
+    }
+    
+    watch_wake_.Open(&shards_[0]->change_log()->watch_wake, shm_name, options_.file_backed, ":watch");
+    
+    // Values are copied here before becoming JS values
+    read_buffer_.resize(shards_[0]->base_header()->max_value_size);
+    value_type_ = static_cast<ValueType>(shards_[0]->base_header()->value_type);
+    key_buffer_.reserve(MAX_KEY_SIZE);
+    
+    if (reap_interval > 0) {
+        StartReaper(reap_interval);
     }
 }
 
 FastShmCache::~FastShmCache() {
-    CleanupSharedMemory();
+    StopReaper();
+    StopWatcher();
+    
+    // Only unlink if we're not persisting and we created the named
+    // segment. Every shard and generation goes with it.
+    if (!shards_.empty() && shards_[0]->is_creator() && !persist_) {
+        for (const std::unique_ptr<Shard>& shard : shards_) {
+            shard->Unlink();
+        }
+    }
 }
 
 Napi::Value FastShmCache::Set(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     
-    if (info.Length() < 2 || !info[0].IsString() || !info[1].IsString()) {
+    if (RejectReadOnly(env)) {
+        return env.Undefined();
+    }
+    
+    if (info.Length() < 2 || !info[0].IsString()) {
         Napi::TypeError::New(env, "Expected set(key: string, value: string)").ThrowAsJavaScriptException();
         return Napi::Boolean::New(env, false);
     }
     
     std::string key = info[0].As<Napi::String>().Utf8Value();
-    std::string value = info[1].As<Napi::String>().Utf8Value();
-    
-    if (key.length() >= MAX_KEY_SIZE || value.length() >= MAX_VALUE_SIZE) {
+    std::string value;
+    if (!ReadValue(env, info[1], value)) {
         return Napi::Boolean::New(env, false);
     }
     
-    uint32_t hash = Hash(key);
-    size_t start_index = hash % header_->max_keys;
-    
-    // Linear probing with wrap-around
-    for (size_t i = 0; i < header_->max_keys; ++i) {
-        size_t index = (start_index + i) % header_->max_keys;
-        CacheSlot& slot = slots_[index];
-        
-        pthread_mutex_lock(&slot.mutex);
-        
-        // Check if slot is empty or has the same key
-        if (!slot.occupied.load() || strncmp(slot.key, key.c_str(), MAX_KEY_SIZE) == 0) {
-            bool was_new = !slot.occupied.load();
-            
-            strncpy(slot.key, key.c_str(), MAX_KEY_SIZE - 1);
-            slot.key[MAX_KEY_SIZE - 1] = '\0';
-            
-            strncpy(slot.value, value.c_str(), MAX_VALUE_SIZE - 1);
-            slot.value[MAX_VALUE_SIZE - 1] = '\0';
-            
-            slot.timestamp.store(std::chrono::system_clock::now().time_since_epoch().count());
-            slot.occupied.store(true);
-            
-            if (was_new) {
-                header_->num_entries.fetch_add(1);
-            }
-            
-            pthread_mutex_unlock(&slot.mutex);
-            return Napi::Boolean::New(env, true);
-        }
-        
-        pthread_mutex_unlock(&slot.mutex);
-    }
-    
-    // Hash table is full
-    return Napi::Boolean::New(env, false);
+    return Napi::Boolean::New(env, StoreValue(key, Hash(key), value.data(), value.length(), ExpiryFrom(info[2])));
 }
 
 Napi::Value FastShmCache::Get(const Napi::CallbackInfo& info) {
@@ -279,211 +498,1494 @@ Napi::Value FastShmCache::Get(const Napi::CallbackInfo& info) {
     }
     
     std::string key = info[0].As<Napi::String>().Utf8Value();
+    uint32_t length = 0;
     
-    if (key.length() >= MAX_KEY_SIZE) {
+    if (!LoadValue(key, Hash(key), &read_buffer_[0], read_buffer_.size(), &length)) {
         return env.Undefined();
     }
     
-    uint32_t hash = Hash(key);
-    size_t start_index = hash % header_->max_keys;
+    return ValueToJs(env, read_buffer_.data(), length);
+}
+
+// Typed tables take numbers, and BigInts for int64, as their 8 native
+// bytes; string tables take strings. Throws and returns false otherwise.
+bool FastShmCache::ReadValue(Napi::Env env, Napi::Value value, std::string& bytes) {
+    if (value_type_ == VALUE_STRING) {
+        if (!value.IsString()) {
+            Napi::TypeError::New(env, "Value must be a string").ThrowAsJavaScriptException();
+            return false;
+        }
+        bytes = value.As<Napi::String>().Utf8Value();
+        return true;
+    }
     
-    // Linear probing with wrap-around
-    for (size_t i = 0; i < header_->max_keys; ++i) {
-        size_t index = (start_index + i) % header_->max_keys;
-        CacheSlot& slot = slots_[index];
-        
-        pthread_mutex_lock(&slot.mutex);
-        
-        if (slot.occupied.load() && strncmp(slot.key, key.c_str(), MAX_KEY_SIZE) == 0) {
-            std::string value(slot.value);
-            pthread_mutex_unlock(&slot.mutex);
-            return Napi::String::New(env, value);
+    if (value_type_ == VALUE_FLOAT64) {
+        if (!value.IsNumber()) {
+            Napi::TypeError::New(env, "Value must be a number").ThrowAsJavaScriptException();
+            return false;
         }
-        
-        // If we hit an empty slot, key doesn't exist
-        // if (!slot.occupied.load()) {
-        //     pthread_mutex_unlock(&slot.mutex);
-        //     break;
-        // }
-        
-        pthread_mutex_unlock(&slot.mutex);
+        double number = value.As<Napi::Number>().DoubleValue();
+        bytes.assign(reinterpret_cast<const char*>(&number), sizeof(number));
+        return true;
     }
     
-    return env.Undefined();
+    int64_t integer = 0;
+    bool exact = false;
+    if (value.IsBigInt()) {
+        integer = value.As<Napi::BigInt>().Int64Value(&exact);
+    } else if (value.IsNumber()) {
+        double number = value.As<Napi::Number>().DoubleValue();
+        exact = number >= -MAX_COUNTER && number <= MAX_COUNTER &&
+                number == static_cast<double>(static_cast<int64_t>(number));
+        integer = exact ? static_cast<int64_t>(number) : 0;
+    }
+    if (!exact) {
+        Napi::TypeError::New(env, "Value must be a BigInt or a safe integer").ThrowAsJavaScriptException();
+        return false;
+    }
+    bytes.assign(reinterpret_cast<const char*>(&integer), sizeof(integer));
+    return true;
 }
 
-Napi::Value FastShmCache::Delete(const Napi::CallbackInfo& info) {
+Napi::Value FastShmCache::ValueToJs(Napi::Env env, const char* data, uint32_t length) const {
+    if (value_type_ == VALUE_INT64) {
+        int64_t integer;
+        memcpy(&integer, data, sizeof(integer));
+        return Napi::BigInt::New(env, integer);
+    }
+    if (value_type_ == VALUE_FLOAT64) {
+        double number;
+        memcpy(&number, data, sizeof(number));
+        return Napi::Number::New(env, number);
+    }
+    return Napi::String::New(env, data, length);
+}
+
+// Reads a string key with a single copy and no allocation beyond what
+// `key` already holds. Keys that don't fit come back MAX_KEY_SIZE bytes
+// long so lookups reject them.
+void FastShmCache::ReadKey(Napi::Env env, Napi::Value value, std::string& key) {
+    // A few spare bytes so a truncated multi-byte character still shows
+    // the key as too long
+    char buffer[MAX_KEY_SIZE + 4];
+    size_t length = MAX_KEY_SIZE;
+    
+    napi_get_value_string_utf8(env, value, buffer, sizeof(buffer), &length);
+    key.assign(buffer, std::min(length, MAX_KEY_SIZE));
+}
+
+Napi::Value FastShmCache::SetBuffer(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     
-    if (info.Length() < 1 || !info[0].IsString()) {
-        Napi::TypeError::New(env, "Expected delete(key: string)").ThrowAsJavaScriptException();
+    if (RejectReadOnly(env)) {
+        return env.Undefined();
+    }
+    
+    if (info.Length() < 2 || !info[0].IsString() || !info[1].IsBuffer()) {
+        Napi::TypeError::New(env, "Expected setBuffer(key: string, value: Buffer)").ThrowAsJavaScriptException();
         return Napi::Boolean::New(env, false);
     }
     
-    std::string key = info[0].As<Napi::String>().Utf8Value();
+    ReadKey(env, info[0], key_buffer_);
+    Napi::Buffer<char> value = info[1].As<Napi::Buffer<char>>();
     
-    if (key.length() >= MAX_KEY_SIZE) {
-        return Napi::Boolean::New(env, false);
+    return Napi::Boolean::New(env, StoreValue(key_buffer_, Hash(key_buffer_), value.Data(), value.Length(),
+                                              ExpiryFrom(info[2])));
+}
+
+Napi::Value FastShmCache::GetBuffer(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (info.Length() < 1 || !info[0].IsString()) {
+        Napi::TypeError::New(env, "Expected getBuffer(key: string)").ThrowAsJavaScriptException();
+        return env.Undefined();
     }
     
-    uint32_t hash = Hash(key);
-    size_t start_index = hash % header_->max_keys;
+    ReadKey(env, info[0], key_buffer_);
+    uint32_t length = 0;
     
-    for (size_t i = 0; i < header_->max_keys; ++i) {
-        size_t index = (start_index + i) % header_->max_keys;
-        CacheSlot& slot = slots_[index];
-        
-        pthread_mutex_lock(&slot.mutex);
-        
-        if (slot.occupied.load() && strncmp(slot.key, key.c_str(), MAX_KEY_SIZE) == 0) {
-            slot.occupied.store(false);
-            memset(slot.key, 0, MAX_KEY_SIZE);
-            memset(slot.value, 0, MAX_VALUE_SIZE);
-            header_->num_entries.fetch_sub(1);
-            pthread_mutex_unlock(&slot.mutex);
-            return Napi::Boolean::New(env, true);
-        }
-        
-        // if (!slot.occupied.load()) {
-        //     pthread_mutex_unlock(&slot.mutex);
-        //     break;
-        // }
-        
-        pthread_mutex_unlock(&slot.mutex);
+    if (!LoadValue(key_buffer_, Hash(key_buffer_), &read_buffer_[0], read_buffer_.size(), &length)) {
+        return env.Undefined();
     }
     
-    return Napi::Boolean::New(env, false);
+    return Napi::Buffer<char>::Copy(env, read_buffer_.data(), length);
 }
 
-Napi::Value FastShmCache::Has(const Napi::CallbackInfo& info) {
+// Copies the value straight into a caller-owned buffer. Returns the value
+// length; when that exceeds the target's length nothing is copied, so the
+// caller can grow the buffer and retry.
+Napi::Value FastShmCache::GetInto(const Napi::CallbackInfo& info) {
     Napi::Env env = info.Env();
     
-    if (info.Length() < 1 || !info[0].IsString()) {
-        Napi::TypeError::New(env, "Expected has(key: string)").ThrowAsJavaScriptException();
-        return Napi::Boolean::New(env, false);
+    if (info.Length() < 2 || !info[0].IsString() || !info[1].IsBuffer()) {
+        Napi::TypeError::New(env, "Expected getInto(key: string, target: Buffer)").ThrowAsJavaScriptException();
+        return env.Undefined();
     }
     
-    std::string key = info[0].As<Napi::String>().Utf8Value();
+    ReadKey(env, info[0], key_buffer_);
+    Napi::Buffer<char> target = info[1].As<Napi::Buffer<char>>();
+    uint32_t length = 0;
+    
+    if (!LoadValue(key_buffer_, Hash(key_buffer_), target.Data(), target.Length(), &length)) {
+        return env.Undefined();
+    }
+    
+    return Napi::Number::New(env, length);
+}
+
+Napi::Value FastShmCache::Delete(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
     
-    if (key.length() >= MAX_KEY_SIZE) {
+    if (RejectReadOnly(env)) {
+        return env.Undefined();
+    }
+    
+    if (info.Length() < 1 || !info[0].IsString()) {
+        Napi::TypeError::New(env, "Expected delete(key: string)").ThrowAsJavaScriptException();
         return Napi::Boolean::New(env, false);
     }
     
-    uint32_t hash = Hash(key);
-    size_t start_index = hash % header_->max_keys;
+    std::string key = info[0].As<Napi::String>().Utf8Value();
     
-    for (size_t i = 0; i < header_->max_keys; ++i) {
-        size_t index = (start_index + i) % header_->max_keys;
-        CacheSlot& slot = slots_[index];
-        
-        pthread_mutex_lock(&slot.mutex);
-        
-        if (slot.occupied.load() && strncmp(slot.key, key.c_str(), MAX_KEY_SIZE) == 0) {
-            pthread_mutex_unlock(&slot.mutex);
-            return Napi::Boolean::New(env, true);
+    return Napi::Boolean::New(env, RemoveValue(key, Hash(key)));
+}
+
+// Runs ReapExpired on a native thread every interval_ms until the handle
+// goes away. Only slot locks are taken, so it never stalls inserts. The
+// mutex stays held while reaping so RefreshTables can't unmap a table
+// from under it.
+void FastShmCache::StartReaper(uint32_t interval_ms) {
+    reaper_stop_ = false;
+    reaper_ = std::thread([this, interval_ms]() {
+        std::unique_lock<std::mutex> lock(reaper_mutex_);
+        while (!reaper_cv_.wait_for(lock, std::chrono::milliseconds(interval_ms), [this]() { return reaper_stop_; })) {
+            ReapExpired(REAP_GROUPS_PER_TICK);
         }
-        
-        // if (!slot.occupied.load()) {
-        //     pthread_mutex_unlock(&slot.mutex);
-        //     break;
-        // }
-        
-        pthread_mutex_unlock(&slot.mutex);
+    });
+}
+
+void FastShmCache::StopReaper() {
+    if (!reaper_.joinable()) {
+        return;
     }
     
-    return Napi::Boolean::New(env, false);
+    {
+        std::lock_guard<std::mutex> lock(reaper_mutex_);
+        reaper_stop_ = true;
+    }
+    reaper_cv_.notify_one();
+    reaper_.join();
 }
 
-Napi::Value FastShmCache::Keys(const Napi::CallbackInfo& info) {
-    Napi::Env env = info.Env();
-    Napi::Array keys = Napi::Array::New(env);
+void FastShmCache::NotifyChange(Shard* shard, const std::string& key) {
+    if (shard->LogChange(key.data(), static_cast<uint32_t>(key.size()))) {
+        WakeWatchers();
+    }
+}
+
+void FastShmCache::NotifyClear() {
+    bool logged = false;
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        logged = shard->LogChange(nullptr, CHANGE_ALL) || logged;
+    }
+    if (logged) {
+        WakeWatchers();
+    }
+}
+
+// Watch threads in every process sleep on shard 0's watch_wake, and only
+// once they have found nothing new, so a burst of writes makes one
+// syscall rather than one each
+void FastShmCache::WakeWatchers() {
+    ChangeLog* log = shards_[0]->change_log();
+    uint32_t sleepers = log->watch_sleepers.load();
+    if (sleepers > 0) {
+        log->watch_wake.fetch_add(1);
+        watch_wake_.Wake(sleepers);
+    }
+}
+
+// The thread keeps the shards' change logs, which stay mapped for the
+// handle's lifetime, so it never touches the shards' table pointers
+void FastShmCache::StartWatcher(Napi::Env env, Napi::Function dispatch) {
+    if (watcher_.joinable()) {
+        return;
+    }
     
-    size_t key_index = 0;
-    for (size_t i = 0; i < header_->max_keys; ++i) {
-        CacheSlot& slot = slots_[i];
-        
-        pthread_mutex_lock(&slot.mutex);
-        if (slot.occupied.load()) {
-            keys[key_index++] = Napi::String::New(env, slot.key);
-        }
-        pthread_mutex_unlock(&slot.mutex);
+    // Whatever is written once watch() returns is reported
+    std::vector<ChangeLog*> logs;
+    std::vector<uint64_t> seen;
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        logs.push_back(shard->change_log());
+        logs.back()->watchers.fetch_add(1);
+        seen.push_back(logs.back()->change_seq.load());
+    }
+    watch_tsfn_ = Napi::ThreadSafeFunction::New(env, dispatch, "fast-shm-cache watch", 0, 1);
+    watcher_stop_.store(false);
+    watcher_ = std::thread(&FastShmCache::WatchLoop, this, logs, seen);
+}
+
+void FastShmCache::StopWatcher() {
+    if (!watcher_.joinable()) {
+        return;
     }
     
-    return keys;
+    // Other processes' watch threads wake too, find nothing and sleep again
+    ChangeLog* log = shards_[0]->change_log();
+    watcher_stop_.store(true);
+    log->watch_wake.fetch_add(1);
+    watch_wake_.Wake(log->watch_sleepers.load());
+    watcher_.join();
+    
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        shard->change_log()->watchers.fetch_sub(1);
+    }
+    // Drops a delivery still queued, so it can't outlive the handle
+    watch_tsfn_.Abort();
+    std::lock_guard<std::mutex> lock(watch_mutex_);
+    pending_.clear();
+    delivery_queued_ = false;
 }
 
-Napi::Value FastShmCache::Entries(const Napi::CallbackInfo& info) {
-    Napi::Env env = info.Env();
-    Napi::Array entries = Napi::Array::New(env);
+void FastShmCache::WatchLoop(std::vector<ChangeLog*> logs, std::vector<uint64_t> seen) {
+    ChangeLog* wake = logs[0];
+    std::vector<uint32_t> stalls(logs.size(), 0);
     
-    size_t entry_index = 0;
-    for (size_t i = 0; i < header_->max_keys; ++i) {
-        CacheSlot& slot = slots_[i];
+    while (!watcher_stop_.load()) {
+        bool changed = false;
+        for (size_t i = 0; i < logs.size(); ++i) {
+            changed = ReadChanges(logs[i], &seen[i], &stalls[i]) || changed;
+        }
+        if (changed) {
+            DeliverChanges();
+        }
         
-        pthread_mutex_lock(&slot.mutex);
-        if (slot.occupied.load()) {
-            Napi::Array pair = Napi::Array::New(env, 2);
-            pair[0u] = Napi::String::New(env, slot.key);
-            pair[1u] = Napi::String::New(env, slot.value);
-            entries[entry_index++] = pair;
+        // Register as a sleeper before the last look, so a writer either
+        // sees us or we see its change
+        wake->watch_sleepers.fetch_add(1);
+        uint32_t word = wake->watch_wake.load();
+        bool idle = !changed && !watcher_stop_.load();
+        for (size_t i = 0; idle && i < logs.size(); ++i) {
+            idle = logs[i]->change_seq.load() == seen[i];
+        }
+        if (idle) {
+            watch_wake_.Wait(word, 0);
+        }
+        wake->watch_sleepers.fetch_sub(1);
+        
+        // Let a burst pile up rather than handing JS one key at a time;
+        // writers don't wake anyone meanwhile
+        if (!watcher_stop_.load()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(WATCH_COALESCE_MS));
         }
-        pthread_mutex_unlock(&slot.mutex);
     }
-    
-    return entries;
 }
 
-Napi::Value FastShmCache::Clear(const Napi::CallbackInfo& info) {
-    Napi::Env env = info.Env();
-    
-    pthread_mutex_lock(&header_->global_mutex);
+// Matches the records a shard has logged since *seen. Returns whether
+// there were any. A record still being written is waited for, for about
+// a second; one whose writer died, or that was reused before it was read,
+// is reported as a change to everything.
+bool FastShmCache::ReadChanges(ChangeLog* log, uint64_t* seen, uint32_t* stalls) {
+    uint64_t end = log->change_seq.load();
+    if (end - *seen > CHANGE_LOG_SIZE) {
+        *seen = end;
+        MatchChange(nullptr, CHANGE_ALL);
+        return true;
+    }
     
-    for (size_t i = 0; i < header_->max_keys; ++i) {
-        CacheSlot& slot = slots_[i];
-        pthread_mutex_lock(&slot.mutex);
-        
-        if (slot.occupied.load()) {
-            slot.occupied.store(false);
-            memset(slot.key, 0, MAX_KEY_SIZE);
-            memset(slot.value, 0, MAX_VALUE_SIZE);
+    bool changed = false;
+    char key[MAX_KEY_SIZE];
+    while (*seen < end) {
+        ChangeRecord& record = log->changes[*seen & (CHANGE_LOG_SIZE - 1)];
+        uint64_t done = 2 * *seen + 2;
+        uint64_t stamp = record.stamp.load(std::memory_order_acquire);
+        if (stamp < done && ++*stalls < 1000) {
+            break;
         }
         
-        pthread_mutex_unlock(&slot.mutex);
+        uint32_t key_length = record.key_length;
+        if (key_length != CHANGE_ALL) {
+            key_length = std::min(key_length, static_cast<uint32_t>(MAX_KEY_SIZE));
+            memcpy(key, record.key, key_length);
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (stamp != done || record.stamp.load(std::memory_order_relaxed) != done) {
+            key_length = CHANGE_ALL;
+        }
+        MatchChange(key, key_length);
+        *stalls = 0;
+        ++*seen;
+        changed = true;
     }
-    
-    header_->num_entries.store(0);
-    pthread_mutex_unlock(&header_->global_mutex);
-    
-    return env.Undefined();
+    return changed;
 }
 
-Napi::Value FastShmCache::Size(const Napi::CallbackInfo& info) {
-    Napi::Env env = info.Env();
-    return Napi::Number::New(env, header_->num_entries.load());
+void FastShmCache::MatchChange(const char* key, uint32_t key_length) {
+    std::lock_guard<std::mutex> lock(watch_mutex_);
+    for (const WatchPattern& watch : watches_) {
+        bool all = key_length == CHANGE_ALL;
+        if (!all && (watch.prefix ? key_length < watch.pattern.size() : key_length != watch.pattern.size())) {
+            continue;
+        }
+        if (!all && memcmp(key, watch.pattern.data(), watch.pattern.size()) != 0) {
+            continue;
+        }
+        
+        PendingChanges& pending = pending_[watch.id];
+        if (!all && !pending.all) {
+            pending.keys.insert(std::string(key, key_length));
+            all = pending.keys.size() > WATCH_MAX_KEYS;
+        }
+        if (all) {
+            pending.all = true;
+            pending.keys.clear();
+        }
+    }
+}
+
+// Hands what has matched to JS, unless a hand-off is already queued: that
+// one will take everything matched until it runs
+void FastShmCache::DeliverChanges() {
+    std::lock_guard<std::mutex> lock(watch_mutex_);
+    if (pending_.empty() || delivery_queued_) {
+        return;
+    }
+    delivery_queued_ = true;
+    
+    watch_tsfn_.NonBlockingCall([this](Napi::Env env, Napi::Function dispatch) {
+        std::map<uint32_t, PendingChanges> batch;
+        {
+            std::lock_guard<std::mutex> lock(watch_mutex_);
+            batch.swap(pending_);
+            delivery_queued_ = false;
+        }
+        
+        Napi::Array changes = Napi::Array::New(env, batch.size());
+        uint32_t index = 0;
+        for (const std::pair<const uint32_t, PendingChanges>& entry : batch) {
+            Napi::Array change = Napi::Array::New(env, 2);
+            change[0u] = Napi::Number::New(env, entry.first);
+            if (entry.second.all) {
+                change[1u] = env.Null();
+            } else {
+                Napi::Array keys = Napi::Array::New(env, entry.second.keys.size());
+                uint32_t key_index = 0;
+                for (const std::string& key : entry.second.keys) {
+                    keys[key_index++] = Napi::String::New(env, key);
+                }
+                change[1u] = keys;
+            }
+            changes[index++] = change;
+        }
+        dispatch.Call({changes});
+    });
+}
+
+// Starts reporting writes to the key `pattern`, or to keys starting with
+// it when prefix is set, through dispatch([[id, keys | null], ...]).
+// While any watch is open the handle keeps the event loop alive.
+Napi::Value FastShmCache::Watch(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (RejectReadOnly(env)) {
+        return env.Undefined();
+    }
+    
+    if (info.Length() < 3 || !info[0].IsString() || !info[1].IsBoolean() || !info[2].IsFunction()) {
+        Napi::TypeError::New(env, "Expected watch(pattern: string, prefix: boolean, dispatch: function)")
+            .ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    
+    WatchPattern watch = {next_watch_id_++, info[0].As<Napi::String>().Utf8Value(),
+                          info[1].As<Napi::Boolean>().Value()};
+    {
+        std::lock_guard<std::mutex> lock(watch_mutex_);
+        watches_.push_back(watch);
+    }
+    StartWatcher(env, info[2].As<Napi::Function>());
+    return Napi::Number::New(env, watch.id);
+}
+
+// Closes a watch; the last one stops the thread. True if it was open.
+Napi::Value FastShmCache::Unwatch(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (info.Length() < 1 || !info[0].IsNumber()) {
+        Napi::TypeError::New(env, "Expected unwatch(id: number)").ThrowAsJavaScriptException();
+        return Napi::Boolean::New(env, false);
+    }
+    
+    uint32_t id = info[0].As<Napi::Number>().Uint32Value();
+    bool found = false;
+    bool last = false;
+    {
+        std::lock_guard<std::mutex> lock(watch_mutex_);
+        for (size_t i = 0; i < watches_.size(); ++i) {
+            if (watches_[i].id == id) {
+                watches_.erase(watches_.begin() + i);
+                found = true;
+                break;
+            }
+        }
+        pending_.erase(id);
+        last = watches_.empty();
+    }
+    if (last) {
+        StopWatcher();
+    }
+    return Napi::Boolean::New(env, found);
+}
+
+// Reads an array of string keys and their hashes, for PipelineLookups.
+// Throws and returns false if anything else is found.
+bool FastShmCache::ReadKeys(Napi::Env env, Napi::Value value, std::vector<std::string>& keys,
+                            std::vector<uint64_t>& hashes) {
+    Napi::Array array = value.As<Napi::Array>();
+    uint32_t count = array.Length();
+    keys.reserve(count);
+    hashes.reserve(count);
+    
+    for (uint32_t i = 0; i < count; ++i) {
+        Napi::Value key = array.Get(i);
+        if (!key.IsString()) {
+            Napi::TypeError::New(env, "Keys must be strings").ThrowAsJavaScriptException();
+            return false;
+        }
+        keys.push_back(std::string());
+        ReadKey(env, key, keys.back());
+        hashes.push_back(Hash(keys.back()));
+    }
+    
+    return true;
+}
+
+Napi::Value FastShmCache::MGet(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (info.Length() < 1 || !info[0].IsArray()) {
+        Napi::TypeError::New(env, "Expected mget(keys: string[])").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    
+    std::vector<std::string> keys;
+    std::vector<uint64_t> hashes;
+    if (!ReadKeys(env, info[0], keys, hashes)) {
+        return env.Undefined();
+    }
+    
+    Napi::Array values = Napi::Array::New(env, keys.size());
+    PipelineLookups(hashes.data(), hashes.size(), [this](uint64_t hash) { return ShardFor(hash); }, [&](size_t i) {
+        uint32_t length = 0;
+        if (LoadValue(keys[i], hashes[i], &read_buffer_[0], read_buffer_.size(), &length)) {
+            values[i] = ValueToJs(env, read_buffer_.data(), length);
+        } else {
+            values[i] = env.Undefined();
+        }
+    });
+    
+    return values;
+}
+
+// Entries are [key, value, ttlMs?] tuples; values may be strings or Buffers.
+// Returns one boolean per entry, as set() would.
+Napi::Value FastShmCache::MSet(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (RejectReadOnly(env)) {
+        return env.Undefined();
+    }
+    
+    if (info.Length() < 1 || !info[0].IsArray()) {
+        Napi::TypeError::New(env, "Expected mset(entries: [key, value][])").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    
+    Napi::Array entries = info[0].As<Napi::Array>();
+    uint32_t count = entries.Length();
+    std::vector<std::string> keys;
+    std::vector<uint64_t> hashes;
+    std::vector<Napi::Value> values;
+    std::vector<uint64_t> expiries;
+    std::string scratch;
+    keys.reserve(count);
+    hashes.reserve(count);
+    values.reserve(count);
+    expiries.reserve(count);
+    
+    for (uint32_t i = 0; i < count; ++i) {
+        Napi::Value entry = entries.Get(i);
+        if (!entry.IsArray()) {
+            Napi::TypeError::New(env, "Entries must be [key, value] pairs").ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+        
+        Napi::Array pair = entry.As<Napi::Array>();
+        Napi::Value key = pair.Get(0u);
+        Napi::Value value = pair.Get(1u);
+        if (!key.IsString() || !(value.IsString() || value.IsBuffer() || value_type_ != VALUE_STRING)) {
+            Napi::TypeError::New(env, "Entries must be [string, string | Buffer] pairs").ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+        // Checked up front, so a bad value stores nothing
+        if (!value.IsBuffer() && value_type_ != VALUE_STRING && !ReadValue(env, value, scratch)) {
+            return env.Undefined();
+        }
+        
+        keys.push_back(std::string());
+        ReadKey(env, key, keys.back());
+        hashes.push_back(Hash(keys.back()));
+        values.push_back(value);
+        expiries.push_back(ExpiryFrom(pair.Get(2u)));
+    }
+    
+    Napi::Array results = Napi::Array::New(env, count);
+    PipelineLookups(hashes.data(), count, [this](uint64_t hash) { return ShardFor(hash); }, [&](size_t i) {
+        bool stored;
+        if (values[i].IsBuffer()) {
+            Napi::Buffer<char> value = values[i].As<Napi::Buffer<char>>();
+            stored = StoreValue(keys[i], hashes[i], value.Data(), value.Length(), expiries[i]);
+        } else {
+            ReadValue(env, values[i], scratch);
+            stored = StoreValue(keys[i], hashes[i], scratch.data(), scratch.length(), expiries[i]);
+        }
+        results[i] = Napi::Boolean::New(env, stored);
+    });
+    
+    return results;
+}
+
+// Returns how many of the keys were present and removed.
+Napi::Value FastShmCache::MDel(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (RejectReadOnly(env)) {
+        return env.Undefined();
+    }
+    
+    if (info.Length() < 1 || !info[0].IsArray()) {
+        Napi::TypeError::New(env, "Expected mdel(keys: string[])").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    
+    std::vector<std::string> keys;
+    std::vector<uint64_t> hashes;
+    if (!ReadKeys(env, info[0], keys, hashes)) {
+        return env.Undefined();
+    }
+    
+    size_t removed = 0;
+    PipelineLookups(hashes.data(), hashes.size(), [this](uint64_t hash) { return ShardFor(hash); }, [&](size_t i) {
+        if (RemoveValue(keys[i], hashes[i])) {
+            ++removed;
+        }
+    });
+    
+    return Napi::Number::New(env, removed);
+}
+
+Napi::Value FastShmCache::Has(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (info.Length() < 1 || !info[0].IsString()) {
+        Napi::TypeError::New(env, "Expected has(key: string)").ThrowAsJavaScriptException();
+        return Napi::Boolean::New(env, false);
+    }
+    
+    std::string key = info[0].As<Napi::String>().Utf8Value();
+    
+    return Napi::Boolean::New(env, LoadValue(key, Hash(key), nullptr, 0, nullptr));
+}
+
+// Adds delta to the integer at key in one probe, under the slot lock,
+// and returns the result. Undefined if the value isn't an integer, the
+// result would pass 2^53, or there is no room. ttlMs only applies when
+// the counter is created.
+Napi::Value FastShmCache::IncrBy(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (RejectReadOnly(env)) {
+        return env.Undefined();
+    }
+    
+    if (info.Length() < 2 || !info[0].IsString() || !(info[1].IsNumber() || info[1].IsBigInt())) {
+        Napi::TypeError::New(env, "Expected incrBy(key: string, delta: number)").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    
+    std::string key = info[0].As<Napi::String>().Utf8Value();
+    if (value_type_ != VALUE_STRING) {
+        return IncrByTyped(env, key, info[1], ExpiryFrom(info[2]));
+    }
+    if (!info[1].IsNumber()) {
+        Napi::TypeError::New(env, "delta must be a number").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    double delta = info[1].As<Napi::Number>().DoubleValue();
+    if (!(delta >= -MAX_COUNTER && delta <= MAX_COUNTER) || delta != static_cast<double>(static_cast<int64_t>(delta))) {
+        Napi::RangeError::New(env, "delta must be a safe integer").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    
+    CounterUpdate update(static_cast<int64_t>(delta));
+    if (!UpdateValue(key, Hash(key), std::string(), ExpiryFrom(info[2]), &update) || !update.valid()) {
+        return env.Undefined();
+    }
+    return Napi::Number::New(env, static_cast<double>(update.result()));
+}
+
+// Typed counters add in place: int64 fails rather than overflow, and
+// float64 adds like JS does.
+Napi::Value FastShmCache::IncrByTyped(Napi::Env env, const std::string& key, Napi::Value delta, uint64_t expires_at) {
+    std::string bytes;
+    if (!ReadValue(env, delta, bytes)) {
+        return env.Undefined();
+    }
+    
+    if (value_type_ == VALUE_FLOAT64) {
+        double step;
+        memcpy(&step, bytes.data(), sizeof(step));
+        TypedCounterUpdate<double> update(step);
+        if (!UpdateValue(key, Hash(key), bytes, expires_at, &update) || !update.valid()) {
+            return env.Undefined();
+        }
+        return Napi::Number::New(env, update.result());
+    }
+    
+    int64_t step;
+    memcpy(&step, bytes.data(), sizeof(step));
+    TypedCounterUpdate<int64_t> update(step);
+    if (!UpdateValue(key, Hash(key), bytes, expires_at, &update) || !update.valid()) {
+        return env.Undefined();
+    }
+    return Napi::BigInt::New(env, update.result());
+}
+
+// Stores next only if the value is still expected, or the key is missing
+// when expected is undefined. True if it did.
+Napi::Value FastShmCache::CompareAndSet(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (RejectReadOnly(env)) {
+        return env.Undefined();
+    }
+    
+    if (info.Length() < 3 || !info[0].IsString()) {
+        Napi::TypeError::New(env, "Expected compareAndSet(key: string, expected: string | undefined, next: string)")
+            .ThrowAsJavaScriptException();
+        return Napi::Boolean::New(env, false);
+    }
+    
+    std::string key = info[0].As<Napi::String>().Utf8Value();
+    std::string expected;
+    std::string next;
+    bool has_expected = !info[1].IsUndefined();
+    if ((has_expected && !ReadValue(env, info[1], expected)) || !ReadValue(env, info[2], next)) {
+        return Napi::Boolean::New(env, false);
+    }
+    
+    CompareAndSetUpdate update(has_expected ? &expected : nullptr, next);
+    bool stored = UpdateValue(key, Hash(key), next, ExpiryFrom(info[3]), &update);
+    return Napi::Boolean::New(env, stored && update.swapped());
+}
+
+// Returns the live value at key, or stores value and returns it. Undefined
+// if the key was missing and there is no room.
+Napi::Value FastShmCache::GetOrSet(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (RejectReadOnly(env)) {
+        return env.Undefined();
+    }
+    
+    if (info.Length() < 2 || !info[0].IsString()) {
+        Napi::TypeError::New(env, "Expected getOrSet(key: string, value: string)").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    
+    std::string key = info[0].As<Napi::String>().Utf8Value();
+    std::string value;
+    if (!ReadValue(env, info[1], value)) {
+        return env.Undefined();
+    }
+    
+    GetOrSetUpdate update(value);
+    if (!UpdateValue(key, Hash(key), value, ExpiryFrom(info[2]), &update)) {
+        return env.Undefined();
+    }
+    const std::string& stored = update.found() ? update.existing() : value;
+    return ValueToJs(env, stored.data(), static_cast<uint32_t>(stored.size()));
+}
+
+Napi::Value FastShmCache::Keys(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Napi::Array keys = Napi::Array::New(env);
+    
+    size_t key_index = 0;
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        shard->ForEachEntry([&](const char* key, const char*, uint32_t, uint64_t) {
+            keys[key_index++] = Napi::String::New(env, key);
+        });
+    }
+    
+    return keys;
+}
+
+Napi::Value FastShmCache::Entries(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    Napi::Array entries = Napi::Array::New(env);
+    
+    size_t entry_index = 0;
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        shard->ForEachEntry([&](const char* key, const char* value, uint32_t length, uint64_t) {
+            Napi::Array pair = Napi::Array::New(env, 2);
+            pair[0u] = Napi::String::New(env, key);
+            pair[1u] = ValueToJs(env, value, length);
+            entries[entry_index++] = pair;
+        });
+    }
+    
+    return entries;
+}
+
+// Returns { cursor, entries } with up to count entries whose key
+// starts with prefix, shard by shard. Cursor 0 starts a scan and comes
+// back once it is done; see Shard::Scan for what happens when tables
+// change in between.
+Napi::Value FastShmCache::Scan(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (info.Length() < 3 || !info[0].IsNumber() || !info[1].IsNumber() || !info[2].IsString()) {
+        Napi::TypeError::New(env, "Expected scan(cursor: number, count: number, prefix: string)")
+            .ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    
+    uint64_t cursor = static_cast<uint64_t>(info[0].As<Napi::Number>().DoubleValue());
+    size_t count = info[1].As<Napi::Number>().Uint32Value();
+    std::string prefix = info[2].As<Napi::String>().Utf8Value();
+    
+    size_t position = cursor & ((static_cast<uint64_t>(1) << SCAN_POSITION_BITS) - 1);
+    size_t shard_index = (cursor >> SCAN_POSITION_BITS) & ((1u << SCAN_SHARD_BITS) - 1);
+    uint32_t tag = static_cast<uint32_t>(cursor >> (SCAN_POSITION_BITS + SCAN_SHARD_BITS));
+    
+    Napi::Array entries = Napi::Array::New(env);
+    size_t entry_index = 0;
+    size_t entries_left = count;
+    size_t groups_left = count * SCAN_GROUPS_PER_ENTRY;
+    uint64_t next = 0;
+    
+    while (shard_index < shards_.size() && entries_left > 0 && groups_left > 0) {
+        position = shards_[shard_index]->Scan(position, &tag, prefix, &entries_left, &groups_left,
+                                              [&](const char* key, const char* value, uint32_t length) {
+            Napi::Array pair = Napi::Array::New(env, 2);
+            pair[0u] = Napi::String::New(env, key);
+            pair[1u] = ValueToJs(env, value, length);
+            entries[entry_index++] = pair;
+        });
+        if (position == 0) {
+            ++shard_index;
+        }
+    }
+    
+    // A position of 0 needs no tag, and shard_index past the end means done
+    if (shard_index < shards_.size()) {
+        next = static_cast<uint64_t>(position) | (static_cast<uint64_t>(shard_index) << SCAN_POSITION_BITS);
+        if (position != 0) {
+            next |= static_cast<uint64_t>(tag) << (SCAN_POSITION_BITS + SCAN_SHARD_BITS);
+        }
+    }
+    
+    Napi::Object result = Napi::Object::New(env);
+    result.Set("cursor", Napi::Number::New(env, static_cast<double>(next)));
+    result.Set("entries", entries);
+    return result;
+}
+
+// Shards are cleared one at a time, each under its own lock only
+Napi::Value FastShmCache::Clear(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (RejectReadOnly(env)) {
+        return env.Undefined();
+    }
+    
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        shard->Clear();
+    }
+    NotifyClear();
+    
+    return env.Undefined();
+}
+
+Napi::Value FastShmCache::Size(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    size_t size = 0;
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        size += shard->Size();
+    }
+    return Napi::Number::New(env, size);
+}
+
+// Grows every shard to an equal share of max_keys; see Shard::Grow.
+// Returns false if the cache is already that large.
+Napi::Value FastShmCache::Resize(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (RejectReadOnly(env)) {
+        return env.Undefined();
+    }
+    
+    if (info.Length() < 1 || !info[0].IsNumber()) {
+        Napi::TypeError::New(env, "Expected resize(maxKeys: number)").ThrowAsJavaScriptException();
+        return Napi::Boolean::New(env, false);
+    }
+    
+    size_t max_keys = info[0].As<Napi::Number>().Uint32Value();
+    size_t shard_keys = (max_keys + shards_.size() - 1) / shards_.size();
+    bool grew = false;
+    
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        bool shard_grew = false;
+        if (!shard->Grow(shard_keys, &shard_grew)) {
+            std::string reason = errno == ENOSPC ? "entries still to move don't fit its arena" : strerror(errno);
+            Napi::Error::New(env, "Failed to resize shared memory: " + reason).ThrowAsJavaScriptException();
+            return Napi::Boolean::New(env, false);
+        }
+        grew = grew || shard_grew;
+    }
+    
+    return Napi::Boolean::New(env, grew);
+}
+
+Napi::Value FastShmCache::GetValueType(const Napi::CallbackInfo& info) {
+    static const char* const NAMES[] = {"string", "int64", "float64"};
+    return Napi::String::New(info.Env(), NAMES[value_type_]);
+}
+
+Napi::Value FastShmCache::MaxKeys(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    size_t max_keys = 0;
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        max_keys += shard->MaxKeys();
+    }
+    return Napi::Number::New(env, max_keys);
+}
+
+// Writes every live entry to `path`. Each entry is copied under its slot
+// lock, so writers keep going and every record is whole; the file lands
+// under its final name only once complete.
+Napi::Value FastShmCache::Snapshot(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (info.Length() < 1 || !info[0].IsString()) {
+        Napi::TypeError::New(env, "Expected snapshot(path: string)").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    
+    std::string path = info[0].As<Napi::String>().Utf8Value();
+    std::string temp_path = path + ".tmp";
+    FILE* file = fopen(temp_path.c_str(), "wb");
+    if (!file) {
+        Napi::Error::New(env, std::string("Failed to write snapshot: ") + strerror(errno)).ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    
+    uint64_t checksum = FNV_64_OFFSET;
+    auto put = [&](const void* data, size_t length) {
+        checksum = Fnv1a64(checksum, data, length);
+        ok = fwrite(data, 1, length, file) == length && ok;
+    };
+    
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        shard->ForEachEntry([&](const char* key, const char* value, uint32_t length, uint64_t expires_at) {
+            uint8_t key_length = static_cast<uint8_t>(strnlen(key, MAX_KEY_SIZE));
+            put(&key_length, sizeof(key_length));
+            put(&length, sizeof(length));
+            put(&expires_at, sizeof(expires_at));
+            put(key, key_length);
+            put(value, length);
+            ++header.entries;
+        });
+    }
+    
+    // Fill in the count and checksum, then make it durable before the rename
+    header.checksum = checksum;
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1 &&
+         SyncFile(file);
+    int error = errno;
+    fclose(file);
+    
+    if (!ok || !RenameFile(temp_path, path)) {
+        error = ok ? errno : error;
+        remove(temp_path.c_str());
+        Napi::Error::New(env, std::string("Failed to write snapshot: ") + strerror(error)).ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    
+    return Napi::Number::New(env, static_cast<double>(header.entries));
+}
+
+// Loads a snapshot written by Snapshot(), after checking its header and
+// checksum. Entries that expired meanwhile or don't fit are skipped.
+Napi::Value FastShmCache::Restore(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (RejectReadOnly(env)) {
+        return env.Undefined();
+    }
+    
+    if (info.Length() < 1 || !info[0].IsString()) {
+        Napi::TypeError::New(env, "Expected restore(path: string)").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    
+    std::string path = info[0].As<Napi::String>().Utf8Value();
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file) {
+        Napi::Error::New(env, std::string("Failed to read snapshot: ") + strerror(errno)).ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    
+    std::string failure;
+    SnapshotHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+        failure = "Not a cache snapshot";
+    } else if (header.version != SNAPSHOT_VERSION) {
+        failure = "Unsupported snapshot version " + std::to_string(header.version);
+    }
+    
+    // Verify the whole body before storing anything
+    if (failure.empty()) {
+        uint64_t checksum = FNV_64_OFFSET;
+        char chunk[65536];
+        size_t read;
+        while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+            checksum = Fnv1a64(checksum, chunk, read);
+        }
+        if (checksum != header.checksum) {
+            failure = "Snapshot checksum mismatch";
+        }
+    }
+    
+    size_t restored = 0;
+    if (failure.empty() && fseek(file, sizeof(header), SEEK_SET) == 0) {
+        uint64_t now = NowNs();
+        std::string key;
+        std::string value;
+        for (uint64_t i = 0; i < header.entries; ++i) {
+            uint8_t key_length;
+            uint32_t length;
+            uint64_t expires_at;
+            if (fread(&key_length, sizeof(key_length), 1, file) != 1 ||
+                fread(&length, sizeof(length), 1, file) != 1 ||
+                fread(&expires_at, sizeof(expires_at), 1, file) != 1) {
+                failure = "Snapshot is truncated";
+                break;
+            }
+            key.resize(key_length);
+            value.resize(length);
+            if ((key_length > 0 && fread(&key[0], 1, key_length, file) != key_length) ||
+                (length > 0 && fread(&value[0], 1, length, file) != length)) {
+                failure = "Snapshot is truncated";
+                break;
+            }
+            
+            if (!IsExpired(expires_at, now) && StoreValue(key, Hash(key), value.data(), length, expires_at)) {
+                ++restored;
+            }
+        }
+    }
+    fclose(file);
+    
+    if (!failure.empty()) {
+        Napi::Error::New(env, failure).ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    return Napi::Number::New(env, static_cast<double>(restored));
+}
+
+// Checkpoint for file-backed caches: returns once every dirty page is on disk
+Napi::Value FastShmCache::Flush(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        if (!shard->Flush()) {
+            Napi::Error::New(env, std::string("Failed to flush: ") + strerror(errno)).ThrowAsJavaScriptException();
+            return env.Undefined();
+        }
+    }
+    return env.Undefined();
+}
+
+// Lock counters summed over every shard: waits that outlasted lockTimeout
+// and locks taken over from processes that died holding them
+Napi::Value FastShmCache::LockStats(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    uint64_t timeouts = 0;
+    uint64_t recovered = 0;
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        shard->LockStats(&timeouts, &recovered);
+    }
+    
+    Napi::Object stats = Napi::Object::New(env);
+    stats.Set("timeouts", Napi::Number::New(env, static_cast<double>(timeouts)));
+    stats.Set("recovered", Napi::Number::New(env, static_cast<double>(recovered)));
+    return stats;
+}
+
+// This handle's counters since it opened, and the table's occupancy as
+// every process sees it
+Napi::Value FastShmCache::Stats(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    size_t entries = 0;
+    size_t max_keys = 0;
+    size_t slots = 0;
+    size_t tombstones = 0;
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        entries += shard->Size();
+        max_keys += shard->MaxKeys();
+        shard->Occupancy(&slots, &tombstones);
+    }
+    
+    uint64_t lookups = stats_.lookups.Get();
+    Napi::Object stats = Napi::Object::New(env);
+    stats.Set("hits", Napi::Number::New(env, static_cast<double>(stats_.hits.Get())));
+    stats.Set("misses", Napi::Number::New(env, static_cast<double>(stats_.misses.Get())));
+    stats.Set("sets", Napi::Number::New(env, static_cast<double>(stats_.sets.Get())));
+    stats.Set("setFailures", Napi::Number::New(env, static_cast<double>(stats_.set_failures.Get())));
+    stats.Set("evictions", Napi::Number::New(env, static_cast<double>(stats_.evictions.Get())));
+    stats.Set("avgProbe",
+              Napi::Number::New(env, lookups ? static_cast<double>(stats_.probe_groups.Get()) / lookups : 0));
+    stats.Set("maxProbe", Napi::Number::New(env, static_cast<double>(stats_.max_probe_groups.Get())));
+    stats.Set("lockContention", Napi::Number::New(env, static_cast<double>(stats_.lock_contended.Get())));
+    stats.Set("loadFactor", Napi::Number::New(env, max_keys ? static_cast<double>(entries) / max_keys : 0));
+    stats.Set("tombstoneRatio", Napi::Number::New(env, slots ? static_cast<double>(tombstones) / slots : 0));
+    
+    if (stats_.sample_every == 0) {
+        return stats;
+    }
+    
+    // Bucket bounds and percentiles are each bucket's upper bound
+    static const char* const op_names[NUM_STAT_OPS] = {"get", "set", "delete"};
+    double ticks_per_ns = stats_.TicksPerNs();
+    Napi::Object latency = Napi::Object::New(env);
+    for (size_t op = 0; op < NUM_STAT_OPS; ++op) {
+        uint64_t samples = 0;
+        for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+            samples += stats_.latency[op][i].Get();
+        }
+        
+        Napi::Array histogram = Napi::Array::New(env);
+        uint32_t rows = 0;
+        double p50 = 0;
+        double p99 = 0;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+            uint64_t count = stats_.latency[op][i].Get();
+            if (count == 0) {
+                continue;
+            }
+            double upper_ns = std::ldexp(1.0, static_cast<int>(i) + 1) / ticks_per_ns;
+            seen += count;
+            if (p50 == 0 && seen * 2 >= samples) {
+                p50 = upper_ns;
+            }
+            if (p99 == 0 && seen * 100 >= samples * 99) {
+                p99 = upper_ns;
+            }
+            Napi::Array row = Napi::Array::New(env, 2);
+            row[0u] = Napi::Number::New(env, upper_ns);
+            row[1u] = Napi::Number::New(env, static_cast<double>(count));
+            histogram[rows++] = row;
+        }
+        
+        Napi::Object summary = Napi::Object::New(env);
+        summary.Set("samples", Napi::Number::New(env, static_cast<double>(samples)));
+        summary.Set("p50", Napi::Number::New(env, p50));
+        summary.Set("p99", Napi::Number::New(env, p99));
+        summary.Set("max", Napi::Number::New(env, stats_.max_latency[op].Get() / ticks_per_ns));
+        summary.Set("histogram", histogram);
+        latency.Set(op_names[op], summary);
+    }
+    stats.Set("latency", latency);
+    return stats;
+}
+
+// Populates a cache's mappings on the libuv pool, so createCacheAsync can
+// prefault a large segment without blocking the event loop. Holds a
+// reference to the cache until it settles.
+class PrefaultWorker : public Napi::AsyncWorker {
+public:
+    PrefaultWorker(Napi::Env env, FastShmCache* cache)
+        : Napi::AsyncWorker(env), cache_(cache), deferred_(Napi::Promise::Deferred::New(env)) {
+        cache_->Ref();
+    }
+    
+    Napi::Promise Promise() const { return deferred_.Promise(); }
+
+protected:
+    void Execute() override {
+        cache_->PrefaultShards();
+    }
+    
+    void OnOK() override {
+        cache_->Unref();
+        deferred_.Resolve(Env().Undefined());
+    }
+    
+    void OnError(const Napi::Error& error) override {
+        cache_->Unref();
+        deferred_.Reject(error.Value());
+    }
+
+private:
+    FastShmCache* cache_;
+    Napi::Promise::Deferred deferred_;
+};
+
+void FastShmCache::PrefaultShards() {
+    std::lock_guard<std::mutex> lock(reaper_mutex_);
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        shard->Prefault();
+    }
+}
+
+Napi::Value FastShmCache::Prefault(const Napi::CallbackInfo& info) {
+    PrefaultWorker* worker = new PrefaultWorker(info.Env(), this);
+    Napi::Promise promise = worker->Promise();
+    worker->Queue();
+    return promise;
+}
+
+// Runs keys(), entries() or clear() on the libuv pool. The scan holds
+// reaper_mutex_, so no table is unmapped under it, and packs the entries
+// into one buffer of records (u8 key length, key, and for entries u32
+// value length, value) that index.js decodes a chunk per tick. Building a
+// million JS strings here instead would block the event loop just as long
+// as the synchronous scan. Holds a reference to the cache until it settles.
+class BulkWorker : public Napi::AsyncWorker {
+public:
+    enum Operation { BULK_KEYS, BULK_ENTRIES, BULK_CLEAR };
+    
+    BulkWorker(Napi::Env env, FastShmCache* cache, Operation operation)
+        : Napi::AsyncWorker(env), cache_(cache), operation_(operation),
+          deferred_(Napi::Promise::Deferred::New(env)) {
+        cache_->Ref();
+    }
+    
+    Napi::Promise Promise() const { return deferred_.Promise(); }
+
+protected:
+    void Execute() override {
+        std::lock_guard<std::mutex> lock(cache_->reaper_mutex_);
+        for (const std::unique_ptr<Shard>& shard : cache_->shards_) {
+            if (operation_ == BULK_CLEAR) {
+                shard->ClearMapped();
+                continue;
+            }
+            shard->ForEachMappedEntry([&](const char* key, const char* value, uint32_t length, uint64_t) {
+                uint8_t key_length = static_cast<uint8_t>(strnlen(key, MAX_KEY_SIZE));
+                records_.append(reinterpret_cast<const char*>(&key_length), sizeof(key_length));
+                records_.append(key, key_length);
+                if (operation_ == BULK_ENTRIES) {
+                    records_.append(reinterpret_cast<const char*>(&length), sizeof(length));
+                    records_.append(value, length);
+                }
+            });
+        }
+        if (operation_ == BULK_CLEAR) {
+            cache_->NotifyClear();
+        }
+    }
+    
+    void OnOK() override {
+        Napi::Env env = Env();
+        cache_->Unref();
+        if (operation_ == BULK_CLEAR) {
+            deferred_.Resolve(env.Undefined());
+            return;
+        }
+        deferred_.Resolve(Napi::Buffer<char>::Copy(env, records_.data(), records_.size()));
+    }
+    
+    void OnError(const Napi::Error& error) override {
+        cache_->Unref();
+        deferred_.Reject(error.Value());
+    }
+
+private:
+    FastShmCache* cache_;
+    Operation operation_;
+    Napi::Promise::Deferred deferred_;
+    std::string records_;
+};
+
+// Resizes are caught up with here, on the JS thread, since the worker may
+// not move the table pointers. One that starts mid-scan is missed just as
+// it would be by keys().
+Napi::Value FastShmCache::QueueBulk(Napi::Env env, int operation) {
+    for (const std::unique_ptr<Shard>& shard : shards_) {
+        shard->SyncTables();
+    }
+    
+    BulkWorker* worker = new BulkWorker(env, this, static_cast<BulkWorker::Operation>(operation));
+    Napi::Promise promise = worker->Promise();
+    worker->Queue();
+    return promise;
+}
+
+Napi::Value FastShmCache::KeysAsync(const Napi::CallbackInfo& info) {
+    return QueueBulk(info.Env(), BulkWorker::BULK_KEYS);
+}
+
+Napi::Value FastShmCache::EntriesAsync(const Napi::CallbackInfo& info) {
+    return QueueBulk(info.Env(), BulkWorker::BULK_ENTRIES);
+}
+
+Napi::Value FastShmCache::ClearAsync(const Napi::CallbackInfo& info) {
+    if (RejectReadOnly(info.Env())) {
+        return info.Env().Undefined();
+    }
+    return QueueBulk(info.Env(), BulkWorker::BULK_CLEAR);
 }
 
 Napi::Object FastShmCache::Init(Napi::Env env, Napi::Object exports) {
     Napi::Function func = DefineClass(env, "FastShmCache", {
         InstanceMethod("set", &FastShmCache::Set),
         InstanceMethod("get", &FastShmCache::Get),
+        InstanceMethod("setBuffer", &FastShmCache::SetBuffer),
+        InstanceMethod("getBuffer", &FastShmCache::GetBuffer),
+        InstanceMethod("getInto", &FastShmCache::GetInto),
+        InstanceMethod("mget", &FastShmCache::MGet),
+        InstanceMethod("mset", &FastShmCache::MSet),
+        InstanceMethod("mdel", &FastShmCache::MDel),
         InstanceMethod("delete", &FastShmCache::Delete),
         InstanceMethod("has", &FastShmCache::Has),
+        InstanceMethod("incrBy", &FastShmCache::IncrBy),
+        InstanceMethod("compareAndSet", &FastShmCache::CompareAndSet),
+        InstanceMethod("getOrSet", &FastShmCache::GetOrSet),
         InstanceMethod("keys", &FastShmCache::Keys),
         InstanceMethod("entries", &FastShmCache::Entries),
+        InstanceMethod("scan", &FastShmCache::Scan),
         InstanceMethod("clear", &FastShmCache::Clear),
-        InstanceMethod("size", &FastShmCache::Size)
+        InstanceMethod("keysAsync", &FastShmCache::KeysAsync),
+        InstanceMethod("entriesAsync", &FastShmCache::EntriesAsync),
+        InstanceMethod("clearAsync", &FastShmCache::ClearAsync),
+        InstanceMethod("size", &FastShmCache::Size),
+        InstanceMethod("resize", &FastShmCache::Resize),
+        InstanceMethod("maxKeys", &FastShmCache::MaxKeys),
+        InstanceMethod("valueType", &FastShmCache::GetValueType),
+        InstanceMethod("watch", &FastShmCache::Watch),
+        InstanceMethod("unwatch", &FastShmCache::Unwatch),
+        InstanceMethod("prefault", &FastShmCache::Prefault),
+        InstanceMethod("snapshot", &FastShmCache::Snapshot),
+        InstanceMethod("restore", &FastShmCache::Restore),
+        InstanceMethod("flush", &FastShmCache::Flush),
+        InstanceMethod("lockStats", &FastShmCache::LockStats),
+        InstanceMethod("stats", &FastShmCache::Stats)
     });
     
     constructor = Napi::Persistent(func);
     constructor.SuppressDestruct();
     
     exports.Set("FastShmCache", func);
+    exports.Set("slotLock", Napi::String::New(env, SLOT_LOCK_KIND == SLOT_LOCK_PTHREAD ? "pthread" : "futex"));
+    return exports;
+}
+
+
+// JS handle on a ShmQueue
+class FastShmQueue : public Napi::ObjectWrap<FastShmQueue> {
+public:
+    static Napi::Object Init(Napi::Env env, Napi::Object exports);
+    FastShmQueue(const Napi::CallbackInfo& info);
+    ~FastShmQueue();
+
+private:
+    static Napi::FunctionReference constructor;
+    
+    bool persist_;
+    ShmQueue queue_;
+    std::vector<char> batch_;           // popBatch's records, reused between calls
+    
+    Napi::Value Push(const Napi::CallbackInfo& info);
+    Napi::Value Pop(const Napi::CallbackInfo& info);
+    Napi::Value PopBatch(const Napi::CallbackInfo& info);
+    Napi::Value Size(const Napi::CallbackInfo& info);
+    Napi::Value Capacity(const Napi::CallbackInfo& info);
+    Napi::Value MaxMessageSize(const Napi::CallbackInfo& info);
+};
+
+Napi::FunctionReference FastShmQueue::constructor;
+
+// Milliseconds to wait, from an optional JS number: missing or 0 never
+// waits, Infinity waits as long as it takes
+static uint32_t TimeoutFrom(Napi::Value value) {
+    if (!value.IsNumber()) {
+        return 0;
+    }
+    double ms = value.As<Napi::Number>().DoubleValue();
+    if (!(ms > 0)) {
+        return 0;
+    }
+    return ms >= WAIT_FOREVER ? WAIT_FOREVER : static_cast<uint32_t>(std::ceil(ms));
+}
+
+FastShmQueue::FastShmQueue(const Napi::CallbackInfo& info) : Napi::ObjectWrap<FastShmQueue>(info), persist_(false) {
+    Napi::Env env = info.Env();
+    
+    if (info.Length() < 1 || !info[0].IsObject()) {
+        Napi::TypeError::New(env, "Options object required").ThrowAsJavaScriptException();
+        return;
+    }
+    
+    Napi::Object options = info[0].As<Napi::Object>();
+    
+    std::string name = "node_queue";
+    size_t capacity = DEFAULT_QUEUE_CAPACITY;
+    size_t max_message_size = DEFAULT_MAX_MESSAGE_SIZE;
+    
+    if (options.Has("name") && options.Get("name").IsString()) {
+        name = options.Get("name").As<Napi::String>().Utf8Value();
+    }
+    
+    if (options.Has("capacity") && options.Get("capacity").IsNumber()) {
+        capacity = options.Get("capacity").As<Napi::Number>().Uint32Value();
+    }
+    
+    if (options.Has("maxMessageSize") && options.Get("maxMessageSize").IsNumber()) {
+        max_message_size = options.Get("maxMessageSize").As<Napi::Number>().Uint32Value();
+    }
+    
+    if (options.Has("persist") && options.Get("persist").IsBoolean()) {
+        persist_ = options.Get("persist").As<Napi::Boolean>().Value();
+    }
+    
+    if (capacity == 0 || max_message_size == 0 || max_message_size > MAX_VALUE_SIZE_LIMIT) {
+        Napi::RangeError::New(env, "capacity and maxMessageSize must be positive, maxMessageSize at most 16 MB")
+            .ThrowAsJavaScriptException();
+        return;
+    }
+    
+    // A power of two, so positions map to cells with a mask
+    size_t cells = 1;
+    while (cells < capacity) {
+        cells <<= 1;
+    }
+    
+    std::string shm_name = "/" + name;
+    bool created = queue_.Create(shm_name, cells, max_message_size);
+    if (!created && (errno != EEXIST || !queue_.Attach(shm_name))) {
+        Napi::Error::New(env, "Failed to initialize shared memory").ThrowAsJavaScriptException();
+        return;
+    }
+}
+
+FastShmQueue::~FastShmQueue() {
+    if (queue_.is_creator() && !persist_) {
+        queue_.Unlink();
+    }
+}
+
+// push(data: Buffer, timeoutMs?): true once the message is in, false if
+// the queue stayed full or the message is larger than maxMessageSize
+Napi::Value FastShmQueue::Push(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (info.Length() < 1 || !info[0].IsBuffer()) {
+        Napi::TypeError::New(env, "Expected push(data: Buffer)").ThrowAsJavaScriptException();
+        return Napi::Boolean::New(env, false);
+    }
+    
+    Napi::Buffer<char> data = info[0].As<Napi::Buffer<char>>();
+    return Napi::Boolean::New(env, queue_.Push(data.Data(), data.Length(), TimeoutFrom(info[1])));
+}
+
+Napi::Value FastShmQueue::Pop(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    Napi::Value message = env.Undefined();
+    queue_.Pop(TimeoutFrom(info[0]), [&](const char* data, uint32_t length) {
+        message = Napi::Buffer<char>::Copy(env, data, length);
+    });
+    return message;
+}
+
+// popBatch(max, timeoutMs?): waits for the first message only, then takes
+// whatever else is already there, up to max. The messages come back packed
+// as u32 length and bytes in one Buffer, which the JS side slices up.
+Napi::Value FastShmQueue::PopBatch(const Napi::CallbackInfo& info) {
+    Napi::Env env = info.Env();
+    
+    if (info.Length() < 1 || !info[0].IsNumber()) {
+        Napi::TypeError::New(env, "Expected popBatch(max: number)").ThrowAsJavaScriptException();
+        return env.Undefined();
+    }
+    
+    uint32_t max = info[0].As<Napi::Number>().Uint32Value();
+    batch_.clear();
+    queue_.PopBatch(max, TimeoutFrom(info[1]), [&](const char* data, uint32_t length) {
+        size_t offset = batch_.size();
+        batch_.resize(offset + sizeof(uint32_t) + length);
+        memcpy(&batch_[offset], &length, sizeof(uint32_t));
+        memcpy(&batch_[offset + sizeof(uint32_t)], data, length);
+    });
+    return Napi::Buffer<char>::Copy(env, batch_.data(), batch_.size());
+}
+
+Napi::Value FastShmQueue::Size(const Napi::CallbackInfo& info) {
+    return Napi::Number::New(info.Env(), queue_.Size());
+}
+
+Napi::Value FastShmQueue::Capacity(const Napi::CallbackInfo& info) {
+    return Napi::Number::New(info.Env(), queue_.header()->capacity);
+}
+
+Napi::Value FastShmQueue::MaxMessageSize(const Napi::CallbackInfo& info) {
+    return Napi::Number::New(info.Env(), queue_.header()->max_message_size);
+}
+
+Napi::Object FastShmQueue::Init(Napi::Env env, Napi::Object exports) {
+    Napi::Function func = DefineClass(env, "FastShmQueue", {
+        InstanceMethod("push", &FastShmQueue::Push),
+        InstanceMethod("pop", &FastShmQueue::Pop),
+        InstanceMethod("popBatch", &FastShmQueue::PopBatch),
+        InstanceMethod("size", &FastShmQueue::Size),
+        InstanceMethod("capacity", &FastShmQueue::Capacity),
+        InstanceMethod("maxMessageSize", &FastShmQueue::MaxMessageSize)
+    });
+    
+    constructor = Napi::Persistent(func);
+    constructor.SuppressDestruct();
+    
+    exports.Set("FastShmQueue", func);
     return exports;
 }
 
 // Module initialization function
 Napi::Object InitAll(Napi::Env env, Napi::Object exports) {
-    return FastShmCache::Init(env, exports);
+    // Once per process, however many threads load the addon
+    static std::once_flag lock_owner_once;
+    std::call_once(lock_owner_once, [] {
+        ResetLockOwner();
+#ifndef _WIN32
+        pthread_atfork(nullptr, nullptr, ResetLockOwner);
+#endif
+    });
+    FastShmCache::Init(env, exports);
+    return FastShmQueue::Init(env, exports);
 }
 
-NODE_API_MODULE(fast_shm_cache, InitAll) 
\ No newline at end of file
+NODE_API_MODULE(fast_shm_cache, InitAll)
@@ -0,0 +1,4273 @@
+// The shared-memory table and queue, with no N-API dependency. The addon
+// in fast_shm_cache.cc is thin glue over this header; native programs
+// include it directly to read and write the same segments. Call
+// fast_shm::ResetLockOwner() once at startup and in the child after a fork.
+#ifndef FAST_SHM_TABLE_H
+#define FAST_SHM_TABLE_H
+
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <unordered_set>
+#include <limits>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+
+#if defined(FAST_SHM_NO_SIMD)
+  // Scalar group matching only
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define FAST_SHM_SSE2 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  #include <arm_neon.h>
+  #define FAST_SHM_NEON 1
+#endif
+
+#ifdef _MSC_VER
+  #include <intrin.h>
+#endif
+
+// Latency samples are timed with the TSC where there is one
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #define FAST_SHM_TSC 1
+#elif defined(_M_X64) || defined(_M_IX86)
+  #define FAST_SHM_TSC 1
+#endif
+
+// Slot locks are 4-byte futex words unless built with
+// FAST_SHM_PTHREAD_SLOT_LOCK, which gives every slot a robust
+// pthread_mutex_t instead (node-gyp rebuild --slot_lock=pthread)
+#if defined(FAST_SHM_PTHREAD_SLOT_LOCK) && !defined(__linux__)
+  #error "FAST_SHM_PTHREAD_SLOT_LOCK needs Linux robust mutexes"
+#endif
+
+#ifdef _WIN32
+  #ifndef NOMINMAX
+    #define NOMINMAX
+  #endif
+  #include <windows.h>
+  #include <io.h>
+  #ifdef _MSC_VER
+    #pragma comment(lib, "advapi32.lib")   // AdjustTokenPrivileges, for large pages
+  #endif
+#else
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <sys/file.h>
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <pthread.h>
+  #include <signal.h>
+#endif
+
+#ifdef __linux__
+  #include <sys/syscall.h>
+  #include <sys/vfs.h>
+  #include <linux/futex.h>
+#endif
+namespace fast_shm {
+
+// Constants
+const size_t MAX_KEY_SIZE = 64;
+const size_t DEFAULT_MAX_VALUE_SIZE = 256;
+const size_t DEFAULT_MAX_KEYS = 1024;
+const size_t CACHE_LINE_SIZE = 64;
+
+// Values live in an arena after the slots, managed as a buddy allocator
+// with power-of-two size classes from ARENA_ALIGN bytes up to
+// MAX_VALUE_SIZE_LIMIT. Offsets are in ARENA_ALIGN units; unit 0 is never
+// handed out, so offset 0 doubles as "none".
+const size_t ARENA_ALIGN = 16;
+const size_t NUM_SIZE_CLASSES = 21;
+const size_t MAX_VALUE_SIZE_LIMIT = ARENA_ALIGN << (NUM_SIZE_CLASSES - 1);  // 16 MB
+const size_t MAX_ARENA_SIZE = (static_cast<size_t>(1) << 31) * ARENA_ALIGN;  // 32 GB
+const size_t DEFAULT_ARENA_BYTES_PER_SLOT = 256;
+
+// Segment identification. The creator publishes the magic last, after the
+// header is fully initialized; attachers wait for it.
+const uint32_t SHM_MAGIC = 0x43485346;  // "FSHC"
+const uint32_t SHM_LAYOUT_VERSION = 17;
+const int ATTACH_TIMEOUT_MS = 2000;
+
+// Control bytes, one per slot, live in a dense array ahead of the payload.
+// Probes compare a whole group of them at once and only touch a CacheSlot
+// when its 7-bit fingerprint matches. A deleted slot becomes a tombstone
+// rather than empty so that probe chains running through it stay intact;
+// lookups stop at the first group containing an EMPTY byte.
+const uint8_t CTRL_EMPTY = 0x00;
+const uint8_t CTRL_TOMBSTONE = 0x01;
+const uint8_t CTRL_FULL = 0x80;     // | 7-bit hash fingerprint
+
+// Compact in place once more than 1/N of the slots are tombstones
+const size_t TOMBSTONE_COMPACT_DIVISOR = 4;
+
+// Optimistic readers spin this many times on a busy slot before yielding,
+// and give up and take the slot lock after this many yields
+const int SEQLOCK_SPIN_LIMIT = 64;
+const int SEQLOCK_YIELD_LIMIT = 1000;
+
+// Slot lock words hold the owner's pid shifted left by one, with bit 0
+// set once someone may be asleep on the lock. Zero is free, so a fresh
+// zero-filled segment needs no per-slot initialization and its pages
+// fault in only when first used.
+const uint32_t SLOT_UNLOCKED = 0;
+const uint32_t SLOT_CONTENDED = 1;
+const int SLOT_LOCK_SPIN_LIMIT = 100;
+
+// Which slot lock a segment was built with; builds only attach to their own
+enum SlotLockKind {
+    SLOT_LOCK_FUTEX,
+    SLOT_LOCK_PTHREAD
+};
+
+#ifdef FAST_SHM_PTHREAD_SLOT_LOCK
+const uint32_t SLOT_LOCK_KIND = SLOT_LOCK_PTHREAD;
+#else
+const uint32_t SLOT_LOCK_KIND = SLOT_LOCK_FUTEX;
+#endif
+
+// Default lockTimeout: how long a waiter sleeps on a slot lock before
+// checking whether its owner is still alive
+const uint32_t DEFAULT_LOCK_TIMEOUT_MS = 1000;
+
+// Slot timestamps are only compared, so bit 0 doubles as the CLOCK
+// reference bit. LRU reads refresh the timestamp at most this often to
+// keep read-heavy workloads from dirtying slot cache lines.
+const uint64_t TIMESTAMP_REFERENCED = 1;
+const uint64_t LRU_TOUCH_INTERVAL_NS = 1000000;
+
+// Sampled LRU evicts the oldest of this many entries past the hand
+const size_t LRU_SAMPLE_SIZE = 16;
+
+// Victims tried per set() when the arena, not the table, is full
+const int ARENA_EVICTION_LIMIT = 16;
+
+// The reaper checks this many groups per wake-up, one slot lock at a time
+const size_t REAP_GROUPS_PER_TICK = 64;
+
+// scan() cursors pack a slot position, the shard and a tag for the
+// shard's tables into 53 bits, so they survive as JS numbers
+const int SCAN_POSITION_BITS = 36;
+const int SCAN_SHARD_BITS = 8;
+const int SCAN_TAG_BITS = 9;
+
+// Besides its count of entries, a scan() call stops after this many
+// groups per entry asked for, so a rare prefix can't make it walk the
+// whole table at once
+const size_t SCAN_GROUPS_PER_ENTRY = 10;
+
+// Batches run as a software pipeline: while one key is looked up, the key
+// this many places further on has its value prefetched, the one twice as
+// far its matching slots and the one three times as far its control
+// group, so misses overlap instead of stalling one after another
+const size_t BATCH_PREFETCH_DISTANCE = 8;
+
+// While anyone watches, each shard logs the keys written to it in a ring
+// of this many records. A watcher that falls further behind than that
+// reports the lost changes as "everything".
+const size_t CHANGE_LOG_SIZE = 1024;
+const uint32_t CHANGE_ALL = 0xffffffff;    // key_length of a clear()
+
+// Watch threads gather changes for this long after waking before they
+// hand them to JS, and list at most this many keys per watch per call
+const uint32_t WATCH_COALESCE_MS = 1;
+const size_t WATCH_MAX_KEYS = 1024;
+
+// Queues are their own segments: a QueueHeader, then `capacity` cells,
+// each a QueueCell followed by up to max_message_size bytes and padded to
+// a cache line
+const uint32_t QUEUE_MAGIC = 0x51485346;  // "FSHQ"
+const uint32_t QUEUE_LAYOUT_VERSION = 2;
+const size_t DEFAULT_QUEUE_CAPACITY = 1024;
+const size_t DEFAULT_MAX_MESSAGE_SIZE = 256;
+const uint32_t WAIT_FOREVER = 0xffffffff;
+
+// A push or pop on the wrong end retries this many times before sleeping,
+// so a busy queue's other end needn't pay for a wakeup per message
+const int QUEUE_SPIN_LIMIT = 200;
+
+// Snapshot files: a SnapshotHeader, then per entry a key length (uint8),
+// value length (uint32), expiry (uint64, ns since the epoch), the key
+// bytes and the value bytes, all in native byte order. The checksum is
+// 64-bit FNV-1a over everything after the header.
+const char SNAPSHOT_MAGIC[8] = {'F', 'S', 'H', 'C', 'S', 'N', 'A', 'P'};
+const uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t entries;
+    uint64_t checksum;
+};
+
+// Upper bounds for the shards option and for the nodes it spreads over
+const size_t MAX_SHARDS = 256;
+const int MAX_NUMA_NODES = 256;
+
+const uint64_t FNV_64_OFFSET = 0xcbf29ce484222325ULL;
+
+inline uint64_t Fnv1a64(uint64_t hash, const void* data, size_t length) {
+    const uint64_t FNV_64_PRIME = 0x100000001b3ULL;
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= bytes[i];
+        hash *= FNV_64_PRIME;
+    }
+    return hash;
+}
+
+// 64x64 -> 128-bit multiply, folded back to 64 bits
+inline uint64_t WyMix(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    uint64_t high;
+    uint64_t low = _umul128(a, b, &high);
+    return low ^ high;
+#else
+    uint64_t a_high = a >> 32, a_low = static_cast<uint32_t>(a);
+    uint64_t b_high = b >> 32, b_low = static_cast<uint32_t>(b);
+    uint64_t high_high = a_high * b_high, high_low = a_high * b_low;
+    uint64_t low_high = a_low * b_high, low_low = a_low * b_low;
+    uint64_t cross = (low_low >> 32) + static_cast<uint32_t>(high_low) + low_high;
+    uint64_t low = (cross << 32) | static_cast<uint32_t>(low_low);
+    return low ^ (high_high + (high_low >> 32) + (cross >> 32));
+#endif
+}
+
+inline uint64_t WyRead8(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t WyRead4(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// wyhash (final version 3, default secret and seed 0). Mixes eight bytes
+// per multiply rather than FNV-1a's one, and long shared key prefixes
+// don't skew it. Only compared within one host, so byte order is native.
+inline uint64_t WyHash(const void* data, size_t length) {
+    const uint64_t SECRET[4] = {0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL,
+                                0x589965cc75374cc3ULL};
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    uint64_t seed = SECRET[0];
+    uint64_t a, b;
+    
+    if (length <= 16) {
+        if (length >= 4) {
+            a = (WyRead4(p) << 32) | WyRead4(p + ((length >> 3) << 2));
+            b = (WyRead4(p + length - 4) << 32) | WyRead4(p + length - 4 - ((length >> 3) << 2));
+        } else if (length > 0) {
+            a = (static_cast<uint64_t>(p[0]) << 16) | (static_cast<uint64_t>(p[length >> 1]) << 8) | p[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = length;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = WyMix(WyRead8(p) ^ SECRET[1], WyRead8(p + 8) ^ seed);
+                see1 = WyMix(WyRead8(p + 16) ^ SECRET[2], WyRead8(p + 24) ^ see1);
+                see2 = WyMix(WyRead8(p + 32) ^ SECRET[3], WyRead8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = WyMix(WyRead8(p) ^ SECRET[1], WyRead8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = WyRead8(p + i - 16);
+        b = WyRead8(p + i - 8);
+    }
+    
+    return WyMix(SECRET[1] ^ length, WyMix(a ^ SECRET[1], b ^ seed));
+}
+
+// Slots per probe group; the table is probed group by group
+const size_t GROUP_WIDTH = 16;
+
+// Key hashes are 64 bits: the low bits pick the probe group, the top
+// seven are the control tag and bits 32-47 pick the shard
+inline uint8_t CtrlTag(uint64_t hash) {
+    return static_cast<uint8_t>(CTRL_FULL | (hash >> 57));
+}
+
+inline bool IsFull(uint8_t ctrl) {
+    return (ctrl & CTRL_FULL) != 0;
+}
+
+inline void Prefetch(const void* address) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(address);
+#elif defined(FAST_SHM_SSE2)
+    _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#else
+    (void)address;
+#endif
+}
+
+inline uint32_t CountTrailingZeros(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<uint32_t>(index);
+#else
+    return static_cast<uint32_t>(__builtin_ctz(mask));
+#endif
+}
+
+// One group of control bytes loaded at once. Each Match* returns a bitmask
+// with bit i set for slot i of the group. The load is a plain racy read;
+// any candidate it yields is re-checked under the slot's protection.
+#if defined(FAST_SHM_SSE2)
+struct CtrlGroup {
+    __m128i ctrl;
+    
+    explicit CtrlGroup(const std::atomic<uint8_t>* group)
+        : ctrl(_mm_load_si128(reinterpret_cast<const __m128i*>(group))) {}
+    
+    uint32_t Match(uint8_t byte) const {
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(static_cast<char>(byte)), ctrl)));
+    }
+    
+    uint32_t MatchEmpty() const {
+        return Match(CTRL_EMPTY);
+    }
+    
+    // Empty or tombstone: the high bit is clear
+    uint32_t MatchFree() const {
+        return ~static_cast<uint32_t>(_mm_movemask_epi8(ctrl)) & 0xFFFF;
+    }
+    
+    uint32_t MatchFull() const {
+        return static_cast<uint32_t>(_mm_movemask_epi8(ctrl));
+    }
+};
+#elif defined(FAST_SHM_NEON)
+struct CtrlGroup {
+    uint8x16_t ctrl;
+    
+    explicit CtrlGroup(const std::atomic<uint8_t>* group)
+        : ctrl(vld1q_u8(reinterpret_cast<const uint8_t*>(group))) {}
+    
+    // NEON has no movemask; weight each lane by its bit and sum the halves
+    static uint32_t ToMask(uint8x16_t lanes) {
+        static const uint8_t kBits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+        uint8x16_t bits = vandq_u8(lanes, vld1q_u8(kBits));
+        return static_cast<uint32_t>(vaddv_u8(vget_low_u8(bits))) |
+               (static_cast<uint32_t>(vaddv_u8(vget_high_u8(bits))) << 8);
+    }
+    
+    uint32_t Match(uint8_t byte) const {
+        return ToMask(vceqq_u8(ctrl, vdupq_n_u8(byte)));
+    }
+    
+    uint32_t MatchEmpty() const {
+        return Match(CTRL_EMPTY);
+    }
+    
+    uint32_t MatchFree() const {
+        return ToMask(vcltq_u8(ctrl, vdupq_n_u8(CTRL_FULL)));
+    }
+    
+    uint32_t MatchFull() const {
+        return ToMask(vcgeq_u8(ctrl, vdupq_n_u8(CTRL_FULL)));
+    }
+};
+#else
+struct CtrlGroup {
+    uint8_t ctrl[GROUP_WIDTH];
+    
+    explicit CtrlGroup(const std::atomic<uint8_t>* group) {
+        for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+            ctrl[i] = group[i].load(std::memory_order_relaxed);
+        }
+    }
+    
+    uint32_t Match(uint8_t byte) const {
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+            mask |= static_cast<uint32_t>(ctrl[i] == byte) << i;
+        }
+        return mask;
+    }
+    
+    uint32_t MatchEmpty() const {
+        return Match(CTRL_EMPTY);
+    }
+    
+    uint32_t MatchFree() const {
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_WIDTH; ++i) {
+            mask |= static_cast<uint32_t>(!IsFull(ctrl[i])) << i;
+        }
+        return mask;
+    }
+    
+    uint32_t MatchFull() const {
+        return ~MatchFree() & 0xFFFF;
+    }
+};
+#endif
+
+// Slot payload for the hash table
+struct alignas(CACHE_LINE_SIZE) CacheSlot {
+    std::atomic<uint32_t> version;      // seqlock: odd while a writer is inside
+    uint32_t value_offset;              // arena chunk, in ARENA_ALIGN units
+    uint32_t value_length;
+    uint64_t hash;                      // full key hash, compared before the key
+    std::atomic<uint64_t> timestamp;
+    std::atomic<uint64_t> expires_at;   // ns since the epoch, 0 = never
+    uint64_t inline_value;              // typed tables: the int64 or double itself
+    char key[MAX_KEY_SIZE];
+#ifdef FAST_SHM_PTHREAD_SLOT_LOCK
+    pthread_mutex_t lock;               // serializes writers (and mutex-mode readers)
+#else
+    std::atomic<uint32_t> lock;         // serializes writers (and mutex-mode readers)
+#endif
+};
+
+// Sleeps while *word == expected, for at most timeout_ms (0 = no limit).
+// Not FUTEX_PRIVATE: the wait is keyed by the shared page, so other
+// processes' wake-ups reach it.
+inline void FutexWait(std::atomic<uint32_t>* word, uint32_t expected, uint32_t timeout_ms) {
+#if defined(__linux__) && defined(SYS_futex)
+    struct timespec timeout = {static_cast<time_t>(timeout_ms / 1000), static_cast<long>(timeout_ms % 1000) * 1000000};
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, timeout_ms ? &timeout : nullptr,
+            nullptr, 0);
+#else
+    (void)word;
+    (void)expected;
+    (void)timeout_ms;
+    std::this_thread::yield();
+#endif
+}
+
+inline void FutexWake(std::atomic<uint32_t>* word) {
+#if defined(__linux__) && defined(SYS_futex)
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, 1, nullptr, nullptr, 0);
+#else
+    (void)word;
+#endif
+}
+
+inline void FutexWakeAll(std::atomic<uint32_t>* word) {
+#if defined(__linux__) && defined(SYS_futex)
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, std::numeric_limits<int>::max(), nullptr,
+            nullptr, 0);
+#else
+    (void)word;
+#endif
+}
+
+// This process's slot lock word, one per process however many files
+// include this header. Set when the addon loads and again in the child
+// after a fork.
+inline uint32_t& LockOwnerWord() {
+    static uint32_t word = 0;
+    return word;
+}
+
+inline void ResetLockOwner() {
+#ifdef _WIN32
+    LockOwnerWord() = static_cast<uint32_t>(GetCurrentProcessId()) << 1;
+#else
+    LockOwnerWord() = static_cast<uint32_t>(getpid()) << 1;
+#endif
+}
+
+#ifndef FAST_SHM_PTHREAD_SLOT_LOCK
+// True if the process owning a held slot lock no longer exists. Pids are
+// only meaningful within one pid namespace; a live owner elsewhere looks
+// dead, so processes sharing a cache must share the namespace.
+inline bool LockOwnerDied(uint32_t state) {
+    uint32_t owner = state & ~SLOT_CONTENDED;
+    if (owner == SLOT_UNLOCKED || owner == LockOwnerWord()) {
+        return false;
+    }
+#ifdef _WIN32
+    // An exited process stays signaled for as long as anyone holds a
+    // handle to it; one that can't be opened at all is long gone
+    HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, owner >> 1);
+    if (!process) {
+        return GetLastError() == ERROR_INVALID_PARAMETER;
+    }
+    bool exited = WaitForSingleObject(process, 0) == WAIT_OBJECT_0;
+    CloseHandle(process);
+    return exited;
+#else
+    return kill(static_cast<pid_t>(owner >> 1), 0) == -1 && errno == ESRCH;
+#endif
+}
+#endif
+
+inline void UnlockSlot(CacheSlot& slot) {
+#ifdef FAST_SHM_PTHREAD_SLOT_LOCK
+    pthread_mutex_unlock(&slot.lock);
+#else
+    if (slot.lock.exchange(SLOT_UNLOCKED, std::memory_order_release) & SLOT_CONTENDED) {
+        FutexWake(&slot.lock);
+    }
+#endif
+}
+
+// Wall-clock time, so expiry times mean the same in every process
+inline uint64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+inline bool IsExpired(uint64_t expires_at, uint64_t now) {
+    return expires_at != 0 && expires_at <= now;
+}
+
+// Copies an entry's payload, and its ownership of the value chunk, from
+// one slot to another. Callers hold both slot locks.
+inline void CopyEntry(const CacheSlot& from, CacheSlot& to) {
+    to.hash = from.hash;
+    memcpy(to.key, from.key, MAX_KEY_SIZE);
+    to.value_offset = from.value_offset;
+    to.value_length = from.value_length;
+    to.inline_value = from.inline_value;
+    to.timestamp.store(from.timestamp.load());
+    to.expires_at.store(from.expires_at.load());
+}
+
+// Forgets a slot's entry without freeing its value
+inline void ClearEntry(CacheSlot& slot) {
+    memset(slot.key, 0, MAX_KEY_SIZE);
+    slot.value_offset = 0;
+    slot.value_length = 0;
+    slot.inline_value = 0;
+    slot.expires_at.store(0);
+}
+
+// Seqlock write side. Callers must hold slot.lock, so a plain
+// load/store pair is enough to bump the counter.
+inline void BeginSlotWrite(CacheSlot& slot) {
+    slot.version.store(slot.version.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+}
+
+inline void EndSlotWrite(CacheSlot& slot) {
+    slot.version.store(slot.version.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// Seqlock read side: wait for an even version, read, then validate. A
+// version that stays odd may belong to a writer that died mid-write, so
+// after a while this fails and the caller takes the slot lock instead.
+inline bool BeginSlotRead(const CacheSlot& slot, uint32_t* version_out) {
+    int spins = 0;
+    for (int yields = 0; yields < SEQLOCK_YIELD_LIMIT;) {
+        uint32_t version = slot.version.load(std::memory_order_acquire);
+        if ((version & 1) == 0) {
+            *version_out = version;
+            return true;
+        }
+        if (++spins >= SEQLOCK_SPIN_LIMIT) {
+            spins = 0;
+            ++yields;
+            std::this_thread::yield();
+        }
+    }
+    return false;
+}
+
+inline bool ValidateSlotRead(const CacheSlot& slot, uint32_t version) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot.version.load(std::memory_order_relaxed) == version;
+}
+
+// How Get/Has read slots in this process. Writers always maintain both the
+// slot lock and the version counter, so processes may mix modes freely.
+enum ReadMode {
+    READ_MODE_MUTEX,
+    READ_MODE_SEQLOCK
+};
+
+// A stats() counter. Each handle keeps its own, in process memory, and
+// only its threads bump them: with a relaxed load and store, so counting
+// costs a plain increment and no cache line moves between processes. Two
+// of the handle's threads racing may lose a count.
+struct StatCounter {
+    std::atomic<uint64_t> value;
+    
+    StatCounter() : value(0) {}
+    void Add(uint64_t n) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    void Raise(uint64_t n) {
+        if (n > value.load(std::memory_order_relaxed)) {
+            value.store(n, std::memory_order_relaxed);
+        }
+    }
+    uint64_t Get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// Operations with a latency histogram
+enum StatOp {
+    STAT_GET,
+    STAT_SET,
+    STAT_DELETE,
+    NUM_STAT_OPS
+};
+
+// Bucket i counts samples that took [2^i, 2^(i+1)) timer ticks
+const size_t LATENCY_BUCKETS = 64;
+
+inline uint64_t ReadTicks() {
+#ifdef FAST_SHM_TSC
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+inline uint64_t SteadyNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+inline uint32_t Log2(uint64_t n) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanReverse64(&index, n | 1);
+    return static_cast<uint32_t>(index);
+#else
+    return 63 - static_cast<uint32_t>(__builtin_clzll(n | 1));
+#endif
+}
+
+// What one handle's operations have seen, for stats()
+struct HandleStats {
+    StatCounter hits;
+    StatCounter misses;
+    StatCounter sets;
+    StatCounter set_failures;           // table or arena full, or value too large
+    StatCounter evictions;
+    StatCounter lookups;                // table probes by get/has
+    StatCounter probe_groups;           // groups those probes looked at
+    StatCounter max_probe_groups;
+    StatCounter lock_contended;         // slot locks not free on the first try
+    
+    // Latency sampling, 1 in sample_every operations (0 for none). Ticks
+    // are converted to ns against the steady clock since the handle opened.
+    uint32_t sample_every;
+    uint32_t sample_countdown;
+    uint64_t opened_ticks;
+    uint64_t opened_ns;
+    StatCounter latency[NUM_STAT_OPS][LATENCY_BUCKETS];
+    StatCounter max_latency[NUM_STAT_OPS];  // in ticks
+    
+    HandleStats() : sample_every(0), sample_countdown(0), opened_ticks(ReadTicks()), opened_ns(SteadyNs()) {}
+    
+    // Ticks at the start of an operation to sample, else 0
+    uint64_t SampleStart() {
+        if (sample_every == 0 || --sample_countdown != 0) {
+            return 0;
+        }
+        sample_countdown = sample_every;
+        return ReadTicks();
+    }
+    void SampleEnd(StatOp op, uint64_t started) {
+        if (started != 0) {
+            uint64_t ticks = ReadTicks() - started;
+            latency[op][Log2(ticks)].Add(1);
+            max_latency[op].Raise(ticks);
+        }
+    }
+    double TicksPerNs() const {
+        uint64_t ns = SteadyNs() - opened_ns;
+        return ns > 0 ? static_cast<double>(ReadTicks() - opened_ticks) / ns : 1.0;
+    }
+};
+
+// Choices each handle makes for itself; nothing here is in the header
+struct HandleOptions {
+    ReadMode read_mode;
+    bool prefault;                      // fault every page in when mapping
+    bool file_backed;                   // segment names are paths of regular files
+    bool read_only;                     // mapped without write access; reads by seqlock only
+    uint32_t lock_timeout_ms;           // wait before checking a lock owner is alive, 0 = never
+    HandleStats* stats;                 // the handle's counters
+};
+
+// Outcome of checking one slot for a key
+enum SlotRead {
+    SLOT_MISS,
+    SLOT_HIT,
+    SLOT_EXPIRED                        // the key matched but its TTL has passed
+};
+
+// What set() does when it needs room. Chosen by the creating process.
+enum EvictionPolicy {
+    EVICTION_NONE,                      // reject the write
+    EVICTION_CLOCK,                     // second chance via the reference bit
+    EVICTION_LRU                        // oldest of a small sample
+};
+
+// Where an insert goes when its home group is full. Chosen by the
+// creating process.
+enum Probing {
+    PROBING_LINEAR,                     // first free slot on the probe path
+    PROBING_ROBIN_HOOD                  // displace entries closer to home than the newcomer
+};
+
+// What a value is. Typed tables keep their 8-byte values inside the slot
+// and have no arena. Chosen by the creating process.
+enum ValueType {
+    VALUE_STRING,                       // bytes in the arena, up to max_value_size
+    VALUE_INT64,
+    VALUE_FLOAT64
+};
+
+// What backs the segment's pages. Chosen by the creating process.
+enum HugePages {
+    HUGE_PAGES_NONE,                    // ordinary pages from /dev/shm
+    HUGE_PAGES_TRANSPARENT,             // /dev/shm with MADV_HUGEPAGE
+    HUGE_PAGES_2MB,                     // a file on a 2 MB hugetlbfs mount
+    HUGE_PAGES_1GB                      // a file on a 1 GB hugetlbfs mount
+};
+
+// One change log record. The stamp is 2n + 1 while change n is written
+// and 2n + 2 once it is complete, so readers can tell a record that is
+// still being written, or already reused, from the one they want.
+struct ChangeRecord {
+    std::atomic<uint64_t> stamp;
+    uint32_t key_length;                // CHANGE_ALL for a clear()
+    char key[MAX_KEY_SIZE];
+};
+
+// Change notifications. Only a shard's named segment has a log, placed
+// after its arena; resize generations leave it out. The wake-up fields
+// are only used in shard 0.
+struct ChangeLog {
+    std::atomic<uint32_t> watchers;     // handles watching; nothing is logged without one
+    std::atomic<uint32_t> watch_sleepers;   // watch threads asleep on watch_wake
+    std::atomic<uint32_t> watch_wake;   // futex word writers bump to wake them
+    std::atomic<uint64_t> change_seq;   // changes logged so far
+    ChangeRecord changes[CHANGE_LOG_SIZE];
+};
+
+#ifdef _WIN32
+// Windows has no robust process-shared mutex, and SRW locks and
+// WaitOnAddress only work within one process, so header mutexes there
+// are owner words like the futex slot locks: spin, then yield, and take
+// over a lock whose owner has exited
+typedef std::atomic<uint32_t> SharedMutex;
+#else
+typedef pthread_mutex_t SharedMutex;
+#endif
+
+// Shared memory header
+struct SharedMemoryHeader {
+    std::atomic<uint32_t> magic;
+    uint32_t layout_version;
+    uint32_t generation;                // 0 for the named segment, +1 per resize
+    std::atomic<uint32_t> successor;    // generation replacing this table, 0 if none
+    std::atomic<uint32_t> migrating;    // 1 while entries move in from the predecessor
+    std::atomic<uint32_t> latest_generation;  // newest table; read from generation 0
+    std::atomic<size_t> reserved;       // room held for entries still to migrate in
+    uint32_t num_shards;                // segments making up the cache
+    int32_t numa_node;                  // preferred node for this shard, -1 for any
+    uint32_t huge_pages;
+    uint32_t slot_lock;                 // SlotLockKind of the creating build
+    size_t max_keys;                    // entry limit
+    size_t capacity;                    // slots, a multiple of GROUP_WIDTH
+    size_t max_value_size;
+    size_t arena_size;
+    uint32_t arena_top;                 // units below this have been carved
+    uint32_t free_heads[NUM_SIZE_CLASSES];  // doubly linked free lists, by class
+    SharedMutex arena_mutex;            // guards the arena fields and free bitmap
+    std::atomic<size_t> num_entries;
+    std::atomic<size_t> num_tombstones;
+    std::atomic<uint32_t> rehash_seq;   // odd while a compaction is moving slots
+    uint32_t eviction_policy;
+    uint32_t probing;
+    uint32_t value_type;
+    std::atomic<uint32_t> max_probe;    // farthest any entry sits from its home group, in groups
+    std::atomic<size_t> clock_hand;     // next slot the eviction sweep looks at
+    std::atomic<size_t> reap_cursor;    // next group a reaper looks at
+    SharedMutex global_mutex;           // serializes inserts, compaction and clear
+    std::atomic<uint64_t> lock_timeouts;    // slot lock waits that outlasted a lockTimeout
+    std::atomic<uint64_t> locks_recovered;  // locks taken over from dead processes
+    size_t change_log_offset;           // the ChangeLog, in generation 0 only; else 0
+};
+
+#ifdef _WIN32
+inline void InitSharedMutex(SharedMutex* mutex) {
+    mutex->store(SLOT_UNLOCKED);
+}
+
+// Spins, then yields; every DEFAULT_LOCK_TIMEOUT_MS it checks whether the
+// owner has exited and if so takes the lock over. True in that case.
+inline bool LockSharedMutexWord(SharedMutex* mutex) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(DEFAULT_LOCK_TIMEOUT_MS);
+    for (int spins = 0; ; ++spins) {
+        uint32_t state = mutex->load(std::memory_order_relaxed);
+        if (state == SLOT_UNLOCKED) {
+            if (mutex->compare_exchange_weak(state, LockOwnerWord(), std::memory_order_acquire)) {
+                return false;
+            }
+            continue;
+        }
+        if (spins < SLOT_LOCK_SPIN_LIMIT) {
+            continue;
+        }
+        
+        SwitchToThread();
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline) {
+            deadline = now + std::chrono::milliseconds(DEFAULT_LOCK_TIMEOUT_MS);
+            if (LockOwnerDied(state) &&
+                mutex->compare_exchange_strong(state, LockOwnerWord(), std::memory_order_acquire)) {
+                return true;
+            }
+        }
+    }
+}
+
+inline void UnlockSharedMutex(SharedMutex* mutex) {
+    mutex->store(SLOT_UNLOCKED, std::memory_order_release);
+}
+#else
+// Process-shared: the futex must be keyed by the shared page, not by
+// this mapping's address, or waiters in other mappings of the segment
+// never see the wake-up. Robust, so a process that dies holding one
+// doesn't leave every other user blocked on it.
+inline void InitSharedMutex(pthread_mutex_t* mutex) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+inline void UnlockSharedMutex(SharedMutex* mutex) {
+    pthread_mutex_unlock(mutex);
+}
+#endif
+
+// Locks one of the header's robust mutexes. If its owner died holding it
+// the mutex is marked consistent again, and an interrupted compaction's
+// odd rehash_seq, which would keep lookups retrying forever, is evened.
+inline void LockSharedMutex(SharedMemoryHeader* header, SharedMutex* mutex) {
+#ifdef _WIN32
+    bool owner_died = LockSharedMutexWord(mutex);
+#elif defined(__linux__)
+    bool owner_died = pthread_mutex_lock(mutex) == EOWNERDEAD;
+    if (owner_died) {
+        pthread_mutex_consistent(mutex);
+    }
+#else
+    bool owner_died = false;
+    pthread_mutex_lock(mutex);
+#endif
+    if (owner_died) {
+        uint32_t seq = header->rehash_seq.load();
+        if (mutex == &header->global_mutex && (seq & 1)) {
+            header->rehash_seq.store(seq + 1);
+        }
+        header->locks_recovered.fetch_add(1);
+    }
+}
+
+// Segment layout: [header][control bytes][slot payloads][value arena],
+// each region starting on its own cache line.
+inline size_t AlignUp(size_t n, size_t alignment) {
+    return (n + alignment - 1) & ~(alignment - 1);
+}
+
+inline size_t CtrlOffset() {
+    return AlignUp(sizeof(SharedMemoryHeader), CACHE_LINE_SIZE);
+}
+
+// One spare slot beyond max_keys guarantees an EMPTY byte survives even
+// a completely full table, which bounds every probe and gives compaction
+// a place to start. A power of two, so probes wrap with a mask.
+inline size_t CapacityFor(size_t max_keys) {
+    size_t capacity = GROUP_WIDTH;
+    while (capacity < max_keys + 1) {
+        capacity <<= 1;
+    }
+    return capacity;
+}
+
+inline size_t SlotsOffset(size_t capacity) {
+    return AlignUp(CtrlOffset() + capacity, CACHE_LINE_SIZE);
+}
+
+// One bit per arena unit marks the first unit of each free chunk
+inline size_t ArenaBitmapOffset(size_t capacity) {
+    return SlotsOffset(capacity) + capacity * sizeof(CacheSlot);
+}
+
+inline size_t ArenaOffset(size_t capacity, size_t arena_size) {
+    return ArenaBitmapOffset(capacity) + AlignUp(arena_size / ARENA_ALIGN / 8 + 1, CACHE_LINE_SIZE);
+}
+
+inline size_t SegmentSize(size_t capacity, size_t arena_size) {
+    return ArenaOffset(capacity, arena_size) + arena_size;
+}
+
+inline size_t ChangeLogOffset(size_t capacity, size_t arena_size) {
+    return AlignUp(SegmentSize(capacity, arena_size), CACHE_LINE_SIZE);
+}
+
+inline size_t SizeClassFor(size_t length) {
+    size_t size_class = 0;
+    while ((ARENA_ALIGN << size_class) < length) {
+        ++size_class;
+    }
+    return size_class;
+}
+
+inline size_t ChunkSize(size_t size_class) {
+    return ARENA_ALIGN << size_class;
+}
+
+// What the creator of a table chooses; a resize carries it over
+struct TableConfig {
+    size_t max_keys;
+    size_t max_value_size;
+    size_t arena_size;
+    EvictionPolicy eviction;
+    Probing probing;
+    ValueType value_type;
+    uint32_t num_shards;
+    int numa_node;                      // -1 for the default placement
+    HugePages huge_pages;
+};
+
+// Nodes listed in /sys/devices/system/node/online, such as "0-1,3"
+inline std::vector<int> OnlineNumaNodes() {
+    std::vector<int> nodes;
+#ifdef __linux__
+    FILE* file = fopen("/sys/devices/system/node/online", "r");
+    if (!file) {
+        return nodes;
+    }
+    
+    char buffer[256];
+    if (fgets(buffer, sizeof(buffer), file)) {
+        char* cursor = buffer;
+        for (;;) {
+            char* end;
+            long first = strtol(cursor, &end, 10);
+            if (end == cursor) {
+                break;
+            }
+            long last = first;
+            if (*end == '-') {
+                cursor = end + 1;
+                last = strtol(cursor, &end, 10);
+            }
+            for (long node = first; node <= last && node < MAX_NUMA_NODES; ++node) {
+                nodes.push_back(static_cast<int>(node));
+            }
+            if (*end != ',') {
+                break;
+            }
+            cursor = end + 1;
+        }
+    }
+    fclose(file);
+#endif
+    return nodes;
+}
+
+// Asks for the pages of a fresh mapping to come from `node`. Preferred
+// rather than bound, so a full node spills over instead of failing the
+// fault. Called before the creator first touches the pages.
+inline void PreferNumaNode(void* address, size_t length, int node) {
+#if defined(__linux__) && defined(SYS_mbind)
+    const int MPOL_PREFERRED_MODE = 1;
+    const size_t BITS = 8 * sizeof(unsigned long);
+    unsigned long mask[MAX_NUMA_NODES / BITS] = {0};
+    
+    if (node < 0 || node >= MAX_NUMA_NODES) {
+        return;
+    }
+    mask[node / BITS] |= 1UL << (node % BITS);
+    syscall(SYS_mbind, address, length, MPOL_PREFERRED_MODE, mask, MAX_NUMA_NODES + 1, 0);
+#endif
+}
+
+// Page size of a hugetlbfs-backed segment, 0 if the pages come from /dev/shm
+inline size_t HugePageBytes(HugePages pages) {
+    switch (pages) {
+        case HUGE_PAGES_2MB: return static_cast<size_t>(2) << 20;
+        case HUGE_PAGES_1GB: return static_cast<size_t>(1) << 30;
+        default: return 0;
+    }
+}
+
+struct HugetlbfsMount {
+    std::string path;
+    size_t page_bytes;
+};
+
+// hugetlbfs mounts from /proc/mounts, read once per process
+inline const std::vector<HugetlbfsMount>& HugetlbfsMounts() {
+    static const std::vector<HugetlbfsMount> mounts = [] {
+        std::vector<HugetlbfsMount> found;
+#ifdef __linux__
+        FILE* file = fopen("/proc/mounts", "r");
+        if (!file) {
+            return found;
+        }
+        
+        char device[256], path[4096], type[64];
+        while (fscanf(file, "%255s %4095s %63s %*[^\n]", device, path, type) == 3) {
+            struct statfs fs;
+            if (strcmp(type, "hugetlbfs") == 0 && statfs(path, &fs) == 0) {
+                found.push_back({path, static_cast<size_t>(fs.f_bsize)});
+            }
+        }
+        fclose(file);
+#endif
+        return found;
+    }();
+    return mounts;
+}
+
+// Opens the segment named `shm_name`, from /dev/shm or any hugetlbfs
+// mount, or the regular file at that path when file backed. With
+// O_CREAT, `pages` picks the backing and a name taken on the other kind
+// fails with EEXIST like one taken on the same kind.
+inline int OpenSegment(const std::string& shm_name, int flags, HugePages pages, bool file_backed) {
+#ifdef _WIN32
+    errno = ENOTSUP;
+    return -1;
+#else
+    if (file_backed) {
+        return open(shm_name.c_str(), flags, 0666);
+    }
+    
+    size_t page_bytes = HugePageBytes(pages);
+    
+    if (!(flags & O_CREAT)) {
+        int fd = shm_open(shm_name.c_str(), flags, 0666);
+        for (size_t i = 0; fd == -1 && errno == ENOENT && i < HugetlbfsMounts().size(); ++i) {
+            fd = open((HugetlbfsMounts()[i].path + shm_name).c_str(), flags, 0666);
+        }
+        return fd;
+    }
+    
+    struct stat sb;
+    for (const HugetlbfsMount& mount : HugetlbfsMounts()) {
+        if (page_bytes == 0 && stat((mount.path + shm_name).c_str(), &sb) == 0) {
+            errno = EEXIST;
+            return -1;
+        }
+    }
+    if (page_bytes == 0) {
+        return shm_open(shm_name.c_str(), flags, 0666);
+    }
+    
+    int existing = shm_open(shm_name.c_str(), O_RDONLY, 0666);
+    if (existing != -1) {
+        close(existing);
+        errno = EEXIST;
+        return -1;
+    }
+    for (const HugetlbfsMount& mount : HugetlbfsMounts()) {
+        if (mount.page_bytes == page_bytes) {
+            return open((mount.path + shm_name).c_str(), flags, 0666);
+        }
+    }
+    errno = ENOENT;                     // no mount with that page size
+    return -1;
+#endif
+}
+
+#ifdef _WIN32
+inline int ErrnoFromWin32(DWORD error) {
+    switch (error) {
+        case ERROR_ALREADY_EXISTS:
+        case ERROR_FILE_EXISTS:
+            return EEXIST;
+        case ERROR_FILE_NOT_FOUND:
+        case ERROR_PATH_NOT_FOUND:
+            return ENOENT;
+        case ERROR_ACCESS_DENIED:
+            return EACCES;
+        case ERROR_PRIVILEGE_NOT_HELD:
+            return EPERM;
+        case ERROR_NOT_ENOUGH_MEMORY:
+        case ERROR_OUTOFMEMORY:
+        case ERROR_COMMITMENT_LIMIT:
+        case ERROR_NO_SYSTEM_RESOURCES:
+            return ENOMEM;
+        default:
+            return EINVAL;
+    }
+}
+
+// Kernel object name of a segment's file mapping: the shm name without
+// its slash, or for a file-backed segment its full path in one case, so
+// every handle on the file shares one mapping and can tell if it's alone
+inline std::string MappingName(const std::string& shm_name, bool file_backed) {
+    if (!file_backed) {
+        return shm_name.substr(1);
+    }
+    
+    char full_path[MAX_PATH];
+    DWORD length = GetFullPathNameA(shm_name.c_str(), MAX_PATH, full_path, NULL);
+    std::string path = length > 0 && length < MAX_PATH ? std::string(full_path, length) : shm_name;
+    for (char& c : path) {
+        c = c == '\\' ? '/' : static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    }
+    return "fast_shm_file:" + path;
+}
+
+// Large-page sections need SeLockMemoryPrivilege, which an account can
+// be granted without it being enabled in the process token
+inline bool EnableLockMemoryPrivilege() {
+    HANDLE token;
+    if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+        return false;
+    }
+    
+    TOKEN_PRIVILEGES privileges;
+    privileges.PrivilegeCount = 1;
+    privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+    bool enabled = LookupPrivilegeValueA(NULL, "SeLockMemoryPrivilege", &privileges.Privileges[0].Luid) &&
+                   AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) &&
+                   GetLastError() == ERROR_SUCCESS;
+    CloseHandle(token);
+    return enabled;
+}
+#endif
+
+// Sleeps on and wakes one word of a segment from any process. Linux uses
+// the futex on the word itself. Windows has no cross-process futex (its
+// WaitOnAddress works within one process), so it waits on a semaphore
+// named after the segment, and Wake releases one token per sleeper the
+// caller counted; a token nobody takes makes one later Wait return early.
+// Elsewhere Wait only yields.
+class SharedWake {
+public:
+    SharedWake() : word_(nullptr) {
+#ifdef _WIN32
+        semaphore_ = NULL;
+#endif
+    }
+    ~SharedWake() {
+#ifdef _WIN32
+        if (semaphore_) {
+            CloseHandle(semaphore_);
+        }
+#endif
+    }
+    SharedWake(const SharedWake&) = delete;
+    SharedWake& operator=(const SharedWake&) = delete;
+    
+    // suffix tells apart the words of one segment. Without a semaphore,
+    // Wait falls back to yielding.
+    void Open(std::atomic<uint32_t>* word, const std::string& shm_name, bool file_backed, const char* suffix) {
+        word_ = word;
+#ifdef _WIN32
+        semaphore_ = CreateSemaphoreA(NULL, 0, LONG_MAX, (MappingName(shm_name, file_backed) + suffix).c_str());
+#else
+        (void)shm_name;
+        (void)file_backed;
+        (void)suffix;
+#endif
+    }
+    
+    // Sleeps while the word == expected, for at most timeout_ms (0 = no limit)
+    void Wait(uint32_t expected, uint32_t timeout_ms) {
+#ifdef _WIN32
+        if (word_->load() != expected) {
+            return;
+        }
+        if (!semaphore_) {
+            SwitchToThread();
+            return;
+        }
+        WaitForSingleObject(semaphore_, timeout_ms ? timeout_ms : INFINITE);
+#else
+        FutexWait(word_, expected, timeout_ms);
+#endif
+    }
+    
+    // Wakes everyone asleep on the word, of whom the caller counted sleepers
+    void Wake(uint32_t sleepers) {
+#ifdef _WIN32
+        if (semaphore_ && sleepers > 0) {
+            long count = static_cast<long>(std::min<uint32_t>(sleepers, std::numeric_limits<int32_t>::max()));
+            ReleaseSemaphore(semaphore_, count, NULL);
+        }
+#else
+        (void)sleepers;
+        FutexWakeAll(word_);
+#endif
+    }
+    
+private:
+    std::atomic<uint32_t>* word_;
+#ifdef _WIN32
+    HANDLE semaphore_;
+#endif
+};
+
+// Faults every page of a mapping in now rather than on first use.
+// MADV_POPULATE_WRITE needs Linux 5.14; older kernels get one byte of
+// each page read, which allocates shared memory pages just the same and
+// is safe while other processes write to the segment.
+inline void PopulatePages(void* address, size_t length) {
+#ifdef __linux__
+    const int MADV_POPULATE_WRITE_ADVICE = 23;
+    if (madvise(address, length, MADV_POPULATE_WRITE_ADVICE) == 0) {
+        return;
+    }
+#endif
+    const size_t page_bytes = 4096;
+    const volatile char* bytes = static_cast<const volatile char*>(address);
+    for (size_t offset = 0; offset < length; offset += page_bytes) {
+        (void)bytes[offset];
+    }
+}
+
+// Flushes a written file and waits for it to reach the disk
+inline bool SyncFile(FILE* file) {
+    if (fflush(file) != 0) {
+        return false;
+    }
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+// rename(), replacing an existing target on Windows too
+inline bool RenameFile(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+    if (!MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+        errno = ErrnoFromWin32(GetLastError());
+        return false;
+    }
+    return true;
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+// Links stored in the first bytes of each free chunk
+struct FreeChunk {
+    uint32_t next;
+    uint32_t prev;
+    uint32_t size_class;
+};
+
+// A read-modify-write for StoreValue, run under the slot lock with the
+// key's live value, or null if it has none (an expired one counts as
+// none). Apply either points data and length at the value to store or
+// returns false to leave the entry as it is. It runs again if the first
+// write finds the arena full, so it must only depend on `current`.
+class ValueUpdate {
+public:
+    ValueUpdate() : keep_expiry(false), applied(false) {}
+    virtual ~ValueUpdate() {}
+    virtual bool Apply(const char* current, uint32_t current_length, const char** data, size_t* length) = 0;
+    
+    // Leave a live entry's expiry alone rather than applying the new one
+    bool keep_expiry;
+    // Set by the table: whether the last Apply chose to write
+    bool applied;
+};
+
+// Largest magnitude a counter holds: beyond it JS numbers lose integers
+const int64_t MAX_COUNTER = 9007199254740991LL;  // 2^53 - 1
+
+// Parses a whole value as a decimal integer of at most MAX_COUNTER
+inline bool ParseCounter(const char* text, uint32_t length, int64_t* value) {
+    uint32_t i = length > 0 && text[0] == '-' ? 1 : 0;
+    if (i == length) {
+        return false;
+    }
+    
+    int64_t magnitude = 0;
+    for (; i < length; ++i) {
+        if (text[i] < '0' || text[i] > '9') {
+            return false;
+        }
+        magnitude = magnitude * 10 + (text[i] - '0');
+        if (magnitude > MAX_COUNTER) {
+            return false;
+        }
+    }
+    *value = text[0] == '-' ? -magnitude : magnitude;
+    return true;
+}
+
+// incrBy: the value is kept as decimal text, so get() and set() still
+// read and write counters. A missing key starts from 0. Counters keep
+// the expiry they were created with, so a rate limit window ends on time
+// however often it is bumped.
+class CounterUpdate : public ValueUpdate {
+public:
+    explicit CounterUpdate(int64_t delta) : delta_(delta), result_(0), valid_(false) {
+        keep_expiry = true;
+    }
+    
+    bool Apply(const char* current, uint32_t current_length, const char** data, size_t* length) override {
+        int64_t value = 0;
+        valid_ = !current || ParseCounter(current, current_length, &value);
+        if (valid_) {
+            result_ = value + delta_;
+            valid_ = result_ >= -MAX_COUNTER && result_ <= MAX_COUNTER;
+        }
+        if (!valid_) {
+            return false;
+        }
+        
+        *length = static_cast<size_t>(snprintf(text_, sizeof(text_), "%lld", static_cast<long long>(result_)));
+        *data = text_;
+        return true;
+    }
+    
+    bool valid() const { return valid_; }
+    int64_t result() const { return result_; }
+
+private:
+    int64_t delta_;
+    int64_t result_;
+    bool valid_;
+    char text_[24];
+};
+
+// incrBy on a typed table: adds to the 8-byte value in place, with no
+// text involved. An int64 that would overflow is left alone, and so is a
+// value of any other width, which isn't a T to add to.
+inline bool AddChecked(int64_t value, int64_t delta, int64_t* result) {
+    if (delta > 0 ? value > std::numeric_limits<int64_t>::max() - delta
+                  : value < std::numeric_limits<int64_t>::min() - delta) {
+        return false;
+    }
+    *result = value + delta;
+    return true;
+}
+
+inline bool AddChecked(double value, double delta, double* result) {
+    *result = value + delta;
+    return true;
+}
+
+template <typename T>
+class TypedCounterUpdate : public ValueUpdate {
+public:
+    explicit TypedCounterUpdate(T delta) : delta_(delta), result_(0), valid_(false) {
+        keep_expiry = true;
+    }
+    
+    bool Apply(const char* current, uint32_t current_length, const char** data, size_t* length) override {
+        T value = 0;
+        if (current) {
+            if (current_length != sizeof(value)) {
+                valid_ = false;
+                return false;
+            }
+            memcpy(&value, current, sizeof(value));
+        }
+        valid_ = AddChecked(value, delta_, &result_);
+        *data = reinterpret_cast<const char*>(&result_);
+        *length = sizeof(result_);
+        return valid_;
+    }
+    
+    bool valid() const { return valid_; }
+    T result() const { return result_; }
+
+private:
+    T delta_;
+    T result_;
+    bool valid_;
+};
+
+// compareAndSet: stores next only while the value equals expected, byte
+// for byte. A null expected matches a missing key.
+class CompareAndSetUpdate : public ValueUpdate {
+public:
+    CompareAndSetUpdate(const std::string* expected, const std::string& next)
+        : expected_(expected), next_(next), swapped_(false) {}
+    
+    bool Apply(const char* current, uint32_t current_length, const char** data, size_t* length) override {
+        if (current && expected_) {
+            swapped_ = current_length == expected_->size() && memcmp(current, expected_->data(), current_length) == 0;
+        } else {
+            swapped_ = !current && !expected_;
+        }
+        *data = next_.data();
+        *length = next_.size();
+        return swapped_;
+    }
+    
+    bool swapped() const { return swapped_; }
+
+private:
+    const std::string* expected_;
+    const std::string& next_;
+    bool swapped_;
+};
+
+// getOrSet: keeps a live value, copying it out, or stores the new one
+class GetOrSetUpdate : public ValueUpdate {
+public:
+    explicit GetOrSetUpdate(const std::string& value) : value_(value), found_(false) {}
+    
+    bool Apply(const char* current, uint32_t current_length, const char** data, size_t* length) override {
+        found_ = current != nullptr;
+        if (found_) {
+            existing_.assign(current, current_length);
+            return false;
+        }
+        *data = value_.data();
+        *length = value_.size();
+        return true;
+    }
+    
+    bool found() const { return found_; }
+    const std::string& existing() const { return existing_; }
+
+private:
+    const std::string& value_;
+    std::string existing_;
+    bool found_;
+};
+
+// One mapped segment: a header, control bytes, slots and a value arena,
+// and every operation on them. A cache normally reads and writes through
+// a single table; while a resize migrates entries it uses two.
+class ShmTable {
+public:
+    explicit ShmTable(const HandleOptions& options);
+    ~ShmTable();
+    
+    bool Create(const std::string& shm_name, const TableConfig& config, uint32_t generation);
+    bool Attach(const std::string& shm_name);
+    static void Unlink(const std::string& shm_name, bool file_backed);
+    // Segment plumbing, shared with ShmQueue: open, flock, size and map.
+    // Both leave errno set on failure; MapNewSegment unlinks what it made.
+#ifdef _WIN32
+    static bool MapNewSegment(const std::string& shm_name, size_t size, HugePages pages, bool file_backed,
+                              HANDLE* mapping, HANDLE* file, void** ptr);
+    static bool MapSegment(const std::string& shm_name, bool file_backed, bool prefault, bool read_only,
+                           HANDLE* mapping, HANDLE* file, void** ptr, size_t* size, bool* sole_user);
+#else
+    static bool MapNewSegment(const std::string& shm_name, size_t size, HugePages pages, bool file_backed, int* fd,
+                              void** ptr);
+    static bool MapSegment(const std::string& shm_name, bool file_backed, bool prefault, bool read_only, int* fd,
+                           void** ptr, size_t* size, bool* sole_user);
+#endif
+    
+    SharedMemoryHeader* header() const { return header_; }
+    ChangeLog* change_log() const { return change_log_; }
+    TableConfig Config() const;
+    bool is_creator() const { return is_creator_; }
+    // True once a resize has started moving entries to a successor table
+    bool Retired() const { return header_->successor.load(std::memory_order_acquire) != 0; }
+    
+    bool StoreValue(const std::string& key, uint64_t hash, const char* data, size_t length, uint64_t expires_at,
+                    bool moving, ValueUpdate* update);
+    bool LoadValue(const std::string& key, uint64_t hash, char* value_out, size_t capacity, uint32_t* length_out);
+    bool RemoveValue(const std::string& key, uint64_t hash);
+    size_t ReapExpired(size_t groups);
+    bool MoveSlot(size_t index, ShmTable& to);
+    bool MoveKey(const std::string& key, uint64_t hash, ShmTable& to);
+    void Clear();
+    void ReleaseArena();
+    void Populate() const { PopulatePages(shm_ptr_, shm_size_); }
+    bool Flush() const;
+    void PrefetchGroup(uint64_t hash) const;
+    void PrefetchSlots(uint64_t hash) const;
+    void PrefetchValue(uint64_t hash) const;
+    
+    // Calls fn(key, value, length, expires_at) for each live entry, as
+    // ReadEntry sees it
+    template <typename Fn>
+    void ForEachEntry(Fn fn) {
+        uint64_t now = NowNs();
+        std::string copy;
+        for (size_t base = 0; base < header_->capacity; base += GROUP_WIDTH) {
+            uint32_t full = CtrlGroup(&ctrl_[base]).MatchFull();
+            PrefetchSlotMask(base, full);
+            for (uint32_t mask = full; mask; mask &= mask - 1) {
+                ReadEntry(base + CountTrailingZeros(mask), &copy,
+                          [&](const char* key, const char* value, uint32_t length, uint64_t expires_at) {
+                    if (!IsExpired(expires_at, now)) {
+                        fn(key, value, length, expires_at);
+                    }
+                });
+            }
+        }
+    }
+    
+    // Calls fn(key, value, length) for live entries whose key starts with
+    // prefix, from slot `from` on, until *entries_left or *groups_left
+    // runs out. Returns the slot to resume from; capacity once done.
+    template <typename Fn>
+    size_t ScanEntries(size_t from, const std::string& prefix, size_t* entries_left, size_t* groups_left, Fn fn) {
+        uint64_t now = NowNs();
+        std::string copy;
+        size_t index = from;
+        while (index < header_->capacity && *entries_left > 0 && *groups_left > 0) {
+            size_t base = index & ~(GROUP_WIDTH - 1);
+            uint32_t mask = CtrlGroup(&ctrl_[base]).MatchFull() & (~0u << (index - base));
+            PrefetchSlotMask(base, mask);
+            for (; mask; mask &= mask - 1) {
+                size_t slot_index = base + CountTrailingZeros(mask);
+                ReadEntry(slot_index, &copy,
+                          [&](const char* key, const char* value, uint32_t length, uint64_t expires_at) {
+                    if (!IsExpired(expires_at, now) && strnlen(key, MAX_KEY_SIZE) >= prefix.size() &&
+                        memcmp(key, prefix.data(), prefix.size()) == 0) {
+                        fn(key, value, length);
+                        --*entries_left;
+                    }
+                });
+                
+                if (*entries_left == 0) {
+                    return slot_index + 1;
+                }
+            }
+            index = base + GROUP_WIDTH;
+            --*groups_left;
+        }
+        return index;
+    }
+
+private:
+    ShmTable(const ShmTable&) = delete;
+    ShmTable& operator=(const ShmTable&) = delete;
+    
+    void* shm_ptr_;
+    size_t shm_size_;
+    std::string shm_name_;
+    int shm_fd_;
+#ifdef _WIN32
+    HANDLE shm_mapping_;                // the file mapping object
+    HANDLE shm_file_;                   // file-backed segments only, kept for Flush
+#endif
+    bool is_creator_;
+    HandleOptions options_;
+    
+    SharedMemoryHeader* header_;
+    std::atomic<uint8_t>* ctrl_;
+    CacheSlot* slots_;
+    char* arena_;
+    uint8_t* arena_free_;
+    ChangeLog* change_log_;             // null in resize generations
+    
+    void Locate();
+    void Recover();
+    
+    // Futex lock: spin briefly, then mark the lock contended and sleep.
+    // Only an unlock that finds it contended pays for a wake-up call.
+    void LockSlot(CacheSlot& slot) {
+#ifdef FAST_SHM_PTHREAD_SLOT_LOCK
+        int rc = pthread_mutex_trylock(&slot.lock);
+        if (rc == 0) {
+            return;
+        }
+        if (rc == EOWNERDEAD) {
+            RecoverSlotLock(slot);
+            return;
+        }
+#else
+        uint32_t state = SLOT_UNLOCKED;
+        if (slot.lock.compare_exchange_strong(state, LockOwnerWord(), std::memory_order_acquire)) {
+            return;
+        }
+#endif
+        options_.stats->lock_contended.Add(1);
+        LockSlotContended(slot);
+    }
+    void LockSlotContended(CacheSlot& slot);
+    
+    void CountProbe(size_t groups) {
+        options_.stats->lookups.Add(1);
+        options_.stats->probe_groups.Add(groups);
+        options_.stats->max_probe_groups.Raise(groups);
+    }
+    
+    // Whether slot `index` holds `key`. The stored hash rules out almost
+    // every fingerprint collision before the keys are compared.
+    bool SlotHolds(size_t index, uint8_t tag, uint64_t hash, const std::string& key) const {
+        const CacheSlot& slot = slots_[index];
+        return ctrl_[index].load() == tag && slot.hash == hash &&
+               strncmp(slot.key, key.c_str(), MAX_KEY_SIZE) == 0;
+    }
+    
+    // Calls fn(key, value, length, expires_at) if slot `index` holds an
+    // entry, under its lock. A read-only handle instead copies the entry
+    // into `copy` under the seqlock, skipping the slot if its writer
+    // stalls or the copy isn't consistent.
+    template <typename Fn>
+    void ReadEntry(size_t index, std::string* copy, Fn fn) {
+        CacheSlot& slot = slots_[index];
+        if (!options_.read_only) {
+            LockSlot(slot);
+            if (IsFull(ctrl_[index].load())) {
+                fn(slot.key, ValuePtr(slot), slot.value_length, slot.expires_at.load());
+            }
+            UnlockSlot(slot);
+            return;
+        }
+        
+        char key[MAX_KEY_SIZE];
+        uint32_t version;
+        while (BeginSlotRead(slot, &version)) {
+            bool full = IsFull(ctrl_[index].load(std::memory_order_relaxed));
+            memcpy(key, slot.key, MAX_KEY_SIZE);
+            uint64_t expires_at = slot.expires_at.load(std::memory_order_relaxed);
+            uint32_t length = slot.value_length;
+            uint32_t offset = slot.value_offset;
+            if (header_->value_type != VALUE_STRING) {
+                copy->assign(reinterpret_cast<const char*>(&slot.inline_value), sizeof(slot.inline_value));
+            } else if (static_cast<size_t>(offset) * ARENA_ALIGN + length <= header_->arena_size) {
+                copy->assign(ArenaPtr(offset), length);
+            } else {
+                full = false;
+            }
+            
+            if (ValidateSlotRead(slot, version)) {
+                key[MAX_KEY_SIZE - 1] = '\0';
+                if (full) {
+                    fn(key, copy->data(), length, expires_at);
+                }
+                return;
+            }
+        }
+    }
+    bool ApplyUpdate(CacheSlot& slot, ValueUpdate* update, uint64_t now, const char** data, size_t* length,
+                     uint64_t* expires_at);
+    template <typename Visit>
+    bool FindSlot(uint64_t hash, bool retry_raced, size_t* groups, Visit visit);
+    void RecoverSlotLock(CacheSlot& slot);
+    void RepairSlot(CacheSlot& slot);
+    size_t NumGroups() const;
+    size_t ProbeLimit() const;
+    void RaiseProbeLimit(size_t groups);
+    size_t DisplaceForInsert(size_t start_group, size_t free_index);
+    void MoveEntry(size_t from_index, size_t to_index);
+    bool LookupRaced(uint32_t seq) const;
+    SlotRead ReadSlot(size_t index, uint8_t tag, uint64_t hash, const std::string& key, char* value_out,
+                      size_t capacity,
+                      uint32_t* length_out);
+    void PrefetchSlotMask(size_t base, uint32_t mask) const;
+    void EraseSlot(size_t index);
+    void ReclaimExpired(size_t index, uint8_t tag, uint64_t hash, const std::string& key);
+    void TouchSlot(size_t index);
+    bool EvictOne(size_t skip_index, size_t size_class);
+    char* ArenaPtr(uint32_t offset) const;
+    char* ValuePtr(CacheSlot& slot) const;
+    FreeChunk* Chunk(uint32_t offset) const;
+    bool IsFreeChunk(uint32_t offset, size_t size_class) const;
+    void PushChunk(uint32_t offset, size_t size_class);
+    void UnlinkChunk(uint32_t offset, size_t size_class);
+    void ReleaseChunk(uint32_t offset, size_t size_class);
+    uint32_t ArenaAlloc(size_t length);
+    void ArenaFree(uint32_t offset, uint32_t length);
+    bool WriteValue(CacheSlot& slot, const char* data, size_t length, bool replace);
+    void CompactTombstones();
+};
+
+inline size_t ShmTable::NumGroups() const {
+    return header_->capacity / GROUP_WIDTH;
+}
+
+// Groups a lookup probes at most: no entry sits further from home
+inline size_t ShmTable::ProbeLimit() const {
+    return std::min(NumGroups(), static_cast<size_t>(header_->max_probe.load()) + 1);
+}
+
+// Called with global_mutex held, before an entry is published that far
+// from its home group
+inline void ShmTable::RaiseProbeLimit(size_t groups) {
+    if (groups > header_->max_probe.load()) {
+        header_->max_probe.store(static_cast<uint32_t>(groups));
+    }
+}
+
+// A miss observed while a compaction was running may be spurious; the
+// caller probes again once the sequence is stable.
+inline bool ShmTable::LookupRaced(uint32_t seq) const {
+    return (seq & 1) != 0 || header_->rehash_seq.load() != seq;
+}
+
+// The one probe loop behind lookups. Calls visit(index) on every slot
+// in key's chain whose fingerprint matches, group by group with
+// wrap-around, until visit returns true or a group with an empty slot ends
+// the chain. groups receives how many groups were probed. With
+// retry_raced a miss that overlapped a rehash is probed again.
+template <typename Visit>
+inline bool ShmTable::FindSlot(uint64_t hash, bool retry_raced, size_t* groups, Visit visit) {
+    uint8_t tag = CtrlTag(hash);
+    size_t num_groups = NumGroups();
+    size_t start_group = hash & (num_groups - 1);
+    
+    for (;;) {
+        uint32_t seq = header_->rehash_seq.load();
+        size_t probe_limit = ProbeLimit();
+        
+        size_t g = 0;
+        for (; g < probe_limit; ++g) {
+            size_t base = ((start_group + g) & (num_groups - 1)) * GROUP_WIDTH;
+            CtrlGroup group(&ctrl_[base]);
+            
+            for (uint32_t mask = group.Match(tag); mask; mask &= mask - 1) {
+                if (visit(base + CountTrailingZeros(mask))) {
+                    *groups = g + 1;
+                    return true;
+                }
+            }
+            
+            // If the group has an empty slot, key doesn't exist
+            if (group.MatchEmpty()) {
+                ++g;
+                break;
+            }
+        }
+        
+        if (!retry_raced || !LookupRaced(seq)) {
+            *groups = g;
+            return false;
+        }
+    }
+}
+
+// Checks whether slot `index` holds a live entry for `key`, re-reading
+// its control byte under the slot's protection. On a hit the value length
+// is reported and, if it fits in `capacity`, the value is copied to
+// value_out. In seqlock mode no lock is taken; the read is retried until
+// the slot version is stable, and the offset and length are bounds-checked
+// first since they may be torn. A read-only handle can't fall back on the
+// lock, so a slot whose writer stalls reads as a miss.
+inline SlotRead ShmTable::ReadSlot(size_t index, uint8_t tag, uint64_t hash, const std::string& key, char* value_out,
+                                   size_t capacity, uint32_t* length_out) {
+    CacheSlot& slot = slots_[index];
+    
+    if (options_.read_mode == READ_MODE_SEQLOCK) {
+        uint32_t version;
+        while (BeginSlotRead(slot, &version)) {
+            bool match = ctrl_[index].load(std::memory_order_relaxed) == tag &&
+                         slot.hash == hash && strncmp(slot.key, key.c_str(), MAX_KEY_SIZE) == 0;
+            uint64_t expires_at = slot.expires_at.load(std::memory_order_relaxed);
+            uint32_t length = slot.value_length;
+            if (match && value_out && length <= capacity) {
+                uint32_t offset = slot.value_offset;
+                if (header_->value_type != VALUE_STRING) {
+                    memcpy(value_out, &slot.inline_value, std::min<size_t>(length, sizeof(slot.inline_value)));
+                } else if (static_cast<size_t>(offset) * ARENA_ALIGN + length <= header_->arena_size) {
+                    memcpy(value_out, ArenaPtr(offset), length);
+                }
+            }
+            
+            if (ValidateSlotRead(slot, version)) {
+                if (!match) {
+                    return SLOT_MISS;
+                }
+                if (IsExpired(expires_at, NowNs())) {
+                    return SLOT_EXPIRED;
+                }
+                if (length_out) {
+                    *length_out = length;
+                }
+                return SLOT_HIT;
+            }
+        }
+        if (options_.read_only) {
+            return SLOT_MISS;
+        }
+    }
+    
+    LockSlot(slot);
+    
+    SlotRead result = SLOT_MISS;
+    if (SlotHolds(index, tag, hash, key)) {
+        if (IsExpired(slot.expires_at.load(), NowNs())) {
+            result = SLOT_EXPIRED;
+        } else {
+            result = SLOT_HIT;
+            if (value_out && slot.value_length <= capacity) {
+                memcpy(value_out, ValuePtr(slot), slot.value_length);
+            }
+            if (length_out) {
+                *length_out = slot.value_length;
+            }
+        }
+    }
+    
+    UnlockSlot(slot);
+    
+    return result;
+}
+
+inline char* ShmTable::ArenaPtr(uint32_t offset) const {
+    return arena_ + static_cast<size_t>(offset) * ARENA_ALIGN;
+}
+
+inline char* ShmTable::ValuePtr(CacheSlot& slot) const {
+    if (header_->value_type != VALUE_STRING) {
+        return reinterpret_cast<char*>(&slot.inline_value);
+    }
+    return ArenaPtr(slot.value_offset);
+}
+
+inline FreeChunk* ShmTable::Chunk(uint32_t offset) const {
+    return reinterpret_cast<FreeChunk*>(ArenaPtr(offset));
+}
+
+// The free bitmap marks chunk starts only, so a set bit is trusted only
+// together with the class recorded in the chunk
+inline bool ShmTable::IsFreeChunk(uint32_t offset, size_t size_class) const {
+    return (arena_free_[offset / 8] & (1u << (offset % 8))) && Chunk(offset)->size_class == size_class;
+}
+
+inline void ShmTable::PushChunk(uint32_t offset, size_t size_class) {
+    FreeChunk* chunk = Chunk(offset);
+    uint32_t head = header_->free_heads[size_class];
+    
+    chunk->next = head;
+    chunk->prev = 0;
+    chunk->size_class = static_cast<uint32_t>(size_class);
+    if (head != 0) {
+        Chunk(head)->prev = offset;
+    }
+    header_->free_heads[size_class] = offset;
+    arena_free_[offset / 8] |= static_cast<uint8_t>(1u << (offset % 8));
+}
+
+inline void ShmTable::UnlinkChunk(uint32_t offset, size_t size_class) {
+    FreeChunk* chunk = Chunk(offset);
+    
+    if (chunk->prev != 0) {
+        Chunk(chunk->prev)->next = chunk->next;
+    } else {
+        header_->free_heads[size_class] = chunk->next;
+    }
+    if (chunk->next != 0) {
+        Chunk(chunk->next)->prev = chunk->prev;
+    }
+    arena_free_[offset / 8] &= static_cast<uint8_t>(~(1u << (offset % 8)));
+}
+
+// Frees a chunk, merging it with its buddy for as long as the buddy is
+// free too. Chunks are aligned to their own size, so a chunk's buddy sits
+// at its offset with the class bit flipped.
+inline void ShmTable::ReleaseChunk(uint32_t offset, size_t size_class) {
+    while (size_class + 1 < NUM_SIZE_CLASSES) {
+        uint32_t units = static_cast<uint32_t>(ChunkSize(size_class) / ARENA_ALIGN);
+        uint32_t buddy = offset ^ units;
+        if (buddy + units > header_->arena_top || !IsFreeChunk(buddy, size_class)) {
+            break;
+        }
+        UnlinkChunk(buddy, size_class);
+        offset = std::min(offset, buddy);
+        ++size_class;
+    }
+    
+    PushChunk(offset, size_class);
+}
+
+// Takes a chunk for `length` bytes: the smallest free chunk that fits,
+// split in halves as needed, or else a fresh one carved from the untouched
+// end of the arena. Returns 0 when nothing fits.
+inline uint32_t ShmTable::ArenaAlloc(size_t length) {
+    size_t size_class = SizeClassFor(length);
+    uint32_t units = static_cast<uint32_t>(ChunkSize(size_class) / ARENA_ALIGN);
+    uint32_t offset = 0;
+    
+    LockSharedMutex(header_, &header_->arena_mutex);
+    
+    for (size_t larger = size_class; larger < NUM_SIZE_CLASSES; ++larger) {
+        offset = header_->free_heads[larger];
+        if (offset == 0) {
+            continue;
+        }
+        
+        // Keep the first half, free the other
+        UnlinkChunk(offset, larger);
+        while (larger > size_class) {
+            --larger;
+            PushChunk(offset + static_cast<uint32_t>(ChunkSize(larger) / ARENA_ALIGN), larger);
+        }
+        break;
+    }
+    
+    if (offset == 0) {
+        uint32_t top = header_->arena_top;
+        uint64_t aligned = AlignUp(top, units);
+        
+        if (aligned + units <= header_->arena_size / ARENA_ALIGN) {
+            offset = static_cast<uint32_t>(aligned);
+            header_->arena_top = offset + units;
+            
+            // Free the alignment gap as the largest aligned chunks it holds
+            while (top < offset) {
+                size_t gap_class = 0;
+                while (gap_class + 1 < NUM_SIZE_CLASSES && top % (2u << gap_class) == 0 &&
+                       top + (2u << gap_class) <= offset) {
+                    ++gap_class;
+                }
+                ReleaseChunk(top, gap_class);
+                top += 1u << gap_class;
+            }
+        }
+    }
+    
+    UnlockSharedMutex(&header_->arena_mutex);
+    
+    return offset;
+}
+
+inline void ShmTable::ArenaFree(uint32_t offset, uint32_t length) {
+    if (offset == 0) {
+        return;
+    }
+    
+    LockSharedMutex(header_, &header_->arena_mutex);
+    ReleaseChunk(offset, SizeClassFor(length));
+    UnlockSharedMutex(&header_->arena_mutex);
+}
+
+// Stores a value into the slot's arena chunk, reusing the current chunk
+// when the size class is unchanged. Called with slot.lock held inside a
+// slot write section, so readers retry around the swap and the old chunk
+// can be freed at once. Returns false, leaving the slot as it was, if the
+// arena is exhausted.
+inline bool ShmTable::WriteValue(CacheSlot& slot, const char* data, size_t length, bool replace) {
+    if (header_->value_type != VALUE_STRING) {
+        memcpy(&slot.inline_value, data, sizeof(slot.inline_value));
+        slot.value_length = sizeof(slot.inline_value);
+        return true;
+    }
+    
+    uint32_t old_offset = replace ? slot.value_offset : 0;
+    uint32_t old_length = replace ? slot.value_length : 0;
+    
+    if (old_offset != 0 && length > 0 && SizeClassFor(old_length) == SizeClassFor(length)) {
+        memcpy(ArenaPtr(old_offset), data, length);
+        slot.value_length = static_cast<uint32_t>(length);
+        return true;
+    }
+    
+    uint32_t offset = 0;
+    if (length > 0) {
+        offset = ArenaAlloc(length);
+        if (offset == 0) {
+            return false;
+        }
+        memcpy(ArenaPtr(offset), data, length);
+    }
+    
+    slot.value_offset = offset;
+    slot.value_length = static_cast<uint32_t>(length);
+    ArenaFree(old_offset, old_length);
+    
+    return true;
+}
+
+// Rebuilds probe chains without tombstones. Must be called with
+// global_mutex held, so no insert can fill an EMPTY slot meanwhile.
+// Walking forward group by group from one that already has an EMPTY slot
+// (no chain crosses it), tombstones are cleared and each live entry is
+// moved back to the first group with an EMPTY slot on its own probe path.
+// Readers that miss during the move retry via rehash_seq.
+inline void ShmTable::CompactTombstones() {
+    size_t num_groups = NumGroups();
+    
+    size_t start = num_groups;
+    for (size_t g = 0; g < num_groups; ++g) {
+        if (CtrlGroup(&ctrl_[g * GROUP_WIDTH]).MatchEmpty()) {
+            start = g;
+            break;
+        }
+    }
+    
+    // The spare slot reserved by CapacityFor keeps this from happening
+    if (start == num_groups) {
+        return;
+    }
+    
+    header_->rehash_seq.fetch_add(1);
+    size_t max_probe = 0;
+    
+    // The start group is visited last, after everything that wraps into it
+    for (size_t n = 1; n <= num_groups; ++n) {
+        size_t group = (start + n) & (num_groups - 1);
+        size_t base = group * GROUP_WIDTH;
+        
+        for (uint32_t mask = CtrlGroup(&ctrl_[base]).Match(CTRL_TOMBSTONE); mask; mask &= mask - 1) {
+            size_t index = base + CountTrailingZeros(mask);
+            CacheSlot& slot = slots_[index];
+            
+            LockSlot(slot);
+            BeginSlotWrite(slot);
+            ctrl_[index].store(CTRL_EMPTY);
+            EndSlotWrite(slot);
+            UnlockSlot(slot);
+            
+            header_->num_tombstones.fetch_sub(1);
+        }
+        
+        for (uint32_t mask = CtrlGroup(&ctrl_[base]).MatchFull(); mask; mask &= mask - 1) {
+            size_t index = base + CountTrailingZeros(mask);
+            CacheSlot& slot = slots_[index];
+            
+            LockSlot(slot);
+            
+            uint8_t ctrl = ctrl_[index].load();
+            if (IsFull(ctrl)) {
+                size_t home = slot.hash & (num_groups - 1);
+                size_t final_group = group;
+                for (size_t target = home; target != group; target = (target + 1) & (num_groups - 1)) {
+                    uint32_t empty = CtrlGroup(&ctrl_[target * GROUP_WIDTH]).MatchEmpty();
+                    if (!empty) {
+                        continue;
+                    }
+                    
+                    size_t dest_index = target * GROUP_WIDTH + CountTrailingZeros(empty);
+                    CacheSlot& dest = slots_[dest_index];
+                    
+                    LockSlot(dest);
+                    BeginSlotWrite(dest);
+                    CopyEntry(slot, dest);
+                    ctrl_[dest_index].store(ctrl);
+                    EndSlotWrite(dest);
+                    UnlockSlot(dest);
+                    
+                    BeginSlotWrite(slot);
+                    ctrl_[index].store(CTRL_EMPTY);
+                    ClearEntry(slot);
+                    EndSlotWrite(slot);
+                    final_group = target;
+                    break;
+                }
+                max_probe = std::max(max_probe, (final_group - home) & (num_groups - 1));
+            }
+            
+            UnlockSlot(slot);
+        }
+    }
+    
+    // Entries only moved closer to home, so the limit may come down
+    header_->max_probe.store(static_cast<uint32_t>(max_probe));
+    header_->rehash_seq.fetch_add(1);
+}
+
+// Robin Hood insertion. Walking from the home group to the one holding
+// free_index, the first free slot on the path, each group's entry
+// closest to its own home gives up its slot whenever the entry being
+// carried is further from home; the displaced entry is carried on.
+// Every group before free_index's is full, so the path never changes.
+// The moves are then made backwards from the free slot, each entry
+// copied before its old slot is cleared, under an odd rehash_seq so
+// lookups that miss meanwhile retry. Returns the slot left free for the
+// new entry. Called with global_mutex held.
+inline size_t ShmTable::DisplaceForInsert(size_t start_group, size_t free_index) {
+    size_t num_groups = NumGroups();
+    size_t free_group = free_index / GROUP_WIDTH;
+    std::vector<size_t> displaced;
+    size_t carried = 0;                 // distance of the carried entry from its home
+    size_t farthest = 0;
+    
+    for (size_t group = start_group; group != free_group; group = (group + 1) & (num_groups - 1)) {
+        size_t base = group * GROUP_WIDTH;
+        size_t richest = header_->capacity;
+        size_t richest_distance = carried;
+        
+        // Only inserters, which hold global_mutex, write slot hashes
+        for (uint32_t mask = CtrlGroup(&ctrl_[base]).MatchFull(); mask; mask &= mask - 1) {
+            size_t index = base + CountTrailingZeros(mask);
+            size_t distance = (group - (slots_[index].hash & (num_groups - 1))) & (num_groups - 1);
+            if (distance < richest_distance) {
+                richest = index;
+                richest_distance = distance;
+            }
+        }
+        
+        if (richest != header_->capacity) {
+            displaced.push_back(richest);
+            farthest = std::max(farthest, carried);
+            carried = richest_distance;
+        }
+        ++carried;
+    }
+    farthest = std::max(farthest, carried);
+    RaiseProbeLimit(farthest);
+    
+    if (displaced.empty()) {
+        return free_index;
+    }
+    
+    header_->rehash_seq.fetch_add(1);
+    size_t to_index = free_index;
+    for (size_t i = displaced.size(); i-- > 0;) {
+        MoveEntry(displaced[i], to_index);
+        to_index = displaced[i];
+    }
+    header_->rehash_seq.fetch_add(1);
+    
+    return displaced[0];
+}
+
+// Moves the entry in from_index to the free slot to_index, leaving a
+// tombstone behind. An entry deleted meanwhile leaves nothing to move.
+inline void ShmTable::MoveEntry(size_t from_index, size_t to_index) {
+    CacheSlot& from = slots_[from_index];
+    CacheSlot& to = slots_[to_index];
+    
+    LockSlot(to);
+    LockSlot(from);
+    
+    uint8_t ctrl = ctrl_[from_index].load();
+    if (IsFull(ctrl)) {
+        BeginSlotWrite(to);
+        if (ctrl_[to_index].load() == CTRL_TOMBSTONE) {
+            header_->num_tombstones.fetch_sub(1);
+        }
+        CopyEntry(from, to);
+        ctrl_[to_index].store(ctrl);
+        EndSlotWrite(to);
+        
+        BeginSlotWrite(from);
+        ctrl_[from_index].store(CTRL_TOMBSTONE);
+        ClearEntry(from);
+        EndSlotWrite(from);
+        header_->num_tombstones.fetch_add(1);
+    }
+    
+    UnlockSlot(from);
+    UnlockSlot(to);
+}
+
+inline ShmTable::ShmTable(const HandleOptions& options)
+    : shm_ptr_(nullptr), shm_size_(0), shm_fd_(-1), is_creator_(false), options_(options), header_(nullptr),
+      ctrl_(nullptr), slots_(nullptr), arena_(nullptr), arena_free_(nullptr), change_log_(nullptr) {
+#ifdef _WIN32
+    shm_mapping_ = NULL;
+    shm_file_ = INVALID_HANDLE_VALUE;
+#endif
+}
+
+inline ShmTable::~ShmTable() {
+#ifdef _WIN32
+    if (shm_ptr_) {
+        UnmapViewOfFile(shm_ptr_);
+    }
+    if (shm_mapping_) {
+        CloseHandle(shm_mapping_);
+    }
+    if (shm_file_ != INVALID_HANDLE_VALUE) {
+        CloseHandle(shm_file_);
+    }
+#else
+    if (shm_ptr_ && shm_ptr_ != MAP_FAILED) {
+        munmap(shm_ptr_, shm_size_);
+    }
+    
+    if (shm_fd_ != -1) {
+        close(shm_fd_);
+    }
+#endif
+}
+
+// Creates and initializes a new segment. Fails with errno set to EEXIST
+// if the name is taken: O_EXCL decides the creator, so two processes
+// starting together can't both initialize the segment.
+inline bool ShmTable::Create(const std::string& shm_name, const TableConfig& config, uint32_t generation) {
+    shm_name_ = shm_name;
+    size_t capacity = CapacityFor(config.max_keys);
+    size_t change_log_offset = generation == 0 ? ChangeLogOffset(capacity, config.arena_size) : 0;
+    shm_size_ = generation == 0 ? change_log_offset + sizeof(ChangeLog) : SegmentSize(capacity, config.arena_size);
+    
+    // hugetlbfs and Windows large pages only map whole huge pages
+    size_t page_bytes = HugePageBytes(config.huge_pages);
+    if (page_bytes != 0) {
+        shm_size_ = AlignUp(shm_size_, page_bytes);
+    }
+    
+#ifdef _WIN32
+    if (!MapNewSegment(shm_name_, shm_size_, config.huge_pages, options_.file_backed, &shm_mapping_, &shm_file_,
+                       &shm_ptr_)) {
+        return false;
+    }
+#else
+    if (!MapNewSegment(shm_name_, shm_size_, config.huge_pages, options_.file_backed, &shm_fd_, &shm_ptr_)) {
+        return false;
+    }
+    
+#ifdef MADV_HUGEPAGE
+    if (config.huge_pages == HUGE_PAGES_TRANSPARENT) {
+        madvise(shm_ptr_, shm_size_, MADV_HUGEPAGE);
+    }
+#endif
+#endif
+    
+    is_creator_ = true;
+    header_ = static_cast<SharedMemoryHeader*>(shm_ptr_);
+    
+    // A fresh segment reads as zeros, which is already an empty table
+    // with every slot unlocked. Only the header page is touched here
+    // unless the caller asked for every page up front.
+    PreferNumaNode(shm_ptr_, shm_size_, config.numa_node);
+    if (options_.prefault) {
+        PopulatePages(shm_ptr_, shm_size_);
+    }
+    header_->layout_version = SHM_LAYOUT_VERSION;
+    header_->generation = generation;
+    header_->max_keys = config.max_keys;
+    header_->capacity = capacity;
+    header_->max_value_size = config.max_value_size;
+    header_->arena_size = config.arena_size;
+    header_->eviction_policy = config.eviction;
+    header_->probing = config.probing;
+    header_->value_type = config.value_type;
+    header_->num_shards = config.num_shards;
+    header_->numa_node = config.numa_node;
+    header_->huge_pages = config.huge_pages;
+    header_->slot_lock = SLOT_LOCK_KIND;
+    header_->arena_top = 1;             // keep offset 0 free as "none"
+    header_->num_entries.store(0);
+    header_->num_tombstones.store(0);
+    header_->rehash_seq.store(0);
+    header_->successor.store(0);
+    // Later generations are created by a resize, which then fills them
+    header_->migrating.store(generation != 0 ? 1 : 0);
+    header_->latest_generation.store(generation);
+    header_->reserved.store(0);
+    header_->change_log_offset = change_log_offset;
+    InitSharedMutex(&header_->global_mutex);
+    InitSharedMutex(&header_->arena_mutex);
+    
+    Locate();
+#ifdef FAST_SHM_PTHREAD_SLOT_LOCK
+    // Unlike a futex word, a zeroed mutex isn't process-shared, so this
+    // build touches every slot page on creation
+    for (size_t i = 0; i < capacity; ++i) {
+        InitSharedMutex(&slots_[i].lock);
+    }
+#endif
+    
+    header_->magic.store(SHM_MAGIC, std::memory_order_release);
+    return true;
+}
+
+// Maps an existing segment once its creator has finished initializing it
+inline bool ShmTable::Attach(const std::string& shm_name) {
+    shm_name_ = shm_name;
+    
+    bool sole_user = false;
+#ifdef _WIN32
+    if (!MapSegment(shm_name_, options_.file_backed, options_.prefault, options_.read_only, &shm_mapping_,
+                    &shm_file_, &shm_ptr_, &shm_size_, &sole_user)) {
+        return false;
+    }
+#else
+    if (!MapSegment(shm_name_, options_.file_backed, options_.prefault, options_.read_only, &shm_fd_, &shm_ptr_,
+                    &shm_size_, &sole_user)) {
+        return false;
+    }
+#endif
+    
+    header_ = static_cast<SharedMemoryHeader*>(shm_ptr_);
+    
+    int waited = 0;
+    while (header_->magic.load(std::memory_order_acquire) != SHM_MAGIC) {
+        if (++waited > ATTACH_TIMEOUT_MS) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    
+    // Reject segments written by an incompatible build
+    if (header_->layout_version != SHM_LAYOUT_VERSION ||
+        header_->slot_lock != SLOT_LOCK_KIND ||
+        header_->capacity < GROUP_WIDTH || (header_->capacity & (header_->capacity - 1)) != 0 ||
+        shm_size_ < SegmentSize(header_->capacity, header_->arena_size) ||
+        shm_size_ < header_->change_log_offset + (header_->change_log_offset != 0 ? sizeof(ChangeLog) : 0)) {
+        return false;
+    }
+    
+#ifdef MADV_HUGEPAGE
+    if (header_->huge_pages == HUGE_PAGES_TRANSPARENT) {
+        madvise(shm_ptr_, shm_size_, MADV_HUGEPAGE);
+    }
+#endif
+    
+    Locate();
+    if (sole_user) {
+        Recover();
+#ifndef _WIN32
+        flock(shm_fd_, LOCK_SH);
+#endif
+    }
+    return true;
+}
+
+// Resets the locks and seqlock counters left by processes that are gone.
+// Only called by a handle that knows it's the segment's sole user.
+inline void ShmTable::Recover() {
+    InitSharedMutex(&header_->global_mutex);
+    InitSharedMutex(&header_->arena_mutex);
+    
+    if (header_->rehash_seq.load() & 1) {
+        header_->rehash_seq.fetch_add(1);
+    }
+    if (change_log_) {
+        change_log_->watchers.store(0);
+        change_log_->watch_sleepers.store(0);
+    }
+    for (size_t i = 0; i < header_->capacity; ++i) {
+        CacheSlot& slot = slots_[i];
+#ifdef FAST_SHM_PTHREAD_SLOT_LOCK
+        InitSharedMutex(&slot.lock);
+#else
+        if (slot.lock.load() != SLOT_UNLOCKED) {
+            slot.lock.store(SLOT_UNLOCKED);
+        }
+#endif
+        RepairSlot(slot);
+    }
+}
+
+#ifdef FAST_SHM_PTHREAD_SLOT_LOCK
+// Slow path of LockSlot. Each wait that outlasts lock_timeout_ms is
+// counted; the kernel hands over the lock of a dead owner as EOWNERDEAD.
+inline void ShmTable::LockSlotContended(CacheSlot& slot) {
+    uint32_t timeout_ms = options_.lock_timeout_ms;
+    bool timed_out = false;
+    for (;;) {
+        int rc;
+        if (timeout_ms == 0) {
+            rc = pthread_mutex_lock(&slot.lock);
+        } else {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += timeout_ms / 1000;
+            deadline.tv_nsec += static_cast<long>(timeout_ms % 1000) * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000;
+            }
+            rc = pthread_mutex_timedlock(&slot.lock, &deadline);
+        }
+        
+        if (rc == 0) {
+            return;
+        }
+        if (rc == EOWNERDEAD) {
+            RecoverSlotLock(slot);
+            return;
+        }
+        if (rc == ETIMEDOUT && !timed_out) {
+            timed_out = true;
+            header_->lock_timeouts.fetch_add(1);
+        }
+    }
+}
+#else
+// Slow path of LockSlot. Each time a wait outlasts lock_timeout_ms the
+// owner is checked, and if its process is gone the lock is taken over.
+inline void ShmTable::LockSlotContended(CacheSlot& slot) {
+    uint32_t state;
+    for (int spins = 0; spins < SLOT_LOCK_SPIN_LIMIT; ++spins) {
+        state = slot.lock.load(std::memory_order_relaxed);
+        if (state == SLOT_UNLOCKED &&
+            slot.lock.compare_exchange_weak(state, LockOwnerWord(), std::memory_order_acquire)) {
+            return;
+        }
+    }
+    
+    // Once this has slept, it takes the lock still marked contended:
+    // others may be asleep on it too
+    uint32_t timeout_ms = options_.lock_timeout_ms;
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+    bool timed_out = false;
+    for (;;) {
+        state = slot.lock.load(std::memory_order_relaxed);
+        if (state == SLOT_UNLOCKED) {
+            if (slot.lock.compare_exchange_weak(state, LockOwnerWord() | SLOT_CONTENDED,
+                                                std::memory_order_acquire)) {
+                return;
+            }
+            continue;
+        }
+        if (!(state & SLOT_CONTENDED)) {
+            if (!slot.lock.compare_exchange_weak(state, state | SLOT_CONTENDED, std::memory_order_relaxed)) {
+                continue;
+            }
+            state |= SLOT_CONTENDED;
+        }
+        
+        if (timeout_ms == 0) {
+            FutexWait(&slot.lock, state, 0);
+            continue;
+        }
+        
+        auto now = std::chrono::steady_clock::now();
+        if (now < deadline) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count();
+            FutexWait(&slot.lock, state, static_cast<uint32_t>(remaining) + 1);
+            continue;
+        }
+        
+        if (!timed_out) {
+            timed_out = true;
+            header_->lock_timeouts.fetch_add(1);
+        }
+        deadline = now + std::chrono::milliseconds(timeout_ms);
+        if (LockOwnerDied(state) &&
+            slot.lock.compare_exchange_strong(state, LockOwnerWord() | SLOT_CONTENDED, std::memory_order_acquire)) {
+            RecoverSlotLock(slot);
+            return;
+        }
+    }
+}
+#endif
+
+// Takes over a slot lock whose owner died, which the caller now holds
+inline void ShmTable::RecoverSlotLock(CacheSlot& slot) {
+    RepairSlot(slot);
+#ifdef FAST_SHM_PTHREAD_SLOT_LOCK
+    pthread_mutex_consistent(&slot.lock);
+#endif
+    header_->locks_recovered.fetch_add(1);
+}
+
+// Called holding a slot lock whose previous owner died. An odd version
+// means it died mid-write, so the entry can't be trusted: it's dropped,
+// and its value chunk, whose free-list state is unknown, is leaked.
+inline void ShmTable::RepairSlot(CacheSlot& slot) {
+    uint32_t version = slot.version.load(std::memory_order_relaxed);
+    if (!(version & 1)) {
+        return;
+    }
+    
+    size_t index = static_cast<size_t>(&slot - slots_);
+    if (IsFull(ctrl_[index].load())) {
+        ctrl_[index].store(CTRL_TOMBSTONE);
+        size_t entries = header_->num_entries.load();
+        while (entries > 0 && !header_->num_entries.compare_exchange_weak(entries, entries - 1)) {
+        }
+        header_->num_tombstones.fetch_add(1);
+    }
+    memset(slot.key, 0, MAX_KEY_SIZE);
+    slot.value_offset = 0;
+    slot.value_length = 0;
+    slot.expires_at.store(0);
+    slot.version.store(version + 1, std::memory_order_release);
+}
+
+// Writes dirty pages back to the file and waits for them. Only does
+// real work for file-backed segments; a read-only handle has none.
+inline bool ShmTable::Flush() const {
+    if (options_.read_only) {
+        return true;
+    }
+    
+#ifdef _WIN32
+    // FlushViewOfFile only starts the writes
+    return FlushViewOfFile(shm_ptr_, shm_size_) != 0 &&
+           (shm_file_ == INVALID_HANDLE_VALUE || FlushFileBuffers(shm_file_) != 0);
+#else
+    return msync(shm_ptr_, shm_size_, MS_SYNC) == 0;
+#endif
+}
+
+inline TableConfig ShmTable::Config() const {
+    TableConfig config;
+    config.max_keys = header_->max_keys;
+    config.max_value_size = header_->max_value_size;
+    config.arena_size = header_->arena_size;
+    config.eviction = static_cast<EvictionPolicy>(header_->eviction_policy);
+    config.probing = static_cast<Probing>(header_->probing);
+    config.value_type = static_cast<ValueType>(header_->value_type);
+    config.num_shards = header_->num_shards;
+    config.numa_node = header_->numa_node;
+    config.huge_pages = static_cast<HugePages>(header_->huge_pages);
+    return config;
+}
+
+inline void ShmTable::Locate() {
+    ctrl_ = reinterpret_cast<std::atomic<uint8_t>*>(static_cast<char*>(shm_ptr_) + CtrlOffset());
+    slots_ = reinterpret_cast<CacheSlot*>(static_cast<char*>(shm_ptr_) + SlotsOffset(header_->capacity));
+    arena_free_ = reinterpret_cast<uint8_t*>(static_cast<char*>(shm_ptr_) + ArenaBitmapOffset(header_->capacity));
+    arena_ = static_cast<char*>(shm_ptr_) + ArenaOffset(header_->capacity, header_->arena_size);
+    change_log_ = header_->change_log_offset == 0 ? nullptr :
+        reinterpret_cast<ChangeLog*>(static_cast<char*>(shm_ptr_) + header_->change_log_offset);
+}
+
+#ifdef _WIN32
+// Maps with large pages on Windows 10 1703 and later, which require it
+// for views of large-page sections
+#ifndef FILE_MAP_LARGE_PAGES
+  #define FILE_MAP_LARGE_PAGES 0x20000000
+#endif
+
+// Pagefile-backed segments are named mappings; the name deciding the
+// creator plays the part of O_EXCL. Large pages are 2 MB on Windows and
+// can't back a file.
+inline bool ShmTable::MapNewSegment(const std::string& shm_name, size_t size, HugePages pages, bool file_backed,
+                                    HANDLE* mapping, HANDLE* file, void** ptr) {
+    DWORD protect = PAGE_READWRITE;
+    DWORD access = FILE_MAP_ALL_ACCESS;
+    if (pages == HUGE_PAGES_2MB || pages == HUGE_PAGES_1GB) {
+        if (file_backed || HugePageBytes(pages) != GetLargePageMinimum()) {
+            errno = ENOTSUP;
+            return false;
+        }
+        if (!EnableLockMemoryPrivilege()) {
+            errno = EPERM;
+            return false;
+        }
+        protect |= SEC_COMMIT | SEC_LARGE_PAGES;
+        access |= FILE_MAP_LARGE_PAGES;
+    }
+    
+    *file = INVALID_HANDLE_VALUE;
+    if (file_backed) {
+        *file = CreateFileA(shm_name.c_str(), GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, CREATE_NEW,
+                            FILE_ATTRIBUTE_NORMAL, NULL);
+        if (*file == INVALID_HANDLE_VALUE) {
+            errno = ErrnoFromWin32(GetLastError());
+            return false;
+        }
+    }
+    
+    *mapping = CreateFileMappingA(*file, NULL, protect, static_cast<DWORD>(static_cast<uint64_t>(size) >> 32),
+                                  static_cast<DWORD>(size), MappingName(shm_name, file_backed).c_str());
+    DWORD error = GetLastError();
+    if (*mapping && error == ERROR_ALREADY_EXISTS) {
+        CloseHandle(*mapping);
+        *mapping = NULL;
+    }
+    if (*mapping) {
+        *ptr = MapViewOfFile(*mapping, access, 0, 0, size);
+        error = GetLastError();
+    }
+    if (!*mapping || !*ptr) {
+        if (*mapping) {
+            CloseHandle(*mapping);
+            *mapping = NULL;
+        }
+        if (*file != INVALID_HANDLE_VALUE) {
+            CloseHandle(*file);
+            *file = INVALID_HANDLE_VALUE;
+            Unlink(shm_name, file_backed);
+        }
+        errno = ErrnoFromWin32(error);
+        return false;
+    }
+    return true;
+}
+
+// sole_user is only ever set for file-backed segments: creating their
+// named mapping, rather than finding it, means nobody else has the file
+// mapped. A pagefile-backed one has always someone, or it wouldn't exist.
+inline bool ShmTable::MapSegment(const std::string& shm_name, bool file_backed, bool prefault, bool read_only,
+                                 HANDLE* mapping, HANDLE* file, void** ptr, size_t* size, bool* sole_user) {
+    DWORD access = read_only ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS;
+    *file = INVALID_HANDLE_VALUE;
+    *sole_user = false;
+    if (file_backed) {
+        *file = CreateFileA(shm_name.c_str(), read_only ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE,
+                            FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, NULL);
+        if (*file == INVALID_HANDLE_VALUE) {
+            errno = ErrnoFromWin32(GetLastError());
+            return false;
+        }
+        
+        // The creator may not have sized the file yet
+        LARGE_INTEGER file_size;
+        for (int waited = 0; ; ++waited) {
+            if (!GetFileSizeEx(*file, &file_size)) {
+                errno = ErrnoFromWin32(GetLastError());
+                return false;
+            }
+            if (file_size.QuadPart > 0) {
+                break;
+            }
+            if (waited >= ATTACH_TIMEOUT_MS) {
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        *size = static_cast<size_t>(file_size.QuadPart);
+        
+        // A read-only section created under the shared name would deny
+        // writers that open it later, so readers map the file unnamed
+        if (read_only) {
+            *mapping = CreateFileMappingA(*file, NULL, PAGE_READONLY, 0, 0, NULL);
+        } else {
+            *mapping = CreateFileMappingA(*file, NULL, PAGE_READWRITE, 0, 0, MappingName(shm_name, true).c_str());
+            *sole_user = *mapping && GetLastError() != ERROR_ALREADY_EXISTS;
+        }
+    } else {
+        *mapping = OpenFileMappingA(access, FALSE, MappingName(shm_name, false).c_str());
+    }
+    if (!*mapping) {
+        errno = ErrnoFromWin32(GetLastError());
+        return false;
+    }
+    
+    // Views of a large-page section fail without the flag on systems that
+    // know it, and the attacher can't tell what it has until it's mapped
+    *ptr = MapViewOfFile(*mapping, access, 0, 0, 0);
+    if (!*ptr && !file_backed) {
+        *ptr = MapViewOfFile(*mapping, access | FILE_MAP_LARGE_PAGES, 0, 0, 0);
+    }
+    if (!*ptr) {
+        errno = ErrnoFromWin32(GetLastError());
+        return false;
+    }
+    
+    if (!file_backed) {
+        MEMORY_BASIC_INFORMATION region;
+        VirtualQuery(*ptr, &region, sizeof(region));
+        *size = region.RegionSize;
+    }
+    
+    // No MAP_POPULATE here, so fault the pages in by hand
+    if (prefault) {
+        PopulatePages(*ptr, *size);
+    }
+    return true;
+}
+#else
+inline bool ShmTable::MapNewSegment(const std::string& shm_name, size_t size, HugePages pages, bool file_backed,
+                                    int* fd, void** ptr) {
+    *fd = OpenSegment(shm_name, O_CREAT | O_EXCL | O_RDWR, pages, file_backed);
+    if (*fd == -1) {
+        return false;
+    }
+    
+    // Every handle holds a shared lock while mapped; see MapSegment.
+    // Taken before sizing, as attachers only try for an exclusive one after.
+    flock(*fd, LOCK_SH);
+    if (ftruncate(*fd, size) == -1) {
+        int error = errno;
+        Unlink(shm_name, file_backed);
+        errno = error;
+        return false;
+    }
+    
+    // Fails with ENOMEM when too few huge pages are free, rather than
+    // leaving a later fault to SIGBUS
+    *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (*ptr == MAP_FAILED) {
+        int error = errno;
+        Unlink(shm_name, file_backed);
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+inline bool ShmTable::MapSegment(const std::string& shm_name, bool file_backed, bool prefault, bool read_only, int* fd,
+                                 void** ptr, size_t* size, bool* sole_user) {
+    *fd = OpenSegment(shm_name, read_only ? O_RDONLY : O_RDWR, HUGE_PAGES_NONE, file_backed);
+    if (*fd == -1) {
+        return false;
+    }
+    
+    // The creator may not have sized the segment yet. Map what is
+    // really there rather than what this caller asked for.
+    struct stat sb;
+    for (int waited = 0; ; ++waited) {
+        if (fstat(*fd, &sb) == -1) {
+            return false;
+        }
+        if (sb.st_size > 0) {
+            break;
+        }
+        if (waited >= ATTACH_TIMEOUT_MS) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    *size = static_cast<size_t>(sb.st_size);
+    
+    // Getting the lock exclusively means no live process has the segment
+    // mapped: a warm restart from a file, or a persisted segment whose
+    // users all died. Anything they held is repaired before sharing it.
+    // Linux downgrades to the shared lock without letting others in.
+    // A read-only handle can't repair anything, so it never asks.
+    *sole_user = !read_only && flock(*fd, LOCK_EX | LOCK_NB) == 0;
+    if (!*sole_user) {
+        flock(*fd, LOCK_SH);
+    }
+    
+    // MAP_POPULATE maps the pages the creator already faulted in, so
+    // this process doesn't take a fault per page on its first requests
+    int flags = MAP_SHARED | (prefault ? MAP_POPULATE : 0);
+    *ptr = mmap(NULL, *size, read_only ? PROT_READ : PROT_READ | PROT_WRITE, flags, *fd, 0);
+    return *ptr != MAP_FAILED;
+}
+#endif
+
+inline void ShmTable::Unlink(const std::string& shm_name, bool file_backed) {
+#ifdef _WIN32
+    // Named mappings go away with their last handle; files need deleting
+    if (file_backed) {
+        DeleteFileA(shm_name.c_str());
+    }
+#else
+    if (file_backed) {
+        unlink(shm_name.c_str());
+        return;
+    }
+    if (shm_unlink(shm_name.c_str()) == 0) {
+        return;
+    }
+    for (const HugetlbfsMount& mount : HugetlbfsMounts()) {
+        unlink((mount.path + shm_name).c_str());
+    }
+#endif
+}
+
+// Hands a drained table's arena pages back to the system. Mappings stay
+// valid and read zeros, and no live slot points into them any more.
+inline void ShmTable::ReleaseArena() {
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+    // The change log after the arena stays in use while the shard lives
+    size_t start = ArenaBitmapOffset(header_->capacity);
+    size_t end = header_->change_log_offset != 0 ? header_->change_log_offset : shm_size_;
+    if (shm_fd_ != -1 && end > start) {
+        fallocate(shm_fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start);
+    }
+#endif
+}
+
+// Writes `length` bytes from `data` under `key` (whose hash the caller
+// has computed), inserting it if needed. The entry expires at expires_at
+// (0 for never), replacing any earlier TTL. `moving` marks an entry
+// migrated in from the predecessor table: it never replaces the key,
+// which must have been written since, and may use the room reserved for
+// it.
+// Returns false if the key or value is too large, the table or arena is
+// full, or the table was retired by a resize and takes no new keys.
+inline bool ShmTable::StoreValue(const std::string& key, uint64_t hash, const char* data, size_t length,
+                                 uint64_t expires_at, bool moving, ValueUpdate* update) {
+    // Typed values are exactly 8 bytes; update callers pass that much
+    if (key.length() >= MAX_KEY_SIZE || length > header_->max_value_size ||
+        (header_->value_type != VALUE_STRING && length != header_->max_value_size)) {
+        return false;
+    }
+    
+    uint8_t tag = CtrlTag(hash);
+    size_t num_groups = NumGroups();
+    size_t start_group = hash & (num_groups - 1);
+    // Writes leave the reference bit clear: only reads earn a second chance
+    uint64_t now = NowNs() & ~TIMESTAMP_REFERENCED;
+    uint32_t evict = header_->eviction_policy;
+    bool needs_room = false;
+    
+    // Fast path: overwrite an existing entry in place
+    bool found = false;
+    bool stored = false;
+    size_t groups = 0;
+    FindSlot(hash, false, &groups, [&](size_t index) {
+        CacheSlot& slot = slots_[index];
+        LockSlot(slot);
+        
+        if (!SlotHolds(index, tag, hash, key)) {
+            UnlockSlot(slot);
+            return false;
+        }
+        
+        found = true;
+        if (moving) {
+            UnlockSlot(slot);
+            stored = true;
+            return true;
+        }
+        
+        const char* value = data;
+        size_t value_length = length;
+        uint64_t expiry = expires_at;
+        if (update && !ApplyUpdate(slot, update, now, &value, &value_length, &expiry)) {
+            UnlockSlot(slot);
+            TouchSlot(index);
+            stored = true;
+            return true;
+        }
+        if (value_length > header_->max_value_size) {
+            UnlockSlot(slot);
+            return true;
+        }
+        
+        BeginSlotWrite(slot);
+        stored = WriteValue(slot, value, value_length, true);
+        if (stored) {
+            slot.timestamp.store(now);
+            slot.expires_at.store(expiry);
+        }
+        EndSlotWrite(slot);
+        
+        UnlockSlot(slot);
+        
+        // Out of arena space: retry under the global mutex, which may
+        // evict to make room
+        needs_room = !stored && evict != EVICTION_NONE;
+        return true;
+    });
+    
+    if (found && !needs_room) {
+        return stored;
+    }
+    
+    // Insert path: serialized so two writers can't claim different slots
+    // for the same key. The chain is probed again under the lock.
+    LockSharedMutex(header_, &header_->global_mutex);
+    
+    // A resize sets the successor under this lock, so from then on every
+    // new key goes to the successor and the migration can't miss one
+    if (Retired()) {
+        UnlockSharedMutex(&header_->global_mutex);
+        return false;
+    }
+    
+    // Make room before compacting so the freed slot's tombstone is
+    // accounted for. If a racing insert of this key won, or an update
+    // declines to insert, this evicts one entry early.
+    size_t limit = header_->max_keys;
+    if (!moving) {
+        limit -= std::min(limit, header_->reserved.load());
+    }
+    if (evict != EVICTION_NONE && header_->num_entries.load() >= limit) {
+        EvictOne(header_->capacity, NUM_SIZE_CLASSES);
+    }
+    
+    // Compact when tombstones pile up, or before the last EMPTY slot is used
+    size_t tombstones = header_->num_tombstones.load();
+    if (tombstones > 0 &&
+        (tombstones * TOMBSTONE_COMPACT_DIVISOR > header_->capacity ||
+         header_->num_entries.load() + tombstones + 1 >= header_->capacity)) {
+        CompactTombstones();
+    }
+    
+    size_t insert_index = header_->capacity;
+    size_t probe_limit = ProbeLimit();
+    
+    for (size_t g = 0; g < num_groups; ++g) {
+        size_t base = ((start_group + g) & (num_groups - 1)) * GROUP_WIDTH;
+        CtrlGroup group(&ctrl_[base]);
+        
+        for (uint32_t mask = group.Match(tag); mask; mask &= mask - 1) {
+            size_t index = base + CountTrailingZeros(mask);
+            CacheSlot& slot = slots_[index];
+            LockSlot(slot);
+            
+            if (SlotHolds(index, tag, hash, key)) {
+                if (moving) {
+                    UnlockSlot(slot);
+                    UnlockSharedMutex(&header_->global_mutex);
+                    return true;
+                }
+                
+                const char* value = data;
+                size_t value_length = length;
+                uint64_t expiry = expires_at;
+                bool write = !update || ApplyUpdate(slot, update, now, &value, &value_length, &expiry);
+                if (!write || value_length > header_->max_value_size) {
+                    UnlockSlot(slot);
+                    UnlockSharedMutex(&header_->global_mutex);
+                    return !write;
+                }
+                
+                BeginSlotWrite(slot);
+                bool stored = WriteValue(slot, value, value_length, true);
+                for (int attempt = 0; !stored && evict != EVICTION_NONE && attempt < ARENA_EVICTION_LIMIT; ++attempt) {
+                    if (!EvictOne(index, SizeClassFor(value_length)) && !EvictOne(index, NUM_SIZE_CLASSES)) {
+                        break;
+                    }
+                    stored = WriteValue(slot, value, value_length, true);
+                }
+                if (stored) {
+                    slot.timestamp.store(now);
+                    slot.expires_at.store(expiry);
+                }
+                EndSlotWrite(slot);
+                
+                UnlockSlot(slot);
+                UnlockSharedMutex(&header_->global_mutex);
+                return stored;
+            }
+            
+            UnlockSlot(slot);
+        }
+        
+        // Remember the first reusable slot, but keep probing until a group
+        // with an EMPTY slot, or the probe limit, to make sure the key
+        // doesn't live further on
+        uint32_t free_mask = group.MatchFree();
+        if (free_mask && insert_index == header_->capacity) {
+            insert_index = base + CountTrailingZeros(free_mask);
+        }
+        if (group.MatchEmpty() || (insert_index != header_->capacity && g + 1 >= probe_limit)) {
+            break;
+        }
+    }
+    
+    // The key is missing, so an update sees no current value
+    if (update) {
+        update->applied = update->Apply(nullptr, 0, &data, &length);
+        if (!update->applied) {
+            UnlockSharedMutex(&header_->global_mutex);
+            return true;
+        }
+    }
+    
+    if (insert_index == header_->capacity || header_->num_entries.load() >= limit ||
+        length > header_->max_value_size) {
+        // Hash table is full
+        UnlockSharedMutex(&header_->global_mutex);
+        return false;
+    }
+    
+    if (header_->probing == PROBING_ROBIN_HOOD) {
+        insert_index = DisplaceForInsert(start_group, insert_index);
+    } else {
+        RaiseProbeLimit((insert_index / GROUP_WIDTH - start_group) & (num_groups - 1));
+    }
+    
+    // Only inserters fill free slots, so it is still free
+    CacheSlot& slot = slots_[insert_index];
+    LockSlot(slot);
+    BeginSlotWrite(slot);
+    
+    stored = WriteValue(slot, data, length, false);
+    for (int attempt = 0; !stored && evict != EVICTION_NONE && attempt < ARENA_EVICTION_LIMIT; ++attempt) {
+        if (!EvictOne(insert_index, SizeClassFor(length)) && !EvictOne(insert_index, NUM_SIZE_CLASSES)) {
+            break;
+        }
+        stored = WriteValue(slot, data, length, false);
+    }
+    
+    if (!stored) {
+        // Arena is full
+        EndSlotWrite(slot);
+        UnlockSlot(slot);
+        UnlockSharedMutex(&header_->global_mutex);
+        return false;
+    }
+    
+    if (ctrl_[insert_index].load() == CTRL_TOMBSTONE) {
+        header_->num_tombstones.fetch_sub(1);
+    }
+    
+    slot.hash = hash;
+    strncpy(slot.key, key.c_str(), MAX_KEY_SIZE - 1);
+    slot.key[MAX_KEY_SIZE - 1] = '\0';
+    
+    slot.timestamp.store(now);
+    slot.expires_at.store(expires_at);
+    ctrl_[insert_index].store(tag, std::memory_order_release);
+    
+    EndSlotWrite(slot);
+    header_->num_entries.fetch_add(1);
+    
+    UnlockSlot(slot);
+    UnlockSharedMutex(&header_->global_mutex);
+    
+    return true;
+}
+
+// Looks up `key`, copying its value to value_out when it fits in
+// `capacity` bytes. length_out receives the full value length either way.
+inline bool ShmTable::LoadValue(const std::string& key, uint64_t hash, char* value_out, size_t capacity,
+                                uint32_t* length_out) {
+    if (key.length() >= MAX_KEY_SIZE) {
+        return false;
+    }
+    
+    uint8_t tag = CtrlTag(hash);
+    bool found = false;
+    size_t groups = 0;
+    FindSlot(hash, true, &groups, [&](size_t index) {
+        SlotRead result = ReadSlot(index, tag, hash, key, value_out, capacity, length_out);
+        if (result == SLOT_HIT) {
+            if (value_out && !options_.read_only) {
+                TouchSlot(index);
+            }
+            found = true;
+            return true;
+        }
+        if (result == SLOT_EXPIRED) {
+            if (!options_.read_only) {
+                ReclaimExpired(index, tag, hash, key);
+            }
+            return true;
+        }
+        return false;
+    });
+    CountProbe(groups);
+    return found;
+}
+
+inline bool ShmTable::RemoveValue(const std::string& key, uint64_t hash) {
+    if (key.length() >= MAX_KEY_SIZE) {
+        return false;
+    }
+    
+    uint8_t tag = CtrlTag(hash);
+    size_t groups = 0;
+    return FindSlot(hash, true, &groups, [&](size_t index) {
+        CacheSlot& slot = slots_[index];
+        LockSlot(slot);
+        bool holds = SlotHolds(index, tag, hash, key);
+        if (holds) {
+            EraseSlot(index);
+        }
+        UnlockSlot(slot);
+        return holds;
+    });
+}
+
+// Turns a full slot into a tombstone and releases its value. Called with
+// slot.lock held; the tombstone keeps later entries in the chain
+// reachable.
+inline void ShmTable::EraseSlot(size_t index) {
+    CacheSlot& slot = slots_[index];
+    
+    BeginSlotWrite(slot);
+    ctrl_[index].store(CTRL_TOMBSTONE);
+    memset(slot.key, 0, MAX_KEY_SIZE);
+    ArenaFree(slot.value_offset, slot.value_length);
+    slot.value_offset = 0;
+    slot.value_length = 0;
+    slot.expires_at.store(0);
+    EndSlotWrite(slot);
+    
+    header_->num_entries.fetch_sub(1);
+    header_->num_tombstones.fetch_add(1);
+}
+
+// Erases an entry a reader found expired, unless it was replaced or
+// refreshed in the meantime.
+inline void ShmTable::ReclaimExpired(size_t index, uint8_t tag, uint64_t hash, const std::string& key) {
+    CacheSlot& slot = slots_[index];
+    LockSlot(slot);
+    
+    if (SlotHolds(index, tag, hash, key) && IsExpired(slot.expires_at.load(), NowNs())) {
+        EraseSlot(index);
+    }
+    
+    UnlockSlot(slot);
+}
+
+// Erases expired entries in the next `groups` groups. The cursor is shared,
+// so reapers in several processes split the table between them. Returns
+// the number of entries reclaimed.
+inline size_t ShmTable::ReapExpired(size_t groups) {
+    size_t num_groups = NumGroups();
+    size_t reclaimed = 0;
+    uint64_t now = NowNs();
+    
+    for (size_t g = 0; g < groups && g < num_groups; ++g) {
+        size_t base = (header_->reap_cursor.fetch_add(1) & (num_groups - 1)) * GROUP_WIDTH;
+        
+        for (uint32_t mask = CtrlGroup(&ctrl_[base]).MatchFull(); mask; mask &= mask - 1) {
+            size_t index = base + CountTrailingZeros(mask);
+            CacheSlot& slot = slots_[index];
+            if (!IsExpired(slot.expires_at.load(std::memory_order_relaxed), now)) {
+                continue;
+            }
+            
+            LockSlot(slot);
+            if (IsFull(ctrl_[index].load()) && IsExpired(slot.expires_at.load(), now)) {
+                EraseSlot(index);
+                ++reclaimed;
+            }
+            UnlockSlot(slot);
+        }
+    }
+    
+    return reclaimed;
+}
+
+// Moves one live entry into `to`, the table replacing this one, unless
+// `to` already has the key: anything there was written after the resize
+// started and is newer. The slot lock is held throughout, so a reader
+// checking this table before `to` finds the entry in one or the other.
+// Each entry gives back the slot `to` reserved for it. Returns false,
+// leaving the entry here, if `to` has no room for it: its arena is packed
+// in slot order rather than the order values were written, so it can
+// fragment where this one didn't.
+inline bool ShmTable::MoveSlot(size_t index, ShmTable& to) {
+    CacheSlot& slot = slots_[index];
+    LockSlot(slot);
+    
+    bool moved = true;
+    if (IsFull(ctrl_[index].load())) {
+        uint64_t expires_at = slot.expires_at.load();
+        if (!IsExpired(expires_at, NowNs())) {
+            moved = to.StoreValue(std::string(slot.key), slot.hash, ValuePtr(slot), slot.value_length,
+                                  expires_at, true, nullptr);
+        }
+        if (moved) {
+            EraseSlot(index);
+            to.header_->reserved.fetch_sub(1);
+        }
+    }
+    
+    UnlockSlot(slot);
+    return moved;
+}
+
+// Moves one key on ahead of the migration, for updates that need its
+// value in the new table. Nothing is inserted into a retired table, so
+// once found the slot holds the key until it is moved or erased, and
+// MoveSlot copes with either. False if the key is here and stays here.
+inline bool ShmTable::MoveKey(const std::string& key, uint64_t hash, ShmTable& to) {
+    if (key.length() >= MAX_KEY_SIZE) {
+        return true;
+    }
+    
+    uint8_t tag = CtrlTag(hash);
+    size_t groups = 0;
+    bool moved = true;
+    FindSlot(hash, false, &groups, [&](size_t index) {
+        CacheSlot& slot = slots_[index];
+        LockSlot(slot);
+        bool holds = SlotHolds(index, tag, hash, key);
+        UnlockSlot(slot);
+        
+        if (holds) {
+            moved = MoveSlot(index, to);
+        }
+        return holds;
+    });
+    return moved;
+}
+
+// Runs update against a slot holding the key, under its lock. Returns
+// false if it leaves the entry alone; otherwise data, length and
+// expires_at are what to write.
+inline bool ShmTable::ApplyUpdate(CacheSlot& slot, ValueUpdate* update, uint64_t now, const char** data, size_t* length,
+                                  uint64_t* expires_at) {
+    uint64_t current_expiry = slot.expires_at.load();
+    bool live = !IsExpired(current_expiry, now);
+    update->applied = update->Apply(live ? ValuePtr(slot) : nullptr, live ? slot.value_length : 0, data, length);
+    if (!update->applied) {
+        return false;
+    }
+    if (live && update->keep_expiry) {
+        *expires_at = current_expiry;
+    }
+    return true;
+}
+
+inline void ShmTable::Clear() {
+    LockSharedMutex(header_, &header_->global_mutex);
+    
+    for (size_t i = 0; i < header_->capacity; ++i) {
+        if (ctrl_[i].load() == CTRL_EMPTY) {
+            continue;
+        }
+        
+        CacheSlot& slot = slots_[i];
+        LockSlot(slot);
+        
+        BeginSlotWrite(slot);
+        ctrl_[i].store(CTRL_EMPTY);
+        memset(slot.key, 0, MAX_KEY_SIZE);
+        ArenaFree(slot.value_offset, slot.value_length);
+        slot.value_offset = 0;
+        slot.value_length = 0;
+        slot.expires_at.store(0);
+        EndSlotWrite(slot);
+        
+        UnlockSlot(slot);
+    }
+    
+    header_->num_entries.store(0);
+    header_->num_tombstones.store(0);
+    header_->max_probe.store(0);
+    UnlockSharedMutex(&header_->global_mutex);
+}
+
+// Records a read for the eviction policy. Done without the slot lock: if
+// the slot was replaced meanwhile, the newcomer just looks recently used.
+inline void ShmTable::TouchSlot(size_t index) {
+    std::atomic<uint64_t>& timestamp = slots_[index].timestamp;
+    
+    if (header_->eviction_policy == EVICTION_CLOCK) {
+        if (!(timestamp.load(std::memory_order_relaxed) & TIMESTAMP_REFERENCED)) {
+            timestamp.fetch_or(TIMESTAMP_REFERENCED, std::memory_order_relaxed);
+        }
+    } else if (header_->eviction_policy == EVICTION_LRU) {
+        uint64_t now = NowNs();
+        if (now - timestamp.load(std::memory_order_relaxed) > LRU_TOUCH_INTERVAL_NS) {
+            timestamp.store(now, std::memory_order_relaxed);
+        }
+    }
+}
+
+// Evicts one entry according to the eviction policy, never `skip_index`.
+// With a size_class other than NUM_SIZE_CLASSES only entries whose chunk
+// is at least that large qualify, as freeing those is certain to make
+// room. Called with the global mutex held, which also guards the clock
+// hand. Returns false if no entry qualified after two passes over the
+// table.
+inline bool ShmTable::EvictOne(size_t skip_index, size_t size_class) {
+    size_t capacity = header_->capacity;
+    size_t victim = capacity;
+    uint64_t oldest = UINT64_MAX;
+    size_t sampled = 0;
+    uint64_t now = NowNs();
+    
+    for (size_t step = 0; step < 2 * capacity; ++step) {
+        size_t index = header_->clock_hand.fetch_add(1) % capacity;
+        
+        if (index == skip_index || !IsFull(ctrl_[index].load())) {
+            continue;
+        }
+        if (size_class != NUM_SIZE_CLASSES &&
+            (slots_[index].value_offset == 0 || SizeClassFor(slots_[index].value_length) < size_class)) {
+            continue;
+        }
+        
+        // Expired entries go first whatever the policy
+        if (IsExpired(slots_[index].expires_at.load(std::memory_order_relaxed), now)) {
+            victim = index;
+            break;
+        }
+        
+        uint64_t timestamp = slots_[index].timestamp.load(std::memory_order_relaxed);
+        
+        if (header_->eviction_policy == EVICTION_CLOCK) {
+            // Second chance: clear the reference bit and move on
+            if (timestamp & TIMESTAMP_REFERENCED) {
+                slots_[index].timestamp.fetch_and(~TIMESTAMP_REFERENCED, std::memory_order_relaxed);
+                continue;
+            }
+            victim = index;
+            break;
+        }
+        
+        if (timestamp < oldest) {
+            oldest = timestamp;
+            victim = index;
+        }
+        if (++sampled == LRU_SAMPLE_SIZE) {
+            break;
+        }
+    }
+    
+    if (victim == capacity) {
+        return false;
+    }
+    
+    // Other writers may have removed it meanwhile, but only inserters,
+    // which hold the global mutex, can fill the slot again
+    CacheSlot& slot = slots_[victim];
+    LockSlot(slot);
+    bool evicted = IsFull(ctrl_[victim].load());
+    if (evicted) {
+        EraseSlot(victim);
+        options_.stats->evictions.Add(1);
+    }
+    UnlockSlot(slot);
+    
+    return evicted;
+}
+
+// The first stage of a batch prefetch (see PipelineLookups): the key's
+// home control group
+inline void ShmTable::PrefetchGroup(uint64_t hash) const {
+    Prefetch(&ctrl_[(hash & (NumGroups() - 1)) * GROUP_WIDTH]);
+}
+
+// The second stage, once PrefetchGroup's line has had time to arrive:
+// prefetches the home group's slots whose fingerprint matches, or the next
+// group's control bytes if the chain runs on past a full group
+inline void ShmTable::PrefetchSlots(uint64_t hash) const {
+    size_t num_groups = NumGroups();
+    size_t base = (hash & (num_groups - 1)) * GROUP_WIDTH;
+    CtrlGroup group(&ctrl_[base]);
+    
+    uint32_t mask = group.Match(CtrlTag(hash));
+    PrefetchSlotMask(base, mask);
+    if (!mask && !group.MatchEmpty()) {
+        Prefetch(&ctrl_[(base + GROUP_WIDTH) & (header_->capacity - 1)]);
+    }
+}
+
+// The third stage: the arena value of the home group's slot holding
+// hash, read racily as the prefetch can't fault
+inline void ShmTable::PrefetchValue(uint64_t hash) const {
+    if (header_->value_type != VALUE_STRING) {
+        return;
+    }
+    size_t base = (hash & (NumGroups() - 1)) * GROUP_WIDTH;
+    for (uint32_t mask = CtrlGroup(&ctrl_[base]).Match(CtrlTag(hash)); mask; mask &= mask - 1) {
+        const CacheSlot& slot = slots_[base + CountTrailingZeros(mask)];
+        if (slot.hash == hash && static_cast<size_t>(slot.value_offset) * ARENA_ALIGN < header_->arena_size) {
+            Prefetch(ArenaPtr(slot.value_offset));
+            return;
+        }
+    }
+}
+
+// Every cache line of each slot in mask: the key straddles the first two
+inline void ShmTable::PrefetchSlotMask(size_t base, uint32_t mask) const {
+    for (; mask; mask &= mask - 1) {
+        const char* slot = reinterpret_cast<const char*>(&slots_[base + CountTrailingZeros(mask)]);
+        for (size_t line = 0; line < sizeof(CacheSlot); line += CACHE_LINE_SIZE) {
+            Prefetch(slot + line);
+        }
+    }
+}
+
+// One shard of a cache: the generations of table behind one segment name,
+// and the routing between them while a resize migrates entries. Shards
+// share nothing, so each has its own locks, counters and eviction state.
+class Shard {
+public:
+    Shard(const std::string& shm_name, const HandleOptions& options, std::mutex& tables_mutex);
+    
+    bool Create(const TableConfig& config);
+    bool Attach();
+    void Unlink();
+    bool Grow(size_t max_keys, bool* grew);
+    
+    // The first table's header; num_shards and max_value_size never change
+    SharedMemoryHeader* base_header() const { return tables_[0]->header(); }
+    ChangeLog* change_log() const { return tables_[0]->change_log(); }
+    bool is_creator() const { return tables_[0]->is_creator(); }
+    
+    bool StoreValue(const std::string& key, uint64_t hash, const char* data, size_t length, uint64_t expires_at,
+                    ValueUpdate* update);
+    bool LoadValue(const std::string& key, uint64_t hash, char* value_out, size_t capacity, uint32_t* length_out);
+    bool RemoveValue(const std::string& key, uint64_t hash);
+    size_t ReapExpired(size_t groups);
+    void Clear();
+    size_t Size();
+    size_t MaxKeys();
+    bool Flush();
+    void Prefault();
+    void LockStats(uint64_t* timeouts, uint64_t* recovered);
+    void Occupancy(size_t* slots, size_t* tombstones);
+    void PrefetchGroup(uint64_t hash) const { table_->PrefetchGroup(hash); }
+    void PrefetchSlots(uint64_t hash) const { table_->PrefetchSlots(hash); }
+    void PrefetchValue(uint64_t hash) const { table_->PrefetchValue(hash); }
+    void SyncTables();
+    bool LogChange(const char* key, uint32_t key_length);
+    
+    // Calls fn(key, value, length, expires_at) for each live entry.
+    // Mid-migration an entry can briefly be in both tables, so keys are
+    // deduplicated then.
+    template <typename Fn>
+    void ForEachEntry(Fn fn) {
+        SyncTables();
+        ForEachMappedEntry(fn);
+    }
+    
+    // ForEachEntry and Clear without catching up on resizes first, for
+    // threads that hold tables_mutex_ and so must leave the table pointers
+    // alone. The JS thread calls SyncTables before handing off.
+    void ClearMapped();
+    template <typename Fn>
+    void ForEachMappedEntry(Fn fn) {
+        std::unordered_set<std::string> seen;
+        for (ShmTable* table : {table_, old_table_}) {
+            if (!table) {
+                continue;
+            }
+            table->ForEachEntry([&](const char* key, const char* value, uint32_t length, uint64_t expires_at) {
+                if (old_table_ && !seen.insert(key).second) {
+                    return;
+                }
+                fn(key, value, length, expires_at);
+            });
+        }
+    }
+    
+    // Resumes a scan at `position`, which counts through the old table
+    // first while a migration runs, so entries it moves are met again in
+    // the new one. `tag` identifies the tables the position refers to; if
+    // they have changed, the shard starts over, repeating entries rather
+    // than missing any. Returns the next position, or 0 once the shard is
+    // done, and the current tag.
+    template <typename Fn>
+    size_t Scan(size_t position, uint32_t* tag, const std::string& prefix, size_t* entries_left,
+                size_t* groups_left, Fn fn) {
+        SyncTables();
+        
+        uint32_t current = (table_->header()->generation * 2 + (old_table_ ? 1 : 0)) & ((1u << SCAN_TAG_BITS) - 1);
+        if (*tag != current) {
+            position = 0;
+            *tag = current;
+        }
+        
+        size_t old_capacity = old_table_ ? old_table_->header()->capacity : 0;
+        if (position < old_capacity) {
+            position = old_table_->ScanEntries(position, prefix, entries_left, groups_left, fn);
+            if (position < old_capacity) {
+                return position;
+            }
+        }
+        position = old_capacity + table_->ScanEntries(position - old_capacity, prefix, entries_left, groups_left, fn);
+        if (position < old_capacity + table_->header()->capacity) {
+            return position;
+        }
+        
+        // A resize that began meanwhile may have moved entries past the
+        // end; any position under the old tag makes the next call start over
+        return table_->Retired() ? 1 : 0;
+    }
+
+private:
+    std::string shm_name_;
+    HandleOptions options_;
+    // Held while table pointers change, as the reaper thread uses them
+    std::mutex& tables_mutex_;
+    
+    // tables_[0] is the named segment, which stays mapped since attachers
+    // find the newest generation through it. table_ is the newest table
+    // and old_table_ the one it is still migrating from, if any.
+    std::vector<std::unique_ptr<ShmTable>> tables_;
+    ShmTable* table_;
+    ShmTable* old_table_;
+    
+    std::string GenerationName(uint32_t generation) const;
+    ShmTable* FindTable(uint32_t generation) const;
+    void RefreshTables();
+    bool MigrateEntries();
+};
+
+inline Shard::Shard(const std::string& shm_name, const HandleOptions& options, std::mutex& tables_mutex)
+    : shm_name_(shm_name), options_(options), tables_mutex_(tables_mutex), table_(nullptr), old_table_(nullptr) {
+}
+
+// Fails with errno EEXIST if the segment already exists
+inline bool Shard::Create(const TableConfig& config) {
+    std::unique_ptr<ShmTable> table(new ShmTable(options_));
+    if (!table->Create(shm_name_, config, 0)) {
+        return false;
+    }
+    
+    tables_.push_back(std::move(table));
+    table_ = tables_[0].get();
+    return true;
+}
+
+inline bool Shard::Attach() {
+    std::unique_ptr<ShmTable> table(new ShmTable(options_));
+    if (!table->Attach(shm_name_)) {
+        return false;
+    }
+    tables_.push_back(std::move(table));
+    table_ = tables_[0].get();
+    
+    // Go straight to the newest generation rather than through every resize
+    uint32_t latest = table_->header()->latest_generation.load();
+    if (latest != 0) {
+        table.reset(new ShmTable(options_));
+        if (table->Attach(GenerationName(latest))) {
+            tables_.push_back(std::move(table));
+            table_ = tables_.back().get();
+        }
+    }
+    
+    RefreshTables();
+    return true;
+}
+
+// Removes every generation's name; mappings stay valid until unmapped
+inline void Shard::Unlink() {
+    uint32_t latest = tables_.empty() ? 0 : base_header()->latest_generation.load();
+    for (uint32_t generation = 0; generation <= latest; ++generation) {
+        ShmTable::Unlink(GenerationName(generation), options_.file_backed);
+    }
+}
+
+// Generation 0 is the named segment itself; each resize creates the next
+inline std::string Shard::GenerationName(uint32_t generation) const {
+    if (generation == 0) {
+        return shm_name_;
+    }
+    return shm_name_ + ".g" + std::to_string(generation);
+}
+
+inline ShmTable* Shard::FindTable(uint32_t generation) const {
+    for (const std::unique_ptr<ShmTable>& table : tables_) {
+        if (table->header()->generation == generation) {
+            return table.get();
+        }
+    }
+    return nullptr;
+}
+
+// Cheap enough to run before every operation: one load of a header field
+// this handle reads anyway, plus one more while a migration is running.
+inline void Shard::SyncTables() {
+    if (table_->Retired() || (old_table_ && table_->header()->migrating.load(std::memory_order_acquire) == 0)) {
+        RefreshTables();
+    }
+}
+
+// Catches up with resizes started by any process: moves on to successor
+// tables, keeps the one still being migrated from, and unmaps the rest.
+// The reaper thread uses the same pointers, so this holds its mutex.
+inline void Shard::RefreshTables() {
+    std::lock_guard<std::mutex> lock(tables_mutex_);
+    
+    for (uint32_t next = table_->header()->successor.load(); next != 0; next = table_->header()->successor.load()) {
+        ShmTable* found = FindTable(next);
+        if (!found) {
+            // A drained generation is unlinked, so fall back to the newest
+            std::unique_ptr<ShmTable> table(new ShmTable(options_));
+            if (!table->Attach(GenerationName(next))) {
+                next = tables_[0]->header()->latest_generation.load();
+                table.reset(new ShmTable(options_));
+                if (next <= table_->header()->generation || !table->Attach(GenerationName(next))) {
+                    break;
+                }
+            }
+            found = table.get();
+            tables_.push_back(std::move(table));
+        }
+        table_ = found;
+    }
+    
+    uint32_t generation = table_->header()->generation;
+    old_table_ = nullptr;
+    if (generation != 0 && table_->header()->migrating.load(std::memory_order_acquire) != 0) {
+        old_table_ = FindTable(generation - 1);
+        if (!old_table_) {
+            std::unique_ptr<ShmTable> table(new ShmTable(options_));
+            // Failing means it was drained and unlinked meanwhile
+            if (table->Attach(GenerationName(generation - 1))) {
+                old_table_ = table.get();
+                tables_.push_back(std::move(table));
+            }
+        }
+    }
+    
+    for (size_t i = tables_.size(); i-- > 1;) {
+        if (tables_[i].get() != table_ && tables_[i].get() != old_table_) {
+            tables_.erase(tables_.begin() + i);
+        }
+    }
+}
+
+// While a resize runs, entries leave old_table_ one slot at a time, each
+// copied to table_ before it is erased. Writes therefore go to table_ and
+// then drop any copy not yet moved, which would otherwise shadow them.
+// An operation that raced with the start of a resize sees the table
+// retired and goes round again.
+// An update needs the current value in the table it runs on, so mid-
+// migration the key is moved over first
+inline bool Shard::StoreValue(const std::string& key, uint64_t hash, const char* data, size_t length,
+                              uint64_t expires_at, ValueUpdate* update) {
+    for (;;) {
+        SyncTables();
+        ShmTable* table = table_;
+        
+        // An update applied to the new table without the current value
+        // would start over from nothing
+        if (update && old_table_ && !old_table_->MoveKey(key, hash, *table)) {
+            return false;
+        }
+        if (table->StoreValue(key, hash, data, length, expires_at, false, update)) {
+            if (old_table_) {
+                old_table_->RemoveValue(key, hash);
+            }
+            return true;
+        }
+        if (!table->Retired()) {
+            return false;
+        }
+    }
+}
+
+// The old table is checked first: an entry missing there has either
+// never existed or already been copied on.
+inline bool Shard::LoadValue(const std::string& key, uint64_t hash, char* value_out, size_t capacity,
+                             uint32_t* length_out) {
+    for (;;) {
+        SyncTables();
+        ShmTable* table = table_;
+        
+        if (old_table_ && old_table_->LoadValue(key, hash, value_out, capacity, length_out)) {
+            return true;
+        }
+        if (table->LoadValue(key, hash, value_out, capacity, length_out)) {
+            return true;
+        }
+        if (!table->Retired()) {
+            return false;
+        }
+    }
+}
+
+// The old table goes first so the migration can't move the entry back
+inline bool Shard::RemoveValue(const std::string& key, uint64_t hash) {
+    for (;;) {
+        SyncTables();
+        ShmTable* table = table_;
+        
+        bool removed = old_table_ && old_table_->RemoveValue(key, hash);
+        if (table->RemoveValue(key, hash) || removed) {
+            return true;
+        }
+        if (!table->Retired()) {
+            return false;
+        }
+    }
+}
+
+// Called by the reaper thread with tables_mutex_ held
+inline size_t Shard::ReapExpired(size_t groups) {
+    size_t reclaimed = table_->ReapExpired(groups);
+    if (old_table_) {
+        reclaimed += old_table_->ReapExpired(groups);
+    }
+    return reclaimed;
+}
+
+// Moves whatever is left in old_table_ into table_, then drops it. Several
+// handles may run this at once; each slot is moved under its own lock and
+// the first to finish releases the drained table. Returns false, with
+// errno ENOSPC, if some entries didn't fit: they stay readable in
+// old_table_, which is kept, and the next call tries them again.
+inline bool Shard::MigrateEntries() {
+    ShmTable* from = old_table_;
+    size_t capacity = from->header()->capacity;
+    
+    size_t stranded = 0;
+    for (size_t index = 0; index < capacity; ++index) {
+        if (!from->MoveSlot(index, *table_)) {
+            ++stranded;
+        }
+    }
+    if (stranded > 0) {
+        errno = ENOSPC;
+        return false;
+    }
+    
+    uint32_t expected = 1;
+    if (table_->header()->migrating.compare_exchange_strong(expected, 0)) {
+        table_->header()->reserved.store(0);
+        from->ReleaseArena();
+        if (from->header()->generation != 0) {
+            ShmTable::Unlink(GenerationName(from->header()->generation), options_.file_backed);
+        }
+    }
+    
+    RefreshTables();
+    return true;
+}
+
+// Grows the shard to max_keys entries by creating its next generation
+// and moving entries over one slot at a time. Every handle, in this
+// process or another, keeps reading and writing throughout and follows
+// on its next call. Resumes a migration some other handle left
+// unfinished. *grew is left false if the shard is already that large.
+// Returns false if the new segment couldn't be created, or if entries
+// still waiting to move don't fit it (see MigrateEntries); another
+// generation can't start until they do.
+inline bool Shard::Grow(size_t max_keys, bool* grew) {
+    *grew = false;
+    
+    SyncTables();
+    if (old_table_ && !MigrateEntries()) {
+        return false;
+    }
+    
+    SharedMemoryHeader* header = table_->header();
+    if (max_keys <= header->max_keys) {
+        return true;
+    }
+    
+    // Keep the arena's share per key
+    TableConfig config = table_->Config();
+    config.max_keys = max_keys;
+    config.arena_size = header->arena_size / (header->max_keys + 1) * (max_keys + 1);
+    config.arena_size = std::min(AlignUp(config.arena_size, CACHE_LINE_SIZE), MAX_ARENA_SIZE);
+    uint32_t generation = header->generation + 1;
+    std::string name = GenerationName(generation);
+    std::unique_ptr<ShmTable> table(new ShmTable(options_));
+    
+    // Setting the successor under the global mutex stops inserts into
+    // this table, so no new key can slip past the migration
+    LockSharedMutex(header, &header->global_mutex);
+    
+    if (table_->Retired()) {
+        // Another handle got there first; help it finish
+        UnlockSharedMutex(&header->global_mutex);
+        SyncTables();
+        if (old_table_ && !MigrateEntries()) {
+            return false;
+        }
+        *grew = table_->header()->max_keys >= max_keys;
+        return true;
+    }
+    
+    // Left behind if a cache of this name crashed mid-resize
+    ShmTable::Unlink(name, options_.file_backed);
+    
+    if (!table->Create(name, config, generation)) {
+        UnlockSharedMutex(&header->global_mutex);
+        return false;
+    }
+    
+    // Writers could otherwise fill the new table before the entries
+    // waiting to move in; no more can arrive here past this point
+    table->header()->reserved.store(header->num_entries.load());
+    tables_[0]->header()->latest_generation.store(generation);
+    header->successor.store(generation, std::memory_order_release);
+    UnlockSharedMutex(&header->global_mutex);
+    
+    {
+        std::lock_guard<std::mutex> lock(tables_mutex_);
+        tables_.push_back(std::move(table));
+    }
+    RefreshTables();
+    *grew = true;
+    return MigrateEntries();
+}
+
+inline void Shard::Clear() {
+    SyncTables();
+    ClearMapped();
+}
+
+inline void Shard::ClearMapped() {
+    // Old table first, so nothing is migrated into the new one afterwards
+    if (old_table_) {
+        old_table_->Clear();
+    }
+    table_->Clear();
+}
+
+// Appends a written key, or CHANGE_ALL, to the change log. Returns false
+// without logging if nobody watches, which costs writers one load.
+inline bool Shard::LogChange(const char* key, uint32_t key_length) {
+    ChangeLog* log = change_log();
+    if (log->watchers.load() == 0) {
+        return false;
+    }
+    
+    uint64_t seq = log->change_seq.fetch_add(1);
+    ChangeRecord& record = log->changes[seq & (CHANGE_LOG_SIZE - 1)];
+    record.stamp.store(2 * seq + 1);
+    std::atomic_thread_fence(std::memory_order_release);
+    record.key_length = key_length;
+    if (key_length != CHANGE_ALL) {
+        memcpy(record.key, key, key_length);
+    }
+    record.stamp.store(2 * seq + 2, std::memory_order_release);
+    return true;
+}
+
+inline size_t Shard::Size() {
+    SyncTables();
+    
+    size_t size = table_->header()->num_entries.load();
+    if (old_table_) {
+        size += old_table_->header()->num_entries.load();
+    }
+    return size;
+}
+
+inline size_t Shard::MaxKeys() {
+    SyncTables();
+    return table_->header()->max_keys;
+}
+
+inline bool Shard::Flush() {
+    SyncTables();
+    
+    bool flushed = true;
+    for (const std::unique_ptr<ShmTable>& table : tables_) {
+        flushed = table->Flush() && flushed;
+    }
+    return flushed;
+}
+
+// Adds up the lock counters of every mapped table
+inline void Shard::LockStats(uint64_t* timeouts, uint64_t* recovered) {
+    SyncTables();
+    
+    for (const std::unique_ptr<ShmTable>& table : tables_) {
+        *timeouts += table->header()->lock_timeouts.load();
+        *recovered += table->header()->locks_recovered.load();
+    }
+}
+
+// Adds up the slots and tombstones of the tables in use
+inline void Shard::Occupancy(size_t* slots, size_t* tombstones) {
+    SyncTables();
+    
+    for (ShmTable* table : {table_, old_table_}) {
+        if (table) {
+            *slots += table->header()->capacity;
+            *tombstones += table->header()->num_tombstones.load();
+        }
+    }
+}
+
+// Faults in every mapped table, and any mapped later, from now on. Called
+// off the JS thread with tables_mutex_ held.
+inline void Shard::Prefault() {
+    options_.prefault = true;
+    for (const std::unique_ptr<ShmTable>& table : tables_) {
+        table->Populate();
+    }
+}
+
+// The key hash every process using a cache agrees on
+inline uint64_t HashKey(const std::string& key) {
+    return WyHash(key.data(), key.size());
+}
+
+// Bits 32-47 of the hash pick the shard; tables use the low bits and the
+// top seven, so keys spread evenly within each shard too
+inline size_t ShardIndex(uint64_t hash, size_t num_shards) {
+    return (((hash >> 32) & 0xffff) * num_shards) >> 16;
+}
+
+// Calls resolve(i) for each of count hashed keys in order, prefetching
+// ahead as BATCH_PREFETCH_DISTANCE describes. table_for(hash) names the
+// Shard or ShmTable a key lives in.
+template <typename TableFor, typename Resolve>
+inline void PipelineLookups(const uint64_t* hashes, size_t count, TableFor table_for, Resolve resolve) {
+    const size_t distance = BATCH_PREFETCH_DISTANCE;
+    
+    for (size_t i = 0; i < std::min(count, 3 * distance); ++i) {
+        table_for(hashes[i])->PrefetchGroup(hashes[i]);
+    }
+    for (size_t i = 0; i < std::min(count, 2 * distance); ++i) {
+        table_for(hashes[i])->PrefetchSlots(hashes[i]);
+    }
+    for (size_t i = 0; i < std::min(count, distance); ++i) {
+        table_for(hashes[i])->PrefetchValue(hashes[i]);
+    }
+    
+    for (size_t i = 0; i < count; ++i) {
+        if (i + 3 * distance < count) {
+            table_for(hashes[i + 3 * distance])->PrefetchGroup(hashes[i + 3 * distance]);
+        }
+        if (i + 2 * distance < count) {
+            table_for(hashes[i + 2 * distance])->PrefetchSlots(hashes[i + 2 * distance]);
+        }
+        if (i + distance < count) {
+            table_for(hashes[i + distance])->PrefetchValue(hashes[i + distance]);
+        }
+        resolve(i);
+    }
+}
+
+// Shard 0 is the named segment and records the shard count, so its
+// creator creates the rest while attachers wait for them to appear
+inline bool OpenShards(const std::string& shm_name, size_t num_shards, const TableConfig& config, bool numa,
+                       const HandleOptions& options, std::mutex& tables_mutex,
+                       std::vector<std::unique_ptr<Shard>>* shards) {
+    std::vector<int> nodes;
+    if (numa) {
+        nodes = OnlineNumaNodes();
+    }
+    
+    TableConfig shard_config = config;
+    if (nodes.size() > 1) {
+        shard_config.numa_node = nodes[0];
+    }
+    
+    // A read-only handle can only attach
+    std::unique_ptr<Shard> first(new Shard(shm_name, options, tables_mutex));
+    bool created = !options.read_only && first->Create(shard_config);
+    if (!created && ((!options.read_only && errno != EEXIST) || !first->Attach())) {
+        return false;
+    }
+    num_shards = first->base_header()->num_shards;
+    shards->push_back(std::move(first));
+    
+    for (size_t i = 1; i < num_shards; ++i) {
+        std::unique_ptr<Shard> shard(new Shard(shm_name + ".s" + std::to_string(i), options, tables_mutex));
+        
+        if (created) {
+            if (nodes.size() > 1) {
+                shard_config.numa_node = nodes[i % nodes.size()];
+            }
+            // Left behind by an earlier cache of this name
+            shard->Unlink();
+            if (!shard->Create(shard_config)) {
+                // Don't leave a cache behind that nobody can attach to
+                int error = errno;
+                for (const std::unique_ptr<Shard>& created_shard : *shards) {
+                    created_shard->Unlink();
+                }
+                shards->clear();
+                errno = error;
+                return false;
+            }
+        } else {
+            for (int waited = 0; !shard->Attach(); ++waited) {
+                if (waited >= ATTACH_TIMEOUT_MS) {
+                    return false;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        
+        shards->push_back(std::move(shard));
+    }
+    
+    return true;
+}
+
+// Queue segment header. The two ends live on their own cache lines, so
+// producers and consumers only meet on the cells themselves.
+// Who waits at one end of a queue. asleep is the futex word, 1 while
+// someone may be waiting; waiting counts them exactly, so a wake-up on
+// Windows releases no more semaphore tokens than there are sleepers.
+struct QueueSleepers {
+    std::atomic<uint32_t> asleep;
+    std::atomic<uint32_t> waiting;
+};
+
+struct QueueHeader {
+    std::atomic<uint32_t> magic;
+    uint32_t layout_version;
+    size_t capacity;                    // cells, a power of two
+    size_t cell_size;
+    size_t max_message_size;
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> tail;    // next position to push
+    alignas(CACHE_LINE_SIZE) std::atomic<uint64_t> head;    // next position to pop
+    alignas(CACHE_LINE_SIZE) QueueSleepers consumers;
+    alignas(CACHE_LINE_SIZE) QueueSleepers producers;
+};
+
+// A bounded MPMC queue (Vyukov's): a push or pop claims a position with a
+// compare-and-swap on tail or head, then hands the cell over through its
+// sequence number, so neither end takes a lock. The number is stored
+// relative to the cell's index, so a zero-filled segment is already an
+// empty queue: it is lap * capacity while the cell is free for the push
+// at that lap, and that plus one once the message is in.
+struct QueueCell {
+    std::atomic<uint64_t> sequence;
+    uint32_t length;
+};
+
+class ShmQueue {
+public:
+    ShmQueue() : shm_ptr_(nullptr), shm_size_(0), shm_fd_(-1), is_creator_(false), header_(nullptr), cells_(nullptr) {
+#ifdef _WIN32
+        shm_mapping_ = NULL;
+        shm_file_ = INVALID_HANDLE_VALUE;
+#endif
+    }
+    ~ShmQueue();
+    
+    bool Create(const std::string& shm_name, size_t capacity, size_t max_message_size);
+    bool Attach(const std::string& shm_name);
+    void Unlink() { ShmTable::Unlink(shm_name_, false); }
+    
+    QueueHeader* header() const { return header_; }
+    bool is_creator() const { return is_creator_; }
+    
+    // Waits up to timeout_ms for room (0 = not at all, WAIT_FOREVER = no
+    // limit). False if the queue stayed full.
+    bool Push(const char* data, size_t length, uint32_t timeout_ms);
+    
+    // Waits up to timeout_ms for a message, then calls fn(data, length)
+    // while the cell is still held. False if there was none.
+    template <typename Fn>
+    bool Pop(uint32_t timeout_ms, Fn fn) {
+        if (TryPop(fn)) {
+            return true;
+        }
+        return timeout_ms != 0 && WaitFor(&header_->consumers, consumers_wake_, timeout_ms, [&]() {
+            return TryPop(fn);
+        });
+    }
+    
+    // Pop for the first message, then up to max - 1 more that are already
+    // there. Returns how many fn was called for.
+    template <typename Fn>
+    uint32_t PopBatch(uint32_t max, uint32_t timeout_ms, Fn fn) {
+        if (max == 0 || !Pop(timeout_ms, fn)) {
+            return 0;
+        }
+        uint32_t count = 1;
+        while (count < max && TryTake(fn)) {
+            count++;
+        }
+        if (count > 1) {
+            Notify(&header_->producers, producers_wake_);
+        }
+        return count;
+    }
+    
+    size_t Size() const {
+        uint64_t head = header_->head.load();
+        uint64_t tail = header_->tail.load();
+        return tail > head ? static_cast<size_t>(tail - head) : 0;
+    }
+
+private:
+    void* shm_ptr_;
+    size_t shm_size_;
+    int shm_fd_;
+#ifdef _WIN32
+    HANDLE shm_mapping_;
+    HANDLE shm_file_;                   // never opened; MapSegment wants one
+#endif
+    bool is_creator_;
+    std::string shm_name_;
+    QueueHeader* header_;
+    char* cells_;
+    SharedWake consumers_wake_;
+    SharedWake producers_wake_;
+    
+    QueueCell* Cell(uint64_t position) const {
+        return reinterpret_cast<QueueCell*>(cells_ + (position & (header_->capacity - 1)) * header_->cell_size);
+    }
+    uint64_t Lap(uint64_t position) const { return position & ~static_cast<uint64_t>(header_->capacity - 1); }
+    
+    bool TryPush(const char* data, size_t length);
+    
+    template <typename Fn>
+    bool TryPop(Fn fn) {
+        if (!TryTake(fn)) {
+            return false;
+        }
+        Notify(&header_->producers, producers_wake_);
+        return true;
+    }
+    
+    // TryPop without waking producers, for batches that wake them once
+    template <typename Fn>
+    bool TryTake(Fn fn) {
+        uint64_t position = header_->head.load(std::memory_order_relaxed);
+        for (;;) {
+            QueueCell* cell = Cell(position);
+            int64_t ready = static_cast<int64_t>(cell->sequence.load(std::memory_order_acquire) - (Lap(position) + 1));
+            if (ready < 0) {
+                return false;           // not pushed yet: empty
+            }
+            if (ready == 0 && header_->head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                fn(reinterpret_cast<const char*>(cell + 1), cell->length);
+                cell->sequence.store(Lap(position) + header_->capacity, std::memory_order_release);
+                return true;
+            }
+            if (ready > 0) {
+                position = header_->head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    
+    // Sleeps until attempt() succeeds or timeout_ms passes. The flag is
+    // raised before the last attempt, so the other end either sees it or
+    // we see what it did. Only the first push or pop after it goes up pays
+    // for a wakeup; it wakes every waiter, and those that lose the race
+    // raise it again.
+    template <typename Fn>
+    bool WaitFor(QueueSleepers* sleepers, SharedWake& wake, uint32_t timeout_ms, Fn attempt) {
+        for (int spins = 0; spins < QUEUE_SPIN_LIMIT; ++spins) {
+            if (attempt()) {
+                return true;
+            }
+        }
+        
+        std::chrono::steady_clock::time_point deadline =
+            std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+        for (;;) {
+            uint32_t remaining = 0;
+            if (timeout_ms != WAIT_FOREVER) {
+                int64_t left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+                if (left <= 0) {
+                    return false;
+                }
+                remaining = static_cast<uint32_t>(left);
+            }
+            
+            sleepers->waiting.fetch_add(1);
+            sleepers->asleep.store(1);
+            bool done = attempt();
+            if (!done) {
+                wake.Wait(1, remaining);
+            }
+            sleepers->waiting.fetch_sub(1);
+            if (done || attempt()) {
+                return true;
+            }
+        }
+    }
+    
+    static void Notify(QueueSleepers* sleepers, SharedWake& wake) {
+        // Orders the cell hand-over before the flag check (see WaitFor)
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleepers->asleep.load(std::memory_order_relaxed) != 0 && sleepers->asleep.exchange(0) != 0) {
+            wake.Wake(sleepers->waiting.load());
+        }
+    }
+};
+
+inline ShmQueue::~ShmQueue() {
+#ifdef _WIN32
+    if (shm_ptr_) {
+        UnmapViewOfFile(shm_ptr_);
+    }
+    if (shm_mapping_) {
+        CloseHandle(shm_mapping_);
+    }
+#else
+    if (shm_ptr_ && shm_ptr_ != MAP_FAILED) {
+        munmap(shm_ptr_, shm_size_);
+    }
+    if (shm_fd_ != -1) {
+        close(shm_fd_);
+    }
+#endif
+}
+
+inline size_t QueueCellSize(size_t max_message_size) {
+    return AlignUp(sizeof(QueueCell) + max_message_size, CACHE_LINE_SIZE);
+}
+
+inline size_t QueueSegmentSize(size_t capacity, size_t max_message_size) {
+    return AlignUp(sizeof(QueueHeader), CACHE_LINE_SIZE) + capacity * QueueCellSize(max_message_size);
+}
+
+// Like ShmTable::Create: O_EXCL picks the creator, and only the header is
+// written, as zeroed cells already make an empty queue
+inline bool ShmQueue::Create(const std::string& shm_name, size_t capacity, size_t max_message_size) {
+    shm_name_ = shm_name;
+    shm_size_ = QueueSegmentSize(capacity, max_message_size);
+#ifdef _WIN32
+    if (!ShmTable::MapNewSegment(shm_name_, shm_size_, HUGE_PAGES_NONE, false, &shm_mapping_, &shm_file_,
+                                 &shm_ptr_)) {
+        return false;
+    }
+#else
+    if (!ShmTable::MapNewSegment(shm_name_, shm_size_, HUGE_PAGES_NONE, false, &shm_fd_, &shm_ptr_)) {
+        return false;
+    }
+#endif
+    
+    is_creator_ = true;
+    header_ = static_cast<QueueHeader*>(shm_ptr_);
+    cells_ = static_cast<char*>(shm_ptr_) + AlignUp(sizeof(QueueHeader), CACHE_LINE_SIZE);
+    header_->layout_version = QUEUE_LAYOUT_VERSION;
+    header_->capacity = capacity;
+    header_->cell_size = QueueCellSize(max_message_size);
+    header_->max_message_size = max_message_size;
+    header_->magic.store(QUEUE_MAGIC, std::memory_order_release);
+    consumers_wake_.Open(&header_->consumers.asleep, shm_name_, false, ":consumers");
+    producers_wake_.Open(&header_->producers.asleep, shm_name_, false, ":producers");
+    return true;
+}
+
+inline bool ShmQueue::Attach(const std::string& shm_name) {
+    shm_name_ = shm_name;
+    bool sole_user = false;
+#ifdef _WIN32
+    if (!ShmTable::MapSegment(shm_name_, false, false, false, &shm_mapping_, &shm_file_, &shm_ptr_, &shm_size_,
+                              &sole_user)) {
+        return false;
+    }
+#else
+    if (!ShmTable::MapSegment(shm_name_, false, false, false, &shm_fd_, &shm_ptr_, &shm_size_, &sole_user)) {
+        return false;
+    }
+#endif
+    
+    header_ = static_cast<QueueHeader*>(shm_ptr_);
+    for (int waited = 0; header_->magic.load(std::memory_order_acquire) != QUEUE_MAGIC; ++waited) {
+        if (waited >= ATTACH_TIMEOUT_MS) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    if (header_->layout_version != QUEUE_LAYOUT_VERSION || header_->capacity == 0 ||
+        (header_->capacity & (header_->capacity - 1)) != 0 ||
+        shm_size_ < QueueSegmentSize(header_->capacity, header_->max_message_size)) {
+        return false;
+    }
+    cells_ = static_cast<char*>(shm_ptr_) + AlignUp(sizeof(QueueHeader), CACHE_LINE_SIZE);
+    
+    // Nobody else has it mapped, so nobody is asleep on it
+    if (sole_user) {
+        header_->consumers.asleep.store(0);
+        header_->consumers.waiting.store(0);
+        header_->producers.asleep.store(0);
+        header_->producers.waiting.store(0);
+#ifndef _WIN32
+        flock(shm_fd_, LOCK_SH);
+#endif
+    }
+    consumers_wake_.Open(&header_->consumers.asleep, shm_name_, false, ":consumers");
+    producers_wake_.Open(&header_->producers.asleep, shm_name_, false, ":producers");
+    return true;
+}
+
+inline bool ShmQueue::Push(const char* data, size_t length, uint32_t timeout_ms) {
+    if (length > header_->max_message_size) {
+        return false;
+    }
+    if (TryPush(data, length)) {
+        return true;
+    }
+    return timeout_ms != 0 && WaitFor(&header_->producers, producers_wake_, timeout_ms, [&]() {
+        return TryPush(data, length);
+    });
+}
+
+inline bool ShmQueue::TryPush(const char* data, size_t length) {
+    uint64_t position = header_->tail.load(std::memory_order_relaxed);
+    for (;;) {
+        QueueCell* cell = Cell(position);
+        int64_t room = static_cast<int64_t>(cell->sequence.load(std::memory_order_acquire) - Lap(position));
+        if (room < 0) {
+            return false;               // last lap's message not popped yet: full
+        }
+        if (room == 0 && header_->tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+            memcpy(reinterpret_cast<char*>(cell + 1), data, length);
+            cell->length = static_cast<uint32_t>(length);
+            cell->sequence.store(Lap(position) + 1, std::memory_order_release);
+            Notify(&header_->consumers, consumers_wake_);
+            return true;
+        }
+        if (room > 0) {
+            position = header_->tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+}  // namespace fast_shm
+
+#endif  // FAST_SHM_TABLE_H
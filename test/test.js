@@ -1,8 +1,26 @@
 'use strict';
 
 const assert = require('assert');
+const fs = require('fs');
+const path = require('path');
 const cache = require('../index.js');
 
+// Handles unlink their segments when they are destroyed, which a run that
+// fails part-way never gets to, and test9 and the rest would then attach
+// to last run's entries. Linux keeps POSIX shared memory in /dev/shm.
+function removeTestSegments() {
+  const dir = '/dev/shm';
+  if (!fs.existsSync(dir)) {
+    return;
+  }
+  for (const name of fs.readdirSync(dir)) {
+    if (/^test\d/.test(name)) {
+      fs.unlinkSync(path.join(dir, name));
+    }
+  }
+}
+
+removeTestSegments();
 console.log('Running fast-shm-cache tests...\n');
 
 // Test 1: Basic set/get operations
@@ -183,4 +201,1029 @@ console.log('Running fast-shm-cache tests...\n');
   console.log('✓ Update existing key works correctly\n');
 }
 
-console.log('All tests passed! ✅'); 
\ No newline at end of file
+// Test 11: Delete leaves probe chains intact
+{
+  console.log('Test 11: Delete leaves probe chains intact');
+  const c = cache({ name: 'test11', maxKeys: 64 });
+  
+  for (let i = 0; i < 48; i++) {
+    assert.strictEqual(c.set(`key${i}`, `value${i}`), true);
+  }
+  
+  // Deleting every other key must not hide entries further down a chain
+  for (let i = 0; i < 48; i += 2) {
+    assert.strictEqual(c.delete(`key${i}`), true);
+  }
+  for (let i = 1; i < 48; i += 2) {
+    assert.strictEqual(c.get(`key${i}`), `value${i}`);
+  }
+  assert.strictEqual(c.size, 24);
+  
+  // Churn through enough deletes to trigger tombstone compaction
+  for (let round = 0; round < 20; round++) {
+    for (let i = 0; i < 16; i++) {
+      assert.strictEqual(c.set(`churn${round}_${i}`, 'x'), true);
+    }
+    for (let i = 0; i < 16; i++) {
+      assert.strictEqual(c.delete(`churn${round}_${i}`), true);
+    }
+  }
+  for (let i = 1; i < 48; i += 2) {
+    assert.strictEqual(c.get(`key${i}`), `value${i}`);
+  }
+  assert.strictEqual(c.get('churn0_0'), undefined);
+  assert.strictEqual(c.has('key0'), false);
+  assert.strictEqual(c.size, 24);
+  
+  console.log('✓ Tombstones keep probe chains intact\n');
+}
+
+// Test 12: Seqlock read mode
+{
+  console.log('Test 12: Seqlock read mode');
+  const writer = cache({ name: 'test12', maxKeys: 32 });
+  const reader = cache({ name: 'test12', maxKeys: 32, readMode: 'seqlock' });
+  
+  assert.throws(() => cache({ name: 'test12', readMode: 'spin' }), /readMode must be/);
+  
+  writer.set('key1', 'value1');
+  assert.strictEqual(reader.get('key1'), 'value1');
+  assert.strictEqual(reader.has('key1'), true);
+  assert.strictEqual(reader.get('missing'), undefined);
+  assert.strictEqual(reader.has('missing'), false);
+  
+  writer.set('key1', 'value2');
+  assert.strictEqual(reader.get('key1'), 'value2');
+  writer.delete('key1');
+  assert.strictEqual(reader.get('key1'), undefined);
+  
+  console.log('✓ Seqlock reads see writes from other handles\n');
+}
+
+// Test 13: Attach uses the creator's layout
+{
+  console.log('Test 13: Attach uses the creator\'s layout');
+  const creator = cache({ name: 'test13', maxKeys: 16 });
+  const attached = cache({ name: 'test13', maxKeys: 4096 });
+  
+  creator.set('key1', 'value1');
+  assert.strictEqual(attached.get('key1'), 'value1');
+  assert.strictEqual(attached.set('key2', 'value2'), true);
+  assert.strictEqual(creator.get('key2'), 'value2');
+  assert.strictEqual(attached.size, 2);
+  
+  console.log('✓ Attaching with a different maxKeys shares the same table\n');
+}
+
+// Test 14: Full table churn
+{
+  console.log('Test 14: Full table churn');
+  const c = cache({ name: 'test14', maxKeys: 40 });
+  
+  for (let i = 0; i < 40; i++) {
+    assert.strictEqual(c.set(`key${i}`, `value${i}`), true);
+  }
+  assert.strictEqual(c.set('overflow', 'x'), false);
+  
+  // Keep the table at its limit while replacing keys many times over
+  for (let i = 40; i < 1000; i++) {
+    assert.strictEqual(c.delete(`key${i - 40}`), true);
+    assert.strictEqual(c.set(`key${i}`, `value${i}`), true);
+    assert.strictEqual(c.get(`key${i - 20}`), `value${i - 20}`);
+    assert.strictEqual(c.get(`key${i - 40}`), undefined);
+  }
+  for (let i = 960; i < 1000; i++) {
+    assert.strictEqual(c.get(`key${i}`), `value${i}`);
+  }
+  assert.strictEqual(c.size, 40);
+  
+  console.log('✓ Probing stays correct at full load\n');
+}
+
+// Test 15: Variable-length values
+{
+  console.log('Test 15: Variable-length values');
+  const c = cache({ name: 'test15', maxKeys: 16, maxValueSize: 64 * 1024, arenaSize: 256 * 1024 });
+  
+  const big = 'b'.repeat(64 * 1024);
+  assert.strictEqual(c.set('big', big), true);
+  assert.strictEqual(c.get('big'), big);
+  assert.strictEqual(c.set('toobig', big + 'x'), false);
+  
+  // Growing and shrinking a value moves it between size classes
+  for (const length of [0, 1, 17, 300, 5000, 40, 0]) {
+    const value = 'v'.repeat(length);
+    assert.strictEqual(c.set('resized', value), true);
+    assert.strictEqual(c.get('resized'), value);
+  }
+  
+  // Embedded NUL bytes survive the round trip
+  assert.strictEqual(c.set('nul', 'a\0b'), true);
+  assert.strictEqual(c.get('nul'), 'a\0b');
+  
+  const entries = new Map(c.entries());
+  assert.strictEqual(entries.get('big'), big);
+  
+  console.log('✓ Values of any size up to maxValueSize round-trip\n');
+}
+
+// Test 16: Arena exhaustion and reuse
+{
+  console.log('Test 16: Arena exhaustion and reuse');
+  const c = cache({ name: 'test16', maxKeys: 64, maxValueSize: 1024, arenaSize: 4096 });
+  const other = cache({ name: 'test16' });
+  const value = 'x'.repeat(1000);
+  
+  let stored = 0;
+  while (c.set(`key${stored}`, value)) {
+    stored++;
+  }
+  assert.ok(stored >= 3 && stored < 64);
+  assert.strictEqual(c.size, stored);
+  assert.strictEqual(c.get(`key${stored}`), undefined);
+  
+  // Freed chunks go back to the shared free lists
+  for (let round = 0; round < 20; round++) {
+    assert.strictEqual(other.delete('key0'), true);
+    assert.strictEqual(c.set('key0', value), true);
+  }
+  assert.strictEqual(other.get('key0'), value);
+  
+  c.clear();
+  for (let i = 0; i < stored; i++) {
+    assert.strictEqual(other.set(`key${i}`, value), true);
+  }
+  
+  console.log('✓ Exhausted arena fails cleanly and freed space is reused\n');
+}
+
+// Test 17: Binary values
+{
+  console.log('Test 17: Binary values');
+  const c = cache({ name: 'test17', maxKeys: 16, maxValueSize: 1024 });
+  
+  const blob = Buffer.from([0x93, 0x00, 0xff, 0xc4, 0x00, 0x01]);
+  assert.strictEqual(c.setBuffer('blob', blob), true);
+  assert.deepStrictEqual(c.getBuffer('blob'), blob);
+  assert.strictEqual(c.getBuffer('missing'), undefined);
+  
+  // getInto fills a caller-owned buffer and reports the length
+  const target = Buffer.alloc(16);
+  assert.strictEqual(c.getInto('blob', target), blob.length);
+  assert.deepStrictEqual(target.subarray(0, blob.length), blob);
+  assert.strictEqual(c.getInto('missing', target), undefined);
+  
+  // Too small a target is left untouched
+  const small = Buffer.alloc(2);
+  assert.strictEqual(c.getInto('blob', small), blob.length);
+  assert.deepStrictEqual(small, Buffer.alloc(2));
+  
+  // Typed arrays and strings share the same storage
+  assert.strictEqual(c.setBuffer('typed', new Uint16Array([1, 2, 3])), true);
+  assert.strictEqual(c.getBuffer('typed').length, 6);
+  c.set('text', 'héllo');
+  assert.deepStrictEqual(c.getBuffer('text'), Buffer.from('héllo'));
+  c.setBuffer('text', Buffer.from('wörld'));
+  assert.strictEqual(c.get('text'), 'wörld');
+  
+  assert.strictEqual(c.setBuffer('big', Buffer.alloc(1025)), false);
+  assert.strictEqual(c.setBuffer('k'.repeat(64), blob), false);
+  assert.strictEqual(c.setBuffer('é'.repeat(40), blob), false);
+  assert.throws(() => c.setBuffer('key', 'not a buffer'), /Value must be a Buffer/);
+  
+  console.log('✓ Buffer get/set copies raw bytes\n');
+}
+
+// Test 18: Batch operations
+{
+  console.log('Test 18: Batch operations');
+  const c = cache({ name: 'test18', maxKeys: 64 });
+  
+  const entries = [];
+  for (let i = 0; i < 40; i++) {
+    entries.push([`key${i}`, i % 2 ? `value${i}` : Buffer.from(`value${i}`)]);
+  }
+  const results = c.mset(entries);
+  assert.strictEqual(results.length, 40);
+  assert(results.every((stored) => stored === true));
+  assert.strictEqual(c.size, 40);
+  
+  const keys = entries.map(([key]) => key).concat(['missing', 'k'.repeat(70)]);
+  const values = c.mget(keys);
+  assert.strictEqual(values.length, 42);
+  for (let i = 0; i < 40; i++) {
+    assert.strictEqual(values[i], `value${i}`);
+  }
+  assert.strictEqual(values[40], undefined);
+  assert.strictEqual(values[41], undefined);
+  
+  // Per-entry results report the ones that didn't fit
+  assert.deepStrictEqual(c.mset(new Map([['ok', 'v'], ['k'.repeat(70), 'v']])), [true, false]);
+  
+  assert.strictEqual(c.mdel(['key0', 'key1', 'key0', 'missing']), 2);
+  assert.deepStrictEqual(c.mget(['key0', 'key1', 'key2']), [undefined, undefined, 'value2']);
+  assert.deepStrictEqual(c.mget([]), []);
+  
+  assert.throws(() => c.mget('key2'), /Keys must be an array/);
+  assert.throws(() => c.mget(['key2', 3]), /Keys must be strings/);
+  assert.throws(() => c.mset([['key', 3]]), /Entries must be/);
+  
+  console.log('✓ mget/mset/mdel match the single-key operations\n');
+}
+
+// Test 19: Eviction
+{
+  console.log('Test 19: Eviction');
+  assert.throws(() => cache({ name: 'test19', eviction: 'random' }), /eviction must be/);
+  
+  // CLOCK gives recently read entries a second chance
+  const clock = cache({ name: 'test19_clock', maxKeys: 32, eviction: 'clock' });
+  clock.set('hot', 'value0');
+  for (let i = 1; i < 200; i++) {
+    assert.strictEqual(clock.get('hot'), 'value0');
+    assert.strictEqual(clock.set(`key${i}`, `value${i}`), true);
+    assert(clock.size <= 32);
+  }
+  assert.strictEqual(clock.size, 32);
+  assert.strictEqual(clock.get('hot'), 'value0');
+  assert.strictEqual(clock.get('key199'), 'value199');
+  assert.strictEqual(clock.get('key1'), undefined);
+  
+  // LRU evicts the least recently read of a sample
+  const lru = cache({ name: 'test19_lru', maxKeys: 32, eviction: 'lru' });
+  for (let i = 0; i < 32; i++) {
+    lru.set(`key${i}`, `value${i}`);
+  }
+  const until = Date.now() + 5;
+  while (Date.now() < until) {}
+  assert.strictEqual(lru.get('key0'), 'value0');
+  for (let i = 32; i < 40; i++) {
+    assert.strictEqual(lru.set(`key${i}`, `value${i}`), true);
+  }
+  assert.strictEqual(lru.size, 32);
+  assert.strictEqual(lru.get('key0'), 'value0');
+  
+  // A full arena evicts entries of the needed size class
+  const arena = cache({ name: 'test19_arena', maxKeys: 64, maxValueSize: 1024, arenaSize: 4096, eviction: 'clock' });
+  const value = 'x'.repeat(1000);
+  for (let i = 0; i < 20; i++) {
+    assert.strictEqual(arena.set(`key${i}`, value), true);
+  }
+  assert(arena.size < 5);
+  assert.strictEqual(arena.get('key19'), value);
+  
+  // Without eviction a full table still rejects writes
+  const none = cache({ name: 'test19_none', maxKeys: 4 });
+  for (let i = 0; i < 4; i++) {
+    none.set(`key${i}`, 'v');
+  }
+  assert.strictEqual(none.set('key4', 'v'), false);
+  
+  console.log('✓ Full caches evict instead of rejecting writes\n');
+}
+
+// Test 20: TTL
+{
+  console.log('Test 20: TTL');
+  const sleep = (ms) => Atomics.wait(new Int32Array(new SharedArrayBuffer(4)), 0, 0, ms);
+  const c = cache({ name: 'test20', maxKeys: 64 });
+  
+  assert.strictEqual(c.set('short', 'value', 30), true);
+  assert.strictEqual(c.setBuffer('buffer', Buffer.from('value'), 30), true);
+  assert.deepStrictEqual(c.mset([['batch', 'value', 30], ['forever', 'value']]), [true, true]);
+  assert.strictEqual(c.set('refreshed', 'old', 30), true);
+  assert.strictEqual(c.set('refreshed', 'new'), true);
+  assert.strictEqual(c.get('short'), 'value');
+  assert.strictEqual(c.size, 5);
+  
+  sleep(50);
+  
+  // Expired entries read as misses and are reclaimed on the spot
+  assert.strictEqual(c.get('short'), undefined);
+  assert.strictEqual(c.has('buffer'), false);
+  assert.deepStrictEqual(c.keys().sort(), ['forever', 'refreshed']);
+  assert.deepStrictEqual(c.mget(['batch', 'forever']), [undefined, 'value']);
+  assert.strictEqual(c.get('refreshed'), 'new');
+  assert.strictEqual(c.size, 2);
+  
+  assert.throws(() => c.set('key', 'value', -1), /ttlMs must be/);
+  
+  // The reaper reclaims entries nobody reads
+  const reaped = cache({ name: 'test20_reaper', maxKeys: 64, reapInterval: 5 });
+  for (let i = 0; i < 20; i++) {
+    reaped.set(`key${i}`, 'value', 20);
+  }
+  reaped.set('kept', 'value');
+  assert.strictEqual(reaped.size, 21);
+  sleep(200);
+  assert.strictEqual(reaped.size, 1);
+  assert.strictEqual(reaped.get('kept'), 'value');
+  
+  console.log('✓ Entries expire lazily and in the background\n');
+}
+
+// Test 21: Online resize
+{
+  console.log('Test 21: Online resize');
+  const c = cache({ name: 'test21', maxKeys: 16 });
+  const other = cache({ name: 'test21', maxKeys: 16 });
+  for (let i = 0; i < 16; i++) {
+    c.set(`key${i}`, `value${i}`);
+  }
+  c.set('ttl', 'value', 10000);
+  assert.strictEqual(c.set('key16', 'value16'), false);
+  
+  assert.strictEqual(c.resize(64), true);
+  assert.strictEqual(c.maxKeys, 64);
+  assert.strictEqual(c.size, 16);
+  assert.strictEqual(c.set('key16', 'value16'), true);
+  
+  // Other handles follow on their next call
+  assert.strictEqual(other.maxKeys, 64);
+  for (let i = 0; i <= 16; i++) {
+    assert.strictEqual(other.get(`key${i}`), `value${i}`);
+  }
+  assert.strictEqual(other.set('key17', 'value17'), true);
+  assert.strictEqual(c.get('key17'), 'value17');
+  
+  // Growing twice, then attaching fresh
+  assert.strictEqual(other.resize(256), true);
+  assert.strictEqual(c.delete('key0'), true);
+  const fresh = cache({ name: 'test21', maxKeys: 16 });
+  assert.strictEqual(fresh.maxKeys, 256);
+  assert.strictEqual(fresh.size, 17);
+  assert.strictEqual(fresh.get('key0'), undefined);
+  assert.strictEqual(fresh.get('key1'), 'value1');
+  assert.deepStrictEqual(fresh.keys().length, 17);
+  
+  assert.strictEqual(c.resize(100), false);
+  assert.throws(() => c.resize(0), /maxKeys must be/);
+  
+  // Moved in slot order, these values fragment the new arena and one is
+  // left over. It stays readable in the old table until a resize that
+  // finds room moves it.
+  const tight = cache({ name: 'test21_tight', maxKeys: 32, maxValueSize: 1024, arenaSize: 4096 });
+  const lengths = { k0: 84, k1: 779, k2: 495, k3: 790, k4: 235, k5: 580, k26: 53, k28: 31, k59: 57 };
+  for (const key of Object.keys(lengths)) {
+    assert.strictEqual(tight.set(key, 'v'.repeat(lengths[key])), true);
+  }
+  assert.throws(() => tight.resize(33), /don't fit/);
+  const follower = cache({ name: 'test21_tight' });
+  for (const key of Object.keys(lengths)) {
+    assert.strictEqual(tight.get(key), 'v'.repeat(lengths[key]));
+    assert.strictEqual(follower.get(key), 'v'.repeat(lengths[key]));
+  }
+  assert.strictEqual(follower.size, 9);
+  assert.strictEqual(tight.delete('k3'), true);
+  assert.strictEqual(tight.resize(33), false);
+  assert.strictEqual(follower.size, 8);
+  assert.strictEqual(follower.get('k1'), 'v'.repeat(779));
+  
+  console.log('✓ Caches grow in place across handles\n');
+}
+
+// Test 22: Shards
+{
+  console.log('Test 22: Shards');
+  const c = cache({ name: 'test22', maxKeys: 400, shards: 4, numa: true });
+  // The creator's shard count wins
+  const other = cache({ name: 'test22', maxKeys: 400, shards: 2 });
+  
+  for (let i = 0; i < 200; i++) {
+    assert.strictEqual(c.set(`key${i}`, `value${i}`), true);
+  }
+  assert.strictEqual(c.size, 200);
+  assert.strictEqual(c.maxKeys, 400);
+  for (let i = 0; i < 200; i++) {
+    assert.strictEqual(other.get(`key${i}`), `value${i}`);
+  }
+  assert.strictEqual(other.keys().length, 200);
+  assert.deepStrictEqual(c.mget(['key0', 'key199', 'missing']), ['value0', 'value199', undefined]);
+  assert.strictEqual(other.delete('key0'), true);
+  assert.strictEqual(c.has('key0'), false);
+  
+  // Each shard grows on its own
+  assert.strictEqual(c.resize(800), true);
+  assert.strictEqual(other.maxKeys, 800);
+  assert.strictEqual(other.size, 199);
+  assert.strictEqual(other.get('key1'), 'value1');
+  
+  other.clear();
+  assert.strictEqual(c.size, 0);
+  
+  assert.throws(() => cache({ name: 'test22_bad', shards: 0 }), /shards must be/);
+  
+  console.log('✓ Sharded caches behave as one\n');
+}
+
+// Test 23: Huge pages and prefaulting
+{
+  console.log('Test 23: Huge pages and prefaulting');
+  const c = cache({ name: 'test23', maxKeys: 4096, hugePages: 'transparent', prefault: true });
+  const other = cache({ name: 'test23', prefault: true });
+  
+  assert.strictEqual(c.set('key', 'value'), true);
+  assert.strictEqual(other.get('key'), 'value');
+  assert.strictEqual(other.maxKeys, 4096);
+  
+  // hugetlbfs needs a mount and reserved pages; without them creation fails cleanly
+  let huge = null;
+  try {
+    huge = cache({ name: 'test23_huge', maxKeys: 1024, hugePages: '2mb' });
+  } catch (err) {
+    assert.match(err.message, /huge pages/);
+  }
+  if (huge) {
+    assert.strictEqual(huge.set('key', 'value'), true);
+    assert.strictEqual(cache({ name: 'test23_huge' }).get('key'), 'value');
+  }
+  
+  assert.throws(() => cache({ name: 'test23_bad', hugePages: '4kb' }), /hugePages must be/);
+  
+  console.log(`✓ Segments map with transparent huge pages and prefaulting${huge ? ' and hugetlbfs' : ''}\n`);
+}
+
+// Test 24: Snapshots and file-backed caches
+{
+  console.log('Test 24: Snapshots and file-backed caches');
+  const os = require('os');
+  const dir = fs.mkdtempSync(path.join(os.tmpdir(), 'fast-shm-cache-'));
+  
+  const c = cache({ name: 'test25', maxKeys: 100, shards: 2 });
+  for (let i = 0; i < 50; i++) {
+    c.set(`key${i}`, `value${i}`);
+  }
+  c.set('short', 'lived', 1);
+  c.setBuffer('bytes', Buffer.from([0, 1, 2, 255]));
+  const file = path.join(dir, 'cache.snap');
+  assert.strictEqual(c.snapshot(file), 52);
+  
+  const copy = cache({ name: 'test25_copy', maxKeys: 100 });
+  const start = Date.now();
+  while (Date.now() - start < 5) {}     // let 'short' expire
+  assert.strictEqual(copy.restore(file), 51);
+  assert.strictEqual(copy.get('key49'), 'value49');
+  assert.deepStrictEqual(copy.getBuffer('bytes'), Buffer.from([0, 1, 2, 255]));
+  assert.strictEqual(copy.has('short'), false);
+  
+  // Corruption is caught before anything is stored
+  const bytes = fs.readFileSync(file);
+  bytes[bytes.length - 1] ^= 1;
+  fs.writeFileSync(file, bytes);
+  assert.throws(() => copy.restore(file), /checksum/);
+  fs.writeFileSync(file, 'not a snapshot at all, just some text');
+  assert.throws(() => copy.restore(file), /Not a cache snapshot/);
+  
+  // A file-backed cache keeps its entries after every handle closes
+  const backing = path.join(dir, 'cache.bin');
+  const first = cache({ name: 'test25_file', file: backing, maxKeys: 100 });
+  assert.strictEqual(first.set('kept', 'across restarts'), true);
+  first.flush();
+  const second = cache({ name: 'test25_file', file: backing });
+  assert.strictEqual(second.get('kept'), 'across restarts');
+  assert.ok(fs.statSync(backing).size > 0);
+  
+  // Warm restart: another process fills a file and exits, then this one
+  // is its sole user and reopens it straight from disk
+  const warm = path.join(dir, 'warm.bin');
+  const script = `const c = require(${JSON.stringify(require.resolve('../index.js'))})` +
+    `({ file: ${JSON.stringify(warm)}, maxKeys: 1000 });` +
+    'for (let i = 0; i < 500; i++) c.set("k" + i, "v" + i); c.flush(); process.exit(0);';
+  require('child_process').execFileSync(process.execPath, ['-e', script]);
+  const reopened = cache({ name: 'test24_warm', file: warm });
+  assert.strictEqual(reopened.size, 500);
+  assert.strictEqual(reopened.get('k499'), 'v499');
+  assert.strictEqual(reopened.set('k500', 'v500'), true);
+  
+  fs.rmSync(dir, { recursive: true, force: true });
+  
+  console.log('✓ Snapshots round-trip and file-backed caches persist\n');
+}
+
+// Test 25: Locks held by dead processes
+{
+  console.log('Test 25: Locks held by dead processes');
+  const c = cache({ name: 'test25_locks', maxKeys: 16, maxValueSize: 1 << 20, lockTimeout: 20 });
+  
+  // Writers killed mid-copy may die holding a slot lock; this handle
+  // must still get every key, whole
+  const script = `const c = require(${JSON.stringify(require.resolve('../index.js'))})` +
+    '({ name: "test25_locks", lockTimeout: 20 });' +
+    'const values = "abcd".split("").map(ch => Buffer.alloc(1 << 20, ch));' +
+    'for (let i = 0; ; i++) c.setBuffer("k" + (i % 4), values[i % 3]);';
+  for (let round = 0; round < 8; round++) {
+    require('child_process').spawnSync(process.execPath, ['-e', script], { timeout: 200, killSignal: 'SIGKILL' });
+    for (let i = 0; i < 4; i++) {
+      const value = c.get(`k${i}`);
+      assert.ok(value === undefined || value === 'parent' || value === value[0].repeat(1 << 20), 'no torn values');
+      assert.strictEqual(c.set(`k${i}`, 'parent'), true);
+      assert.strictEqual(c.get(`k${i}`), 'parent');
+    }
+  }
+  
+  const stats = c.lockStats();
+  assert.strictEqual(typeof stats.timeouts, 'number');
+  assert.strictEqual(typeof stats.recovered, 'number');
+  assert.throws(() => cache({ name: 'test25_bad', lockTimeout: -1 }), /lockTimeout must be/);
+  assert.ok(['futex', 'pthread'].includes(cache.slotLock));
+  
+  console.log(`✓ Locks held by dead processes are taken over (${stats.recovered} recovered)\n`);
+}
+
+// Test 26: Keys with long shared prefixes
+{
+  console.log('Test 26: Keys with long shared prefixes');
+  const c = cache({ name: 'test26', maxKeys: 1000 });
+  
+  // Capacity rounds up to a power of two, but the limit stays maxKeys
+  for (let i = 0; i < 1000; i++) {
+    assert.strictEqual(c.set(`tenant:${1000 + i % 7}:session:${i}`, `v${i}`), true);
+  }
+  assert.strictEqual(c.set('tenant:one:too:many', 'x'), false);
+  assert.strictEqual(c.maxKeys, 1000);
+  for (let i = 0; i < 1000; i++) {
+    assert.strictEqual(c.get(`tenant:${1000 + i % 7}:session:${i}`), `v${i}`);
+    assert.strictEqual(c.has(`tenant:${1000 + i % 7}:session:${i + 1000}`), false);
+  }
+  
+  console.log('✓ Prefixed keys fill the table and stay distinct\n');
+}
+
+// Test 27: Robin Hood probing
+{
+  console.log('Test 27: Robin Hood probing');
+  const c = cache({ name: 'test27', maxKeys: 1000, probing: 'robinhood' });
+  
+  // 1000 keys in 1024 slots: every probe chain crosses groups
+  for (let i = 0; i < 1000; i++) {
+    assert.strictEqual(c.set(`rh${i}`, `v${i}`), true);
+  }
+  for (let i = 0; i < 1000; i++) {
+    assert.strictEqual(c.get(`rh${i}`), `v${i}`);
+    assert.strictEqual(c.has(`miss${i}`), false);
+  }
+  
+  // Churn through deletes and reinserts, which move entries around
+  for (let round = 0; round < 5; round++) {
+    for (let i = round; i < 1000; i += 3) {
+      assert.strictEqual(c.delete(`rh${i}`), true);
+    }
+    for (let i = round; i < 1000; i += 3) {
+      assert.strictEqual(c.set(`rh${i}`, `r${round}:${i}`), true);
+    }
+  }
+  assert.strictEqual(c.size, 1000);
+  assert.strictEqual(c.keys().length, 1000);
+  for (let i = 0; i < 1000; i++) {
+    assert.notStrictEqual(c.get(`rh${i}`), undefined);
+  }
+  
+  // Attaching handles use the creator's strategy
+  const other = cache({ name: 'test27' });
+  assert.strictEqual(other.get('rh999'), c.get('rh999'));
+  assert.throws(() => cache({ name: 'test27_bad', probing: 'cuckoo' }), /probing must be/);
+  
+  console.log('✓ Robin Hood tables find every key at 98% load\n');
+}
+
+// Test 28: Cursor scans
+{
+  console.log('Test 28: Cursor scans');
+  const c = cache({ name: 'test28', maxKeys: 2000, shards: 3 });
+  for (let i = 0; i < 1500; i++) {
+    c.set(i % 3 ? `user:${i}` : `order:${i}`, `v${i}`);
+  }
+  
+  const walk = (count, options) => {
+    const seen = new Map();
+    let cursor = 0;
+    let batches = 0;
+    do {
+      const batch = c.scan(cursor, count, options);
+      assert.ok(batch.entries.length <= count);
+      for (const [key, value] of batch.entries) {
+        seen.set(key, value);
+      }
+      cursor = batch.cursor;
+      batches++;
+    } while (cursor !== 0);
+    return { seen, batches };
+  };
+  
+  const all = walk(64);
+  assert.strictEqual(all.seen.size, 1500);
+  assert.ok(all.batches >= 1500 / 64);
+  assert.strictEqual(all.seen.get('user:1'), 'v1');
+  
+  const orders = walk(10, { prefix: 'order:' });
+  assert.strictEqual(orders.seen.size, 500);
+  for (const key of orders.seen.keys()) {
+    assert.ok(key.startsWith('order:'));
+  }
+  assert.strictEqual(walk(1000, { prefix: 'nobody:' }).seen.size, 0);
+  
+  // Entries present throughout survive a resize between batches
+  let cursor = 0;
+  const seen = new Set();
+  for (let i = 0; cursor !== 0 || i === 0; i++) {
+    const batch = c.scan(cursor, 50);
+    batch.entries.forEach(([key]) => seen.add(key));
+    cursor = batch.cursor;
+    if (i === 5) {
+      assert.strictEqual(c.resize(4000), true);
+    }
+  }
+  assert.strictEqual(seen.size, 1500);
+  
+  assert.throws(() => c.scan(-1), /cursor must be/);
+  assert.throws(() => c.scan(0, 0), /count must be/);
+  assert.throws(() => c.scan(0, 10, { prefix: 5 }), /prefix must be/);
+  
+  console.log(`✓ scan() walks ${all.batches} batches and filters by prefix natively\n`);
+}
+
+// Test 29: Lazy layout and async creation
+async function testAsyncCreation() {
+  console.log('Test 29: Lazy layout and async creation');
+  
+  // Zeroed memory is a valid empty table, so creating one only touches
+  // the header and the slots actually written
+  const lazy = cache({ name: 'test24_lazy', maxKeys: 200000 });
+  assert.strictEqual(lazy.set('key', 'value'), true);
+  assert.strictEqual(cache({ name: 'test24_lazy' }).get('key'), 'value');
+  if (cache.slotLock === 'futex' && fs.existsSync('/dev/shm/test24_lazy')) {
+    const stat = fs.statSync('/dev/shm/test24_lazy');
+    assert.ok(stat.blocks * 512 < stat.size / 4, 'fresh segment should be mostly unallocated');
+  }
+  
+  const c = await cache.createCacheAsync({ name: 'test24', maxKeys: 20000, prefault: true });
+  assert.strictEqual(c.set('key', 'value'), true);
+  const other = await cache.createCacheAsync({ name: 'test24', prefault: true });
+  assert.strictEqual(other.get('key'), 'value');
+  assert.strictEqual(other.maxKeys, 20000);
+  if (fs.existsSync('/dev/shm/test24')) {
+    const stat = fs.statSync('/dev/shm/test24');
+    assert.ok(stat.blocks * 512 >= stat.size, 'prefaulted segment should be fully allocated');
+  }
+  
+  await assert.rejects(cache.createCacheAsync({ name: 'test24_bad', shards: 0 }), /shards must be/);
+  
+  console.log('✓ Caches start empty without initialization and open asynchronously\n');
+}
+
+// Test 30: Bulk operations off the JS thread
+async function testAsyncBulk() {
+  console.log('Test 30: Bulk operations off the JS thread');
+  const c = cache({ name: 'test29', maxKeys: 5000, shards: 2 });
+  for (let i = 0; i < 3000; i++) {
+    c.set(`bulk${i}`, `v${i}`);
+  }
+  
+  const keys = await c.keysAsync();
+  assert.deepStrictEqual(keys.slice().sort(), c.keys().sort());
+  assert.strictEqual(keys.length, 3000);
+  const entries = await c.entriesAsync();
+  assert.strictEqual(entries.length, 3000);
+  for (const [key, value] of entries) {
+    assert.strictEqual(value, `v${key.slice(4)}`);
+  }
+  
+  // The JS thread keeps using the handle while a scan runs
+  const pending = c.keysAsync();
+  assert.strictEqual(c.set('during', 'scan'), true);
+  assert.strictEqual(c.get('bulk7'), 'v7');
+  assert.ok((await pending).length >= 3000);
+  
+  await c.clearAsync();
+  assert.strictEqual(c.size, 0);
+  assert.deepStrictEqual(await c.keysAsync(), []);
+  assert.strictEqual(c.set('after', 'clear'), true);
+  assert.deepStrictEqual(await c.entriesAsync(), [['after', 'clear']]);
+  
+  console.log('✓ keysAsync, entriesAsync and clearAsync match their synchronous versions\n');
+}
+
+// Test 31: Atomic read-modify-write
+async function testAtomicUpdates() {
+  console.log('Test 31: Atomic read-modify-write');
+  const { Worker } = require('worker_threads');
+  const c = cache({ name: 'test31', maxKeys: 100, maxValueSize: 64 });
+  
+  assert.strictEqual(c.incrBy('hits'), 1);
+  assert.strictEqual(c.incrBy('hits', 41), 42);
+  assert.strictEqual(c.get('hits'), '42');
+  assert.strictEqual(c.incrBy('hits', -50), -8);
+  c.set('hits', '100');
+  assert.strictEqual(c.incrBy('hits', 5), 105);
+  c.set('word', 'abc');
+  assert.strictEqual(c.incrBy('word', 1), undefined);
+  assert.strictEqual(c.get('word'), 'abc');
+  c.set('big', String(Number.MAX_SAFE_INTEGER));
+  assert.strictEqual(c.incrBy('big', 1), undefined);
+  assert.throws(() => c.incrBy('hits', 1.5), /delta must be/);
+  
+  // A counter keeps the expiry it was created with
+  assert.strictEqual(c.incrBy('window', 1, 50), 1);
+  assert.strictEqual(c.incrBy('window', 1, 60000), 2);
+  await new Promise(resolve => setTimeout(resolve, 80));
+  assert.strictEqual(c.get('window'), undefined);
+  assert.strictEqual(c.incrBy('window', 1), 1);
+  
+  assert.strictEqual(c.compareAndSet('state', undefined, 'open'), true);
+  assert.strictEqual(c.compareAndSet('state', undefined, 'again'), false);
+  assert.strictEqual(c.compareAndSet('state', 'closed', 'half'), false);
+  assert.strictEqual(c.compareAndSet('state', 'open', 'closed'), true);
+  assert.strictEqual(c.get('state'), 'closed');
+  assert.strictEqual(c.compareAndSet('missing', 'x', 'y'), false);
+  assert.strictEqual(c.has('missing'), false);
+  
+  assert.strictEqual(c.getOrSet('config', 'first'), 'first');
+  assert.strictEqual(c.getOrSet('config', 'second'), 'first');
+  assert.strictEqual(c.getOrSet('toolong', 'x'.repeat(65)), undefined);
+  
+  // Counts from several threads add up exactly
+  const script = `
+    const { parentPort } = require('worker_threads');
+    const c = require(${JSON.stringify(require.resolve('../index.js'))})({ name: 'test31' });
+    for (let i = 0; i < 5000; i++) c.incrBy('shared');
+    parentPort.postMessage(c.getOrSet('winner', String(Math.random())));
+  `;
+  const winners = await Promise.all([0, 1, 2, 3].map(() => new Promise((resolve, reject) => {
+    const worker = new Worker(script, { eval: true });
+    worker.once('message', resolve);
+    worker.once('error', reject);
+  })));
+  assert.strictEqual(c.get('shared'), '20000');
+  assert.strictEqual(new Set(winners).size, 1);
+  assert.strictEqual(c.get('winner'), winners[0]);
+  
+  console.log('✓ incrBy, compareAndSet and getOrSet are atomic across threads\n');
+}
+
+// Test 32: Typed values
+async function testTypedValues() {
+  console.log('Test 32: Typed values');
+  const counters = cache({ name: 'test32', maxKeys: 1000, valueType: 'int64' });
+  assert.strictEqual(counters.valueType, 'int64');
+  
+  assert.strictEqual(counters.set('big', 2n ** 62n), true);
+  assert.strictEqual(counters.get('big'), 2n ** 62n);
+  assert.strictEqual(counters.set('small', -5), true);
+  assert.strictEqual(counters.get('small'), -5n);
+  assert.strictEqual(counters.incrBy('small', 7), 2n);
+  assert.strictEqual(counters.incrBy('fresh', 3n), 3n);
+  assert.strictEqual(counters.incrBy('big', 2n ** 62n), undefined);
+  assert.strictEqual(counters.get('big'), 2n ** 62n);
+  assert.strictEqual(counters.compareAndSet('small', 2n, 10n), true);
+  assert.strictEqual(counters.getOrSet('small', 0n), 10n);
+  assert.deepStrictEqual(counters.mget(['fresh', 'none']), [3n, undefined]);
+  assert.throws(() => counters.set('bad', '1'), TypeError);
+  assert.throws(() => counters.set('bad', 1.5), TypeError);
+  assert.throws(() => counters.set('bad', 2n ** 64n), RangeError);
+  assert.throws(() => counters.mset([['bad', 'x']]), TypeError);
+  assert.strictEqual(counters.has('bad'), false);
+  
+  const expected = [['big', 2n ** 62n], ['fresh', 3n], ['small', 10n]];
+  const byKey = (a, b) => (a[0] < b[0] ? -1 : 1);
+  assert.deepStrictEqual(counters.entries().sort(byKey), expected);
+  assert.deepStrictEqual(counters.scan(0, 10).entries.sort(byKey), expected);
+  assert.deepStrictEqual((await counters.entriesAsync()).sort(byKey), expected);
+  
+  // Attaching takes the creator's type
+  const attached = cache({ name: 'test32' });
+  assert.strictEqual(attached.valueType, 'int64');
+  assert.strictEqual(attached.get('fresh'), 3n);
+  
+  const gauges = cache({ name: 'test32f', maxKeys: 1000, valueType: 'float64' });
+  assert.strictEqual(gauges.set('load', 0.25), true);
+  assert.strictEqual(gauges.incrBy('load', 0.5), 0.75);
+  assert.strictEqual(gauges.get('load'), 0.75);
+  assert.throws(() => gauges.set('load', 1n), TypeError);
+
+  // No call stores another width, so shorten the slot's value_length (40
+  // bytes before its key) in the segment itself; incrBy must leave it be
+  const narrow = cache({ name: 'test32w', maxKeys: 64, valueType: 'int64' });
+  narrow.set('narrow', 5n);
+  const segment = fs.readFileSync('/dev/shm/test32w');
+  const lengthAt = segment.indexOf('narrow\0') - 40;
+  assert.strictEqual(segment.readUInt32LE(lengthAt), 8);
+  const patch = Buffer.alloc(4);
+  const fd = fs.openSync('/dev/shm/test32w', 'r+');
+  patch.writeUInt32LE(4);
+  fs.writeSync(fd, patch, 0, 4, lengthAt);
+  assert.strictEqual(narrow.incrBy('narrow', 1n), undefined);
+  patch.writeUInt32LE(8);
+  fs.writeSync(fd, patch, 0, 4, lengthAt);
+  fs.closeSync(fd);
+  assert.strictEqual(narrow.get('narrow'), 5n);
+
+  // No arena behind the slots
+  const strings = cache({ name: 'test32s', maxKeys: 1000, maxValueSize: 8 });
+  assert.ok(fs.statSync('/dev/shm/test32').size < fs.statSync('/dev/shm/test32s').size);
+  assert.throws(() => cache({ name: 'test32x', valueType: 'int32' }), TypeError);
+  
+  console.log('✓ int64 and float64 values live in the slot\n');
+}
+
+// Test 33: Watching for changes
+async function testWatch() {
+  console.log('Test 33: Watching for changes');
+  const c = cache({ name: 'test33', maxKeys: 1000, shards: 2 });
+  const other = cache({ name: 'test33' });
+  const next = (target) => new Promise((resolve) => {
+    const stop = c.watch(target, (keys) => {
+      stop();
+      resolve(keys);
+    });
+  });
+  
+  const config = next('config');
+  other.set('unrelated', 'x');
+  other.set('config', 'v1');
+  other.set('config', 'v2');
+  assert.deepStrictEqual(await config, ['config']);
+  
+  const flags = next({ prefix: 'flag:' });
+  other.mset([['flag:a', '1'], ['flag:b', '1'], ['flag:a', '0']]);
+  other.delete('config');
+  assert.deepStrictEqual((await flags).sort(), ['flag:a', 'flag:b']);
+  
+  const deleted = next('flag:b');
+  assert.strictEqual(other.compareAndSet('flag:b', 'wrong', '2'), false);
+  other.delete('flag:b');
+  assert.deepStrictEqual(await deleted, ['flag:b']);
+  
+  const cleared = next('config');
+  other.clear();
+  assert.strictEqual(await cleared, null);
+  
+  assert.throws(() => c.watch(42, () => {}), TypeError);
+  assert.throws(() => c.watch('config'), TypeError);
+  
+  console.log('✓ watch() reports other handles\' writes, coalesced\n');
+}
+
+// Test 34: Message queues
+async function testQueue() {
+  console.log('Test 34: Message queues');
+  const { Worker } = require('worker_threads');
+  const q = cache.createQueue({ name: 'test34', capacity: 3, maxMessageSize: 16 });
+  assert.strictEqual(q.capacity, 4);
+  assert.strictEqual(q.maxMessageSize, 16);
+  assert.strictEqual(q.pop(), undefined);
+  assert.deepStrictEqual(q.popBatch(10), []);
+  
+  // First in, first out, with a bounded wait at either end
+  assert.strictEqual(q.push('one'), true);
+  assert.strictEqual(q.push(Buffer.from([1, 2, 3])), true);
+  assert.strictEqual(q.push(new Uint8Array(0)), true);
+  assert.strictEqual(q.push('four'), true);
+  assert.strictEqual(q.size(), 4);
+  const start = Date.now();
+  assert.strictEqual(q.push('five', 20), false);
+  assert.ok(Date.now() - start >= 15);
+  assert.strictEqual(q.pop().toString(), 'one');
+  assert.deepStrictEqual(q.pop(), Buffer.from([1, 2, 3]));
+  const rest = q.popBatch(10);
+  assert.deepStrictEqual(rest.map(String), ['', 'four']);
+  assert.strictEqual(q.pop(20), undefined);
+  assert.strictEqual(q.size(), 0);
+  
+  assert.throws(() => q.push('x'.repeat(17)), RangeError);
+  assert.throws(() => q.push(42), TypeError);
+  assert.throws(() => q.pop(-1), TypeError);
+  assert.throws(() => q.popBatch(0), TypeError);
+  assert.throws(() => cache.createQueue({ name: 'test34x', capacity: 0 }), RangeError);
+  
+  // Every message from every producer arrives exactly once, through a
+  // queue small enough that both ends block
+  const script = `
+    const { parentPort, workerData } = require('worker_threads');
+    const q = require(${JSON.stringify(require.resolve('../index.js'))}).createQueue({ name: 'test34' });
+    if (workerData.producer) {
+      const message = Buffer.alloc(4);
+      for (let i = 0; i < 2000; i++) {
+        message.writeUInt32LE(workerData.producer * 10000 + i);
+        q.push(message, Infinity);
+      }
+      parentPort.postMessage([]);
+    } else {
+      const seen = [];
+      while (seen.length < 2000) {
+        for (const message of q.popBatch(Math.min(64, 2000 - seen.length), Infinity)) seen.push(message.readUInt32LE());
+      }
+      parentPort.postMessage(seen);
+    }
+  `;
+  const results = await Promise.all([{ producer: 1 }, { producer: 2 }, {}, {}].map((workerData) => {
+    return new Promise((resolve, reject) => {
+      const worker = new Worker(script, { eval: true, workerData });
+      worker.once('message', resolve);
+      worker.once('error', reject);
+    });
+  }));
+  const received = [].concat(...results);
+  assert.strictEqual(new Set(received).size, 4000);
+  for (const seen of results) {
+    for (const producer of [1, 2]) {
+      const own = seen.filter(n => Math.floor(n / 10000) === producer);
+      assert.deepStrictEqual(own, own.slice().sort((a, b) => a - b));
+    }
+  }
+  
+  console.log('✓ createQueue() passes messages between threads in order\n');
+}
+
+// Test 35: Stats
+async function testStats() {
+  console.log('Test 35: Stats');
+  const c = cache({ name: 'test35', maxKeys: 100, maxValueSize: 16, latencySampling: 1 });
+  const other = cache({ name: 'test35' });
+  
+  for (let i = 0; i < 50; i++) {
+    c.set(`key${i}`, 'value');
+  }
+  assert.strictEqual(c.set('big', 'x'.repeat(17)), false);
+  for (let i = 0; i < 10; i++) {
+    c.delete(`key${i}`);
+  }
+  assert.strictEqual(c.get('key20'), 'value');
+  assert.strictEqual(c.has('key5'), false);
+  assert.strictEqual(c.incrBy('counter'), 1);
+  
+  const stats = c.stats();
+  assert.strictEqual(stats.hits, 1);
+  assert.strictEqual(stats.misses, 1);
+  assert.strictEqual(stats.sets, 51);
+  assert.strictEqual(stats.setFailures, 1);
+  assert.strictEqual(stats.evictions, 0);
+  assert.ok(stats.avgProbe >= 1 && stats.maxProbe >= 1);
+  assert.strictEqual(stats.loadFactor, 41 / 100);
+  assert.ok(stats.tombstoneRatio > 0);
+  assert.strictEqual(stats.latency.set.samples, 52);
+  assert.strictEqual(stats.latency.delete.samples, 10);
+  const { p50, p99, max, histogram } = stats.latency.get;
+  assert.ok(p50 > 0 && p50 <= p99 && histogram.length >= 1);
+  assert.ok(max > 0 && max <= p99);
+  
+  // Counts are per handle; occupancy is the table's
+  const seen = other.stats();
+  assert.strictEqual(seen.sets, 0);
+  assert.strictEqual(seen.loadFactor, stats.loadFactor);
+  assert.strictEqual(seen.latency, undefined);
+  
+  const lru = cache({ name: 'test35e', maxKeys: 10, eviction: 'lru' });
+  for (let i = 0; i < 20; i++) {
+    lru.set(`key${i}`, 'value');
+  }
+  assert.strictEqual(lru.stats().evictions, 10);
+  assert.throws(() => cache({ name: 'test35x', latencySampling: -1 }), TypeError);
+  
+  console.log('✓ stats() counts hits, misses, sets and latencies\n');
+}
+
+// Test 36: Read-only handles
+async function testReadOnly() {
+  console.log('Test 36: Read-only handles');
+  const writer = cache({ name: 'test36', maxKeys: 64, shards: 2, eviction: 'lru' });
+  for (let i = 0; i < 20; i++) {
+    writer.set(`key${i}`, `value${i}`);
+  }
+  writer.set('brief', 'value', 1);
+  const reader = cache({ name: 'test36', readOnly: true });
+  
+  assert.strictEqual(reader.get('key3'), 'value3');
+  assert.strictEqual(reader.has('key4'), true);
+  assert.deepStrictEqual(reader.mget(['key5', 'missing']), ['value5', undefined]);
+  writer.set('key3', 'updated');
+  assert.strictEqual(reader.get('key3'), 'updated');
+  
+  await new Promise((resolve) => setTimeout(resolve, 5));
+  assert.strictEqual(reader.get('brief'), undefined);
+  assert.strictEqual(reader.keys().length, 20);
+  assert.strictEqual((await reader.entriesAsync()).length, 20);
+  assert.strictEqual(reader.scan(0, 100, { prefix: 'key1' }).entries.length, 11);
+  assert.strictEqual(reader.size, 21);
+  
+  assert.throws(() => reader.set('key1', 'value'), /read-only/);
+  assert.throws(() => reader.delete('key1'), /read-only/);
+  assert.throws(() => reader.incrBy('counter'), /read-only/);
+  assert.throws(() => reader.clear(), /read-only/);
+  assert.throws(() => reader.watch('key1', () => {}), /read-only/);
+  assert.strictEqual(writer.get('key1'), 'value1');
+  
+  assert.throws(() => cache({ name: 'test36missing', readOnly: true }), /Failed to attach read-only/);
+  assert.throws(() => cache({ name: 'test36', readOnly: 1 }), /readOnly must be a boolean/);
+  assert.throws(() => cache({ name: 'test36', readOnly: true, reapInterval: 10 }), /reapInterval/);
+  
+  console.log('✓ Read-only handles read without writing\n');
+}
+
+testAsyncCreation().then(testAsyncBulk).then(testAtomicUpdates).then(testTypedValues).then(testWatch).then(testQueue)
+  .then(testStats).then(testReadOnly).then(() => {
+  console.log('All tests passed! ✅');
+}, (err) => {
+  console.error(err);
+  removeTestSegments();
+  process.exit(1);
+}); 
\ No newline at end of file